@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <mutex>
+#include <ostream>
+
+namespace engine {
+namespace util {
+
+/**
+ * \brief The size of the first block an Arena takes from the heap. Later blocks are larger.
+ */
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+/**
+ * \brief Allocations of at least this many bytes bypass the blocks of an Arena.
+ *
+ * Vectors that keep growing would otherwise leave every old buffer behind, which for the
+ * points of a large mesh means several times its size.
+ */
+#define ARENA_LARGE_SIZE (1 << 20)
+
+/**
+ * \brief A memory resource for allocations that all die at the same time, such as the
+ * geometry of a single render.
+ *
+ * Small allocations bump a pointer in a block & are only released when the arena is
+ * destroyed, so deallocating them does nothing. Allocations are serialized with a lock so
+ * containers in the arena can grow on the threads of a ThreadPool.
+ *
+ * The arena must outlive everything allocated in it.
+ */
+class Arena : public std::pmr::memory_resource {
+public:
+	struct Stats {
+		// Calls to allocate() & the amount of bytes requested.
+		size_t allocations = 0;
+		size_t bytes = 0;
+		// Bytes of small allocations given back before the arena is destroyed, e.g. when a
+		// vector grows. These can't be reused.
+		size_t bytes_abandoned = 0;
+		// Allocations that bypassed the blocks.
+		size_t large_allocations = 0;
+		// Blocks taken from the heap & their total size.
+		size_t blocks = 0;
+		size_t block_bytes = 0;
+	};
+
+private:
+	/**
+	 * \brief Counts the blocks taken from the heap.
+	 */
+	class Upstream : public std::pmr::memory_resource {
+		Stats &stats;
+
+		void *do_allocate(size_t bytes, size_t alignment) override;
+		void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+		bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+	public:
+		Upstream(Stats &stats) : stats(stats) {}
+	};
+
+	Stats stats;
+	Upstream upstream;
+	std::pmr::monotonic_buffer_resource blocks;
+	std::mutex lock;
+
+	void *do_allocate(size_t bytes, size_t alignment) override;
+	void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+public:
+	Arena();
+
+	Arena(const Arena &) = delete;
+
+	Arena &operator=(const Arena &) = delete;
+
+	Stats get_stats();
+};
+
+std::ostream &operator<<(std::ostream &out, const Arena::Stats &stats);
+
+}
+}
@@ -68,6 +68,36 @@ struct cgengine_color8 {
 	uint8_t b, g, r;
 };
 
+/**
+ * \brief Counters gathered while drawing to a framebuffer.
+ */
+struct cgengine_stats {
+	/**
+	 * \brief Amount of triangles skipped because they were hidden entirely.
+	 *
+	 * A triangle that spans multiple tiles is counted once for each tile it is hidden in.
+	 */
+	size_t occluded_triangles;
+	/**
+	 * \brief Amount of times a pixel was written to the depth buffer.
+	 */
+	size_t pixel_writes;
+	/**
+	 * \brief Amount of pixels covered by a triangle.
+	 *
+	 * pixel_writes divided by this gives the average overdraw.
+	 */
+	size_t pixels_covered;
+	/**
+	 * \brief Amount of point light shadow maps reused from previous draws.
+	 */
+	size_t shadow_cache_hits;
+	/**
+	 * \brief Amount of point light shadow maps that had to be built.
+	 */
+	size_t shadow_cache_misses;
+};
+
 /**
  * \brief Create a new rendering context.
  *
@@ -99,6 +129,58 @@ void cgengine_context_move_camera(
 	const struct cgengine_vector3d *dir
 );
 
+/**
+ * \brief Set the amount of threads to use while drawing.
+ *
+ * 0 means "as many as there are cores", which is the default. The CGENGINE_THREADS
+ * environment variable overrides this value.
+ */
+void cgengine_context_set_threads(struct cgengine_context *, unsigned int threads);
+
+/**
+ * \brief Enable or disable drawing triangles from front to back.
+ *
+ * This reduces overdraw, but triangles at exactly the same depth may be drawn in a
+ * different order. It is disabled by default.
+ */
+void cgengine_context_set_front_to_back(struct cgengine_context *, int enable);
+
+/**
+ * \brief Add a point light to a context.
+ *
+ * Like shapes, the position is relative to the camera at the time it is added.
+ */
+void cgengine_context_add_point_light(
+	struct cgengine_context *,
+	const struct cgengine_point3d *pos,
+	const struct cgengine_color *diffuse,
+	const struct cgengine_color *specular
+);
+
+/**
+ * \brief Remove all lights in a context.
+ */
+void cgengine_context_clear_lights(struct cgengine_context *);
+
+/**
+ * \brief Enable or disable shadows of point lights.
+ *
+ * Only shapes added after enabling shadows cast shadows.
+ *
+ * Shadow maps are kept between draws and are reused if the light, camera, shapes and mask
+ * are the same.
+ *
+ * \param mask Size of the shadow maps. 0 disables shadows.
+ */
+void cgengine_context_set_shadows(struct cgengine_context *, unsigned int mask);
+
+/**
+ * \brief Set the radius of the percentage-closer filter used for shadows.
+ *
+ * \param radius Half the width of the filter in texels, up to 3. 0 gives hard shadows.
+ */
+void cgengine_context_set_shadow_filter(struct cgengine_context *, unsigned int radius);
+
 /**
  * \brief Add a face shape to a context to be rendered.
  */
@@ -162,6 +244,14 @@ void cgengine_framebuffer_clear(
 	const struct cgengine_color8 *bg
 );
 
+/**
+ * \brief Get the counters of all draws since the framebuffer was created or last cleared.
+ */
+void cgengine_framebuffer_get_stats(
+	const struct cgengine_framebuffer *fb,
+	struct cgengine_stats *stats
+);
+
 /**
  * \brief Try to load a face shape from a file.
  *
@@ -309,6 +399,12 @@ public:
 	void clear(const Color8 &clr) {
 		cgengine_framebuffer_clear(fb, &clr);
 	}
+
+	struct cgengine_stats stats() const {
+		struct cgengine_stats s;
+		cgengine_framebuffer_get_stats(fb, &s);
+		return s;
+	}
 };
 
 class Material {
@@ -408,6 +504,30 @@ public:
 		cgengine_context_set_camera(ctx, fov, aspect, near, far);
 	}
 
+	void set_threads(unsigned int threads) {
+		cgengine_context_set_threads(ctx, threads);
+	}
+
+	void set_front_to_back(bool enable) {
+		cgengine_context_set_front_to_back(ctx, enable);
+	}
+
+	void add_point_light(const Point3D &position, const Color &diffuse, const Color &specular) {
+		cgengine_context_add_point_light(ctx, &position, &diffuse, &specular);
+	}
+
+	void clear_lights() {
+		cgengine_context_clear_lights(ctx);
+	}
+
+	void set_shadows(unsigned int mask) {
+		cgengine_context_set_shadows(ctx, mask);
+	}
+
+	void set_shadow_filter(unsigned int radius) {
+		cgengine_context_set_shadow_filter(ctx, radius);
+	}
+
 	void add_shape(const FaceShape &shape, const Material &mat, const Isometry3D &iso, double scale, int flags) {
 		cgengine_context_add_face_shape(ctx, shape.shape, mat.mat, &iso, scale, flags);
 	}
@@ -19,6 +19,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <iostream>
 #include "math/point3d.h"
@@ -158,6 +160,29 @@ namespace img
 			 */
 			unsigned int get_height() const;
 
+			/**
+			 * \brief Returns the image as a complete BMP file
+			 *
+			 * \return a view of the internal buffer, which is valid until the image is
+			 * modified, moved or destroyed
+			 */
+			std::string_view bmp_file() const;
+
+			/**
+			 * \brief Returns the rows of the image as they are stored in a BMP file
+			 *
+			 * \return a view of the internal buffer, which is valid until the image is
+			 * modified, moved or destroyed
+			 */
+			std::string_view bmp_pixels() const;
+
+			/**
+			 * \brief Returns the header of a BMP file of the given size
+			 *
+			 * Together with bmp_pixels() this allows writing an image in parts.
+			 */
+			static std::string bmp_file_header(unsigned int width, unsigned int height);
+
 			/**
 			 * \brief Function operator. This operator returns a reference to a particular pixel of the image.
 			 *
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "easy_image.h"
+
+namespace engine {
+
+enum ImageFormat {
+	IMAGE_BMP,
+	IMAGE_QOI,
+};
+
+/**
+ * \brief Look up a format by its name, which is the same as its file extension.
+ *
+ * \return false if the name is unknown.
+ */
+bool image_format_from_name(const std::string &name, ImageFormat &format);
+
+/**
+ * \brief The file extension of a format, without a dot.
+ */
+const char *image_format_extension(ImageFormat format);
+
+/**
+ * \brief Encodes a QOI file a few rows at a time.
+ */
+class QoiEncoder {
+	// Alpha is always 255, so only RGB needs to be tracked.
+	struct Rgb {
+		unsigned char r, g, b;
+		bool valid;
+	};
+
+	Rgb index[64] = {};
+	unsigned char pr = 0, pg = 0, pb = 0;
+	unsigned int run = 0;
+
+public:
+	/**
+	 * \brief Append the header of a QOI file.
+	 */
+	static void header(unsigned int width, unsigned int height, std::vector<char> &out);
+
+	/**
+	 * \brief Append all rows of an image, from the top row to the bottom row.
+	 */
+	void rows(const img::EasyImage &image, std::vector<char> &out);
+
+	/**
+	 * \brief Append the last run & the end marker.
+	 */
+	void finish(std::vector<char> &out);
+};
+
+/**
+ * \brief Encode an image as a QOI file.
+ *
+ * QOI is lossless and encodes about as fast as the pixels can be read, while renders with large
+ * areas of the same color shrink by an order of magnitude.
+ *
+ * See https://qoiformat.org/qoi-specification.pdf
+ */
+std::vector<char> encode_qoi(const img::EasyImage &image);
+
+/**
+ * \brief Write an image to a file with as few copies as possible.
+ *
+ * BMP files are written straight from the buffer of the image. The image is written to a
+ * temporary file first, which replaces the file at path once it is complete.
+ *
+ * Throws std::system_error if the file can't be written.
+ */
+void write_image(const std::string &path, const img::EasyImage &image, ImageFormat format);
+
+/**
+ * \brief Writes an image one band of rows at a time, so the whole image never has to be in
+ * memory.
+ *
+ * BMP bands are written in place with pwrite(2) and may come in any order. QOI bands must
+ * come from the top of the image to the bottom.
+ *
+ * Like write_image(), the bands go to a temporary file. It only replaces the file at path
+ * when close() is called & is removed if the stream is destroyed before that.
+ *
+ * Throws std::system_error if the file can't be written.
+ */
+class ImageStream {
+	// Declared before fd, as opening it sets tmp.
+	std::string path, tmp;
+	int fd;
+	ImageFormat format;
+	unsigned int width, height;
+	// Bottom row of the last band, to check that QOI bands are in order.
+	unsigned int next_top;
+	size_t row_size;
+	QoiEncoder qoi;
+	std::vector<char> buffer;
+
+public:
+	ImageStream(const std::string &path, unsigned int width, unsigned int height, ImageFormat format);
+
+	ImageStream(const ImageStream &) = delete;
+
+	ImageStream &operator=(const ImageStream &) = delete;
+
+	~ImageStream();
+
+	/**
+	 * \brief Write a band of rows with the same width as the image.
+	 *
+	 * \param y The row of the image the bottom row of the band ends up at.
+	 */
+	void write(const img::EasyImage &band, unsigned int y);
+
+	/**
+	 * \brief Finish & close the file.
+	 */
+	void close();
+};
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <ostream>
+
+namespace engine {
+
+/**
+ * \brief The stream progress messages are written to.
+ *
+ * Every thread has its own stream, which is std::cout unless changed with set_log_stream().
+ */
+std::ostream &log_stream();
+
+/**
+ * \brief Set the stream progress messages of the calling thread are written to.
+ *
+ * \param out The stream to use or nullptr to use std::cout again.
+ */
+void set_log_stream(std::ostream *out);
+
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace engine {
+namespace util {
+
+/**
+ * \brief A read-only view of a whole file mapped into memory.
+ *
+ * This avoids copying the file into buffers, which matters for large meshes & images.
+ */
+class MappedFile {
+	const char *ptr = nullptr;
+	size_t len = 0;
+
+public:
+	/**
+	 * \brief Map the file at the given path.
+	 *
+	 * Throws std::system_error if the file can't be opened or mapped.
+	 *
+	 * \param sequential Whether the file will be read front to back once. Otherwise the whole
+	 * file is read ahead as it is expected to be accessed randomly.
+	 */
+	explicit MappedFile(const std::string &path, bool sequential = true);
+
+	MappedFile(const MappedFile &) = delete;
+
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	~MappedFile();
+
+	const char *data() const {
+		return ptr;
+	}
+
+	size_t size() const {
+		return len;
+	}
+
+	std::string_view view() const {
+		return { ptr, len };
+	}
+};
+
+}
+}
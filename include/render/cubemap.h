@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include "easy_image.h"
+#include "math/matrix4d.h"
+#include "math/point3d.h"
+#include "math/vector3d.h"
+#include "render/color.h"
+#include "render/texture.h"
+
+namespace engine {
+namespace render {
+
+/**
+ * \brief A skybox around the origin, stored as six separate faces.
+ *
+ * The faces are copied out of an image with the faces laid out as a cross:
+ *
+ *   T
+ *   F R B L
+ *   B
+ *
+ * Each face is contiguous, so sampling one face doesn't drag the rows of the others through
+ * the cache.
+ */
+class Cubemap {
+	struct Face {
+		// Pixels of the cross image this face was copied from, inclusive.
+		unsigned int x0, y0, x1, y1;
+		std::vector<img::Color> pixels;
+	};
+
+	std::array<Face, 6> faces;
+	// Largest pixel coordinates of the cross image.
+	double max_x, max_y;
+	// Half the size of the box.
+	double size;
+
+public:
+	/**
+	 * \brief Origins & directions of rays, stored per component so batches of rays can be
+	 * processed with SIMD instructions.
+	 */
+	struct Rays {
+		std::vector<double> px, py, pz, nx, ny, nz;
+
+		explicit Rays(size_t count) : px(count), py(count), pz(count), nx(count), ny(count), nz(count) {}
+
+		void set(size_t i, Point3D p, Vector3D n) {
+			px[i] = p.x, py[i] = p.y, pz[i] = p.z;
+			nx[i] = n.x, ny[i] = n.y, nz[i] = n.z;
+		}
+	};
+
+	/**
+	 * \param cross The faces laid out as a cross.
+	 * \param size Half the size of the box.
+	 */
+	Cubemap(const Texture &cross, double size);
+
+	/**
+	 * \brief Get the colors of the box in the given directions.
+	 *
+	 * \param inv_eye Transformation from eye space to the space of the box.
+	 * \param rays The origins & directions of the rays in eye space.
+	 * \param count The amount of rays.
+	 * \param out The colors.
+	 */
+	void sample(const Matrix4D &inv_eye, const Rays &rays, unsigned int count, Color *out) const;
+};
+
+}
+}
@@ -1,12 +1,19 @@
 #pragma once
 
+#include <functional>
+#include <vector>
 #include "math/point3d.h"
 #include "math/matrix4d.h"
 #include "math/vector3d.h"
 #include "render/color.h"
 #include "render/light.h"
+#include "render/options.h"
+#include "render/raster.h"
+#include "render/shadow_cache.h"
+#include "render/stats.h"
 #include "render/triangle.h"
 #include "render/lines.h"
+#include "thread_pool.h"
 
 namespace engine {
 namespace render {
@@ -15,9 +22,86 @@ Matrix4D look_direction(Point3D pos, Vector3D dir, Matrix4D &inv);
 
 Matrix4D look_direction(Point3D pos, Vector3D dir);
 
-void draw(const std::vector<TriangleFigure> &figures, const Lights &lights, double d, Vector2D offset, img::EasyImage &img, TaggedZBuffer &zbuf);
+/**
+ * \brief Draw triangle figures to an existing image & ZBuffer.
+ *
+ * The image holds the same rows as the ZBuffer, see ZBuffer::get_origin_y().
+ *
+ * \param pool Runs all parallel work. It can be kept between draws to avoid starting threads
+ * every time.
+ * \param stats If not null, counters gathered while drawing are added to it.
+ * \param cache If not null, shadow maps are taken from and stored in it.
+ * \param window If not null, nothing outside this projected rectangle is drawn.
+ */
+void draw(
+	const std::vector<TriangleFigure> &figures,
+	const Lights &lights,
+	double d,
+	Vector2D offset,
+	img::EasyImage &img,
+	TaggedZBuffer &zbuf,
+	const Options &opts,
+	util::ThreadPool &pool,
+	Stats *stats = nullptr,
+	ShadowCache *cache = nullptr,
+	const Rect *window = nullptr
+);
 
-img::EasyImage draw(const std::vector<TriangleFigure> &figures, const Lights &lights, unsigned int size, Color background);
+/**
+ * \brief Draw triangle figures to a new image.
+ *
+ * \param pool See draw().
+ * \param stats If not null, counters gathered while drawing are added to it.
+ * \param window If not null, only the part of the figures inside this projected rectangle
+ * is drawn and the image is fit to that part.
+ */
+img::EasyImage draw(
+	const std::vector<TriangleFigure> &figures,
+	const Lights &lights,
+	unsigned int size,
+	Color background,
+	const Options &opts,
+	util::ThreadPool &pool,
+	Stats *stats = nullptr,
+	const Rect *window = nullptr
+);
+
+/**
+ * \brief Receives the bands of an image drawn by draw_bands().
+ */
+struct BandSink {
+	// Called once with the size of the whole image, before the first band.
+	std::function<void(unsigned int width, unsigned int height)> start;
+	// Called with each band and the row of the image its bottom row belongs at.
+	std::function<void(const img::EasyImage &band, unsigned int y)> band;
+};
+
+/**
+ * \brief Draw triangle figures in horizontal bands of rows, from the top of the image down.
+ *
+ * Only one band of the image & ZBuffer is in memory at once, so memory use scales with the
+ * band height instead of the image size. The triangles are sorted into bands and the shadow
+ * maps are built once for all bands.
+ *
+ * Nothing is passed to sink if the image would be empty.
+ *
+ * \param pool See draw().
+ * \param band_height The maximum amount of rows of a band.
+ * \param stats If not null, counters gathered while drawing are added to it.
+ * \param window See draw().
+ */
+void draw_bands(
+	const std::vector<TriangleFigure> &figures,
+	const Lights &lights,
+	unsigned int size,
+	Color background,
+	const Options &opts,
+	util::ThreadPool &pool,
+	unsigned int band_height,
+	const BandSink &sink,
+	Stats *stats = nullptr,
+	const Rect *window = nullptr
+);
 
 img::EasyImage draw(const std::vector<LineFigure> &figures, unsigned int size, Color background, bool with_z);
 
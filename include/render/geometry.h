@@ -6,17 +6,51 @@
 #include "math/point3d.h"
 #include "math/vector2d.h"
 #include "math/vector3d.h"
+#include "render/rect.h"
 #include "render/triangle.h"
 #include "util.h"
 
 namespace engine {
+
+namespace util {
+class ThreadPool;
+}
+
 namespace render {
 
+/**
+ * \brief How far triangles may stick out of the sides of the view, relative to its size,
+ * before they are clipped.
+ *
+ * The guard band is off by default, as the images it produces differ slightly along the
+ * edges of the view. Set General.guardBand to e.g. 16 to use it.
+ */
+#define GUARD_BAND (1.0)
+
 struct Frustum {
 	double near, far;
 	double fov, aspect;
+	// 1 or less clips exactly against the side planes.
+	double guard_band = GUARD_BAND;
 
-	void clip(TriangleFigure &f) const;
+	/**
+	 * \brief Clip a figure to this frustum.
+	 *
+	 * The points are classified against all planes at once. Only faces that cross a plane
+	 * are clipped, the others are kept or removed as is.
+	 *
+	 * Near & far clipping is exact. Faces that stick out of the sides are only clipped if
+	 * they also leave the guard band, so the rasterizer must discard everything outside
+	 * window() itself.
+	 *
+	 * \param pool If not null, large figures are clipped in parallel.
+	 */
+	void clip(TriangleFigure &f, util::ThreadPool *pool = nullptr) const;
+
+	/**
+	 * \brief Determine the bounds of the view in projected coordinates.
+	 */
+	Rect window() const;
 
 	/**
 	 * \brief Determine the perspective scaling factor d for this frustum for a given width.
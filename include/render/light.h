@@ -4,6 +4,7 @@
 #include "math/point3d.h"
 #include "math/matrix4d.h"
 #include "render/color.h"
+#include "render/cubemap.h"
 #include "render/texture.h"
 #include "render/triangle.h"
 
@@ -15,26 +16,46 @@ struct DirectionalLight {
 	Color diffuse, specular;
 };
 
+/**
+ * \brief Depth map of the scene as seen from a point light.
+ */
+struct ShadowMap {
+	// From camera space to the space of the light, for looking up points that are drawn.
+	Matrix4D eye;
+	// From world space to the space of the light. The map only depends on this, so it can
+	// be reused when the camera moves.
+	Matrix4D light_eye;
+	ZBuffer zbuf;
+	double d;
+	Vector2D offset;
+};
+
 struct PointLight {
 	Point3D point;
 	Color diffuse, specular;
 	double spot_angle_cos;
-	struct {
-		Matrix4D eye;
-		ZBuffer zbuf;
-		double d;
-		Vector2D offset;
-	} mutable cached;
+	mutable ShadowMap cached;
+	// The position before the eye transform, which the shadow map is built from.
+	Point3D world;
 };
 
 struct Lights {
+	/**
+	 * \brief Largest supported radius of the shadow filter kernel.
+	 */
+	static constexpr unsigned int SHADOW_FILTER_MAX = 3;
+
 	std::vector<DirectionalLight> directional;
 	std::vector<PointLight> point;
+	// Figures that cast shadows, in world space so shadow maps don't depend on the camera.
 	std::vector<ZBufferTriangleFigure> zfigures;
+	// Set if zfigures are in camera space instead. Their shadow maps can't be cached.
+	bool zfigures_camera = false;
 	Matrix4D eye, inv_eye;
-	double cubemap_size;
-	std::optional<Texture> cubemap;
+	std::optional<Cubemap> cubemap;
 	unsigned int shadow_mask;
+	// Half the width of the percentage-closer filter kernel in texels. 0 gives hard shadows.
+	unsigned int shadow_filter = 0;
 	Color ambient;
 	bool shadows = false;
 };
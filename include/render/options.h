@@ -0,0 +1,18 @@
+#pragma once
+
+namespace engine {
+namespace render {
+
+/**
+ * \brief Settings that affect how, but not what, is rendered.
+ */
+struct Options {
+	// 0 means "as many as there are cores".
+	unsigned int threads = 0;
+	// Rasterize triangles from front to back to reduce overdraw. Triangles at exactly the
+	// same depth may be drawn in a different order.
+	bool front_to_back = false;
+};
+
+}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+#include "math/vector2d.h"
+#include "render/options.h"
+#include "render/rect.h"
+#include "render/stats.h"
+#include "render/triangle.h"
+#include "thread_pool.h"
+#include "zbuffer.h"
+
+namespace engine {
+namespace render {
+
+/**
+ * \brief A triangle of one of the figures that are drawn.
+ */
+struct TriangleRef {
+	u_int16_t figure_id;
+	u_int32_t triangle_id;
+};
+
+/**
+ * \brief Sort the visible triangles into horizontal bands of rows.
+ *
+ * The triangles of each band are in the same order rasterize() would draw them in.
+ *
+ * \param width, height The size of the whole image.
+ * \param band_height The amount of rows per band. The last band may be smaller.
+ */
+std::vector<std::vector<TriangleRef>> bin_bands(
+	const std::vector<TriangleFigure> &figures,
+	double d,
+	Vector2D offset,
+	unsigned int width,
+	unsigned int height,
+	unsigned int band_height,
+	util::ThreadPool &pool,
+	const Options &opts
+);
+
+/**
+ * \brief Fill in a ZBuffer with the figure & triangle IDs of all visible triangles.
+ *
+ * Triangles are first sorted into screen tiles, after which each tile is rasterized on its
+ * own thread. Triangles are processed in the same order as a serial loop would, so the
+ * result is identical.
+ *
+ * If Options::front_to_back is set, clusters of triangles are drawn from front to back
+ * instead. This avoids overwriting pixels many times, but triangles at exactly the same
+ * depth may end up in a different order.
+ *
+ * If stats is not null, counters are added to it. Counting the covered pixels takes another
+ * pass over the ZBuffer, so it is skipped otherwise.
+ *
+ * If window is not null, pixels outside of it are left untouched.
+ *
+ * If triangles is not null, only those triangles are drawn, in the given order.
+ */
+void rasterize(
+	const std::vector<TriangleFigure> &figures,
+	double d,
+	Vector2D offset,
+	double bias,
+	TaggedZBuffer &zbuf,
+	util::ThreadPool &pool,
+	const Options &opts,
+	Stats *stats,
+	const Rect *window = nullptr,
+	const std::vector<TriangleRef> *triangles = nullptr
+);
+
+}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "math/matrix4d.h"
+#include "math/point3d.h"
+#include "render/light.h"
+#include "render/triangle.h"
+
+namespace engine {
+namespace render {
+
+/**
+ * \brief Shadow maps of point lights that are kept between draws.
+ *
+ * A shadow map only depends on the position of the light, the shadow mask size and the
+ * geometry, all in world space. If none of these change between draws the map can be reused
+ * instead of rasterizing every figure again, even if the camera moved.
+ */
+class ShadowCache {
+	struct Entry {
+		// Position of the light in world space.
+		Point3D point;
+		unsigned int shadow_mask;
+		u_int64_t geometry;
+		ShadowMap map;
+	};
+
+	std::vector<Entry> entries;
+
+public:
+	/**
+	 * \brief Hash the geometry that casts shadows, which is in world space.
+	 */
+	static u_int64_t hash(const std::vector<ZBufferTriangleFigure> &figures);
+
+	/**
+	 * \brief Move a matching shadow map into the light, if there is one.
+	 *
+	 * The map is set up for lookups from the current camera.
+	 *
+	 * \return true if a map was found.
+	 */
+	bool take(const PointLight &light, const Lights &lights, u_int64_t geometry);
+
+	/**
+	 * \brief Move the shadow map of a light into the cache.
+	 */
+	void put(const PointLight &light, const Lights &lights, u_int64_t geometry);
+
+	/**
+	 * \brief Remove all shadow maps.
+	 */
+	void clear() {
+		entries.clear();
+	}
+};
+
+}
+}
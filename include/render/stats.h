@@ -0,0 +1,104 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+namespace engine {
+namespace render {
+
+/**
+ * \brief The parts of turning an INI file into an image that are timed separately.
+ */
+enum Stage {
+	STAGE_PARSE,
+	STAGE_GENERATE,
+	STAGE_CONVERT,
+	STAGE_CLIP,
+	STAGE_SHADOWS,
+	STAGE_RASTERIZE,
+	STAGE_SHADE,
+	STAGE_WRITE,
+	STAGES,
+};
+
+/**
+ * \brief The name of a stage as used in reports.
+ */
+constexpr const char *stage_name(Stage stage) {
+	switch (stage) {
+	case STAGE_PARSE: return "parse";
+	case STAGE_GENERATE: return "generate";
+	case STAGE_CONVERT: return "convert";
+	case STAGE_CLIP: return "clip";
+	case STAGE_SHADOWS: return "shadows";
+	case STAGE_RASTERIZE: return "rasterize";
+	case STAGE_SHADE: return "shade";
+	case STAGE_WRITE: return "write";
+	case STAGES: break;
+	}
+	return "";
+}
+
+/**
+ * \brief Counters gathered while rendering.
+ */
+struct Stats {
+	// Triangles skipped because everything behind them was already covered. A triangle
+	// that spans multiple tiles is counted once for each tile it is hidden in.
+	size_t occluded_triangles = 0;
+	// Amount of times a pixel was written to the ZBuffer. Divided by pixels_covered this gives
+	// the average overdraw.
+	size_t pixel_writes = 0;
+	// Pixels with a triangle in it at the end of rasterization.
+	size_t pixels_covered = 0;
+	// Shadow maps of point lights that were reused from or missing in the ShadowCache.
+	size_t shadow_cache_hits = 0;
+	size_t shadow_cache_misses = 0;
+	// Triangles of all figures before & after clipping.
+	size_t triangles_in = 0;
+	size_t triangles_out = 0;
+	// Pixels that went through the lighting model.
+	size_t pixels_shaded = 0;
+	// Wall time spent in each stage, in seconds. Stages that run once per band add up.
+	double stage_seconds[STAGES] = {};
+};
+
+/**
+ * \brief Adds the wall time until it is stopped or destroyed to a stage.
+ *
+ * Without stats to add to it does nothing, so it can stay in hot paths.
+ */
+class StageTimer {
+	Stats *stats;
+	Stage stage;
+	std::chrono::steady_clock::time_point start;
+
+public:
+	StageTimer(Stats *stats, Stage stage) : stats(stats), stage(stage) {
+		if (stats != nullptr) {
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	StageTimer(const StageTimer &) = delete;
+
+	StageTimer &operator=(const StageTimer &) = delete;
+
+	~StageTimer() {
+		stop();
+	}
+
+	/**
+	 * \brief Add the time so far. Later calls do nothing.
+	 */
+	void stop() {
+		if (stats != nullptr) {
+			std::chrono::duration<double> t = std::chrono::steady_clock::now() - start;
+			stats->stage_seconds[stage] += t.count();
+			stats = nullptr;
+		}
+	}
+};
+
+}
+}
@@ -1,21 +1,171 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <vector>
 #include "easy_image.h"
 #include "math/point2d.h"
+#include "render/color.h"
+#include "util.h"
+
+/**
+ * \brief Width & height of the blocks of texels of mipmaps. A block of 4x4 RGBA8 texels fills
+ * exactly one cache line.
+ */
+#define TEXTURE_TILE_SIZE (4)
 
 namespace engine {
 namespace render {
 
-struct Texture {
-	std::shared_ptr<img::EasyImage> image;
+enum TextureFilter {
+	TEXTURE_NEAREST,
+	TEXTURE_BILINEAR,
+	TEXTURE_TRILINEAR,
+	TEXTURE_FILTER_MAX = TEXTURE_TRILINEAR,
+};
+
+/**
+ * \brief One level of a mip chain, stored as RGBA8 texels in square tiles.
+ *
+ * Neighbouring texels are usually in the same tile, so filtering touches few cache lines
+ * regardless of the direction the texture is stepped through.
+ */
+struct MipLevel {
+	unsigned int width, height;
+	unsigned int tiles_x;
+	std::vector<uint32_t> texels;
+
+	MipLevel(unsigned int width, unsigned int height);
+
+	static uint32_t pack(double r, double g, double b) {
+		return (uint32_t)round_up(r * 255)
+			| (uint32_t)round_up(g * 255) << 8
+			| (uint32_t)round_up(b * 255) << 16
+			| 0xffu << 24;
+	}
+
+	size_t index(unsigned int x, unsigned int y) const {
+		auto tile = (size_t)(y / TEXTURE_TILE_SIZE) * tiles_x + x / TEXTURE_TILE_SIZE;
+		return tile * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE
+			+ (y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE
+			+ x % TEXTURE_TILE_SIZE;
+	}
+
+	Color get(unsigned int x, unsigned int y) const {
+		auto t = texels[index(x, y)];
+		return Color((t & 0xff) / 255.0, (t >> 8 & 0xff) / 255.0, (t >> 16 & 0xff) / 255.0);
+	}
+
+	void set(unsigned int x, unsigned int y, Color c) {
+		texels[index(x, y)] = pack(c.r, c.g, c.b);
+	}
+
+	/**
+	 * \brief Interpolate between the 4 texels nearest to the given coordinates.
+	 */
+	Color bilinear(Point2D uv) const {
+		auto x = (width - 1) * std::clamp(uv.x, 0.0, 1.0);
+		auto y = (height - 1) * std::clamp(uv.y, 0.0, 1.0);
+		auto x0 = (unsigned int)x, y0 = (unsigned int)y;
+		auto x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+		auto fx = x - x0, fy = y - y0;
+		auto top = get(x0, y0) * (1 - fx) + get(x1, y0) * fx;
+		auto bottom = get(x0, y1) * (1 - fx) + get(x1, y1) * fx;
+		return top * (1 - fy) + bottom * fy;
+	}
+};
+
+/**
+ * \brief A read-only image that is sampled by faces.
+ *
+ * The pixels are either owned by an EasyImage or mapped straight from a BMP file. Copies
+ * share the same pixels.
+ *
+ * Filtered textures also have a mip chain, which is built once per image & shared by all
+ * copies.
+ */
+class Texture {
+	struct Shared;
+
+	std::shared_ptr<Shared> shared;
+	// The bottom row. Rows are stored upside down in BMP files, unless the height is negative.
+	const char *pixels;
+	unsigned int width, height;
+	ptrdiff_t row_size;
+	TextureFilter filter = TEXTURE_NEAREST;
+	// Owned by shared. Empty if not filtered.
+	const std::vector<MipLevel> *mips = nullptr;
+
+	Texture(std::shared_ptr<const void> owner, const char *pixels, unsigned int width, unsigned int height, ptrdiff_t row_size);
+
+public:
+	Texture(img::EasyImage &&img);
 
-	Texture(img::EasyImage &&img) : image(std::make_shared<img::EasyImage>(std::move(img))) {}
+	/**
+	 * \brief Load a 24-bit uncompressed BMP file.
+	 *
+	 * The file is memory-mapped and its pixels are used in place. Textures are cached by path,
+	 * so every figure using the same file shares the same pages.
+	 */
+	static Texture load(const std::string &path);
+
+	/**
+	 * \brief Get a copy that is sampled with the given filter.
+	 *
+	 * The mip chain is built the first time any copy of this image needs it.
+	 */
+	Texture filtered(TextureFilter filter) const;
+
+	TextureFilter get_filter() const {
+		return filter;
+	}
+
+	unsigned int get_width() const {
+		return width;
+	}
+
+	unsigned int get_height() const {
+		return height;
+	}
+
+	const img::Color &operator()(unsigned int x, unsigned int y) const {
+		return ((const img::Color *)(pixels + row_size * (ptrdiff_t)y))[x];
+	}
 
 	img::Color get_clamped(Point2D uv) const {
-		unsigned int u = round_up((image->get_width() - 1) * std::clamp(uv.x, 0.0, 1.0));
-		unsigned int v = round_up((image->get_height() - 1) * std::clamp(uv.y, 0.0, 1.0));
-		return (*image)(u, v);
+		unsigned int u = round_up((width - 1) * std::clamp(uv.x, 0.0, 1.0));
+		unsigned int v = round_up((height - 1) * std::clamp(uv.y, 0.0, 1.0));
+		return (*this)(u, v);
+	}
+
+	/**
+	 * \brief Sample the texture with its filter.
+	 *
+	 * \param footprint The distance in texels of the full-size image between this sample and
+	 * the samples of neighbouring pixels. Only used for trilinear filtering.
+	 */
+	Color sample(Point2D uv, double footprint) const {
+		switch (filter) {
+		case TEXTURE_NEAREST:
+			return Color(get_clamped(uv));
+		case TEXTURE_BILINEAR:
+			return (*mips)[0].bilinear(uv);
+		case TEXTURE_TRILINEAR: {
+			auto lod = footprint > 1 ? std::log2(footprint) : 0.0;
+			lod = std::min(lod, (double)(mips->size() - 1));
+			auto l = (size_t)lod;
+			auto f = lod - l;
+			auto c = (*mips)[l].bilinear(uv);
+			return f > 0 ? c * (1 - f) + (*mips)[l + 1].bilinear(uv) * f : c;
+		}
+		}
+		UNREACHABLE;
+		return Color();
 	}
 };
 
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+namespace engine {
+namespace render {
+
+/**
+ * \brief Splits an image in square tiles so they can be processed independently.
+ *
+ * Tiles are numbered row by row, starting at the bottom-left.
+ */
+struct TileGrid {
+	struct Tile {
+		// x1 and y1 are exclusive.
+		unsigned int x0, y0, x1, y1;
+	};
+
+	unsigned int width, height, size;
+
+	constexpr TileGrid(unsigned int width, unsigned int height, unsigned int size = 64)
+		: width(width), height(height), size(size)
+	{}
+
+	constexpr unsigned int columns() const {
+		return (width + size - 1) / size;
+	}
+
+	constexpr unsigned int rows() const {
+		return (height + size - 1) / size;
+	}
+
+	constexpr size_t count() const {
+		return (size_t)columns() * rows();
+	}
+
+	constexpr Tile operator [](size_t i) const {
+		unsigned int x = (unsigned int)(i % columns()) * size;
+		unsigned int y = (unsigned int)(i / columns()) * size;
+		return { x, y, std::min(x + size, width), std::min(y + size, height) };
+	}
+};
+
+}
+}
@@ -1,9 +1,16 @@
 #pragma once
 
+#include <array>
+#include <memory_resource>
 #include <optional>
+#include <vector>
+#include "math/matrix4d.h"
+#include "math/point3d.h"
+#include "math/vector3d.h"
 #include "render/color.h"
 #include "render/rect.h"
 #include "render/texture.h"
+#include "util.h"
 
 namespace engine {
 namespace render {
@@ -38,12 +45,83 @@ public:
 	void cubemap(bool v) { return set_flag(4, v); };
 };
 
+/**
+ * \brief A scaled & moved copy of an instanced mesh.
+ */
+struct Instance {
+	Vector3D offset;
+	double scale;
+
+	constexpr Point3D apply(Point3D p) const {
+		return Point3D(p.to_vector() * scale + offset);
+	}
+};
+
+/**
+ * \brief A mesh that is placed many times without copying its points, normals and faces.
+ *
+ * Triangles are numbered instance by instance.
+ */
+struct InstancedMesh {
+	// Points relative to the origin of an instance.
+	std::pmr::vector<Point3D> points;
+	// Per point or per face, like the normals of the figure it is part of. Instances don't
+	// rotate, so these don't need to be transformed.
+	std::pmr::vector<Vector3D> normals;
+	std::pmr::vector<Face> faces;
+
+	std::pmr::vector<Instance> instances;
+
+	InstancedMesh() {}
+
+	/**
+	 * \brief Create an empty mesh whose vectors are allocated from arena.
+	 */
+	explicit InstancedMesh(std::pmr::memory_resource *arena)
+		: points(arena), normals(arena), faces(arena), instances(arena)
+	{}
+
+	/**
+	 * \brief Copy a mesh into arena.
+	 */
+	InstancedMesh(const InstancedMesh &m, std::pmr::memory_resource *arena)
+		: points(m.points, arena)
+		, normals(m.normals, arena)
+		, faces(m.faces, arena)
+		, instances(m.instances, arena)
+	{}
+
+	size_t triangles_count() const {
+		return faces.size() * instances.size();
+	}
+
+	/**
+	 * \brief Transform the points of every instance. Normals are left alone.
+	 *
+	 * \param mat An affine transformation.
+	 */
+	void transform(const Matrix4D &mat);
+};
+
+struct Triangle {
+	Point3D a, b, c;
+};
+
+/**
+ * \brief A figure ready to be drawn.
+ *
+ * The vectors are usually allocated from the arena of a render, see util::Arena. Temporary
+ * vectors that grow along with them should use the same arena.
+ */
 struct TriangleFigure {
-	std::vector<Point3D> points;
-	std::vector<Vector3D> normals;
-	std::vector<Point2D> uv;
+	std::pmr::vector<Point3D> points;
+	std::pmr::vector<Vector3D> normals;
+	std::pmr::vector<Point2D> uv;
 
-	std::vector<Face> faces;
+	std::pmr::vector<Face> faces;
+
+	// Triangles that come after faces. Instanced meshes never have UVs.
+	InstancedMesh instanced;
 
 	std::optional<Texture> texture;
 	Color ambient;
@@ -54,32 +132,120 @@ struct TriangleFigure {
 
 	TriangleFigureFlags flags;
 
+	TriangleFigure() {}
+
+	explicit TriangleFigure(std::pmr::memory_resource *arena)
+		: points(arena), normals(arena), uv(arena), faces(arena), instanced(arena)
+	{}
+
+	/**
+	 * \brief The arena the vectors of the figure are allocated from.
+	 */
+	std::pmr::memory_resource *arena() const {
+		return points.get_allocator().resource();
+	}
+
+	size_t triangles_count() const {
+		return faces.size() + instanced.triangles_count();
+	}
+
+	/**
+	 * \brief Get the corners of a triangle.
+	 */
+	ALWAYS_INLINE Triangle triangle(size_t k) const {
+		if (k < faces.size()) {
+			auto &t = faces[k];
+			return { points[t.a], points[t.b], points[t.c] };
+		}
+		k -= faces.size();
+		auto &i = instanced.instances[k / instanced.faces.size()];
+		auto &t = instanced.faces[k % instanced.faces.size()];
+		auto &p = instanced.points;
+		return { i.apply(p[t.a]), i.apply(p[t.b]), i.apply(p[t.c]) };
+	}
+
+	/**
+	 * \brief Get the normals of the corners of a triangle if separate_normals() is set,
+	 * otherwise the normal of the triangle itself.
+	 */
+	ALWAYS_INLINE std::array<Vector3D, 3> triangle_normals(size_t k) const {
+		auto &n = k < faces.size() ? normals : instanced.normals;
+		if (!flags.separate_normals()) {
+			auto i = k < faces.size() ? k : (k - faces.size()) % instanced.faces.size();
+			return { n[i], n[i], n[i] };
+		}
+		auto &t = k < faces.size() ? faces[k] : instanced.faces[(k - faces.size()) % instanced.faces.size()];
+		return { n[t.a], n[t.b], n[t.c] };
+	}
+
+	/**
+	 * \brief Call f with the corners of every triangle, in order.
+	 */
+	template<typename F>
+	void for_each_triangle(F f) const {
+		for (auto &t : faces) {
+			f(Triangle { points[t.a], points[t.b], points[t.c] });
+		}
+		auto &p = instanced.points;
+		for (auto &i : instanced.instances) {
+			for (auto &t : instanced.faces) {
+				f(Triangle { i.apply(p[t.a]), i.apply(p[t.b]), i.apply(p[t.c]) });
+			}
+		}
+	}
+
 	Rect bounds_projected() const;
+
+	/**
+	 * \brief Determine the projected bounds of only the part of the figure inside window.
+	 *
+	 * All points must be in front of the camera.
+	 */
+	Rect bounds_projected(const Rect &window) const;
 };
 
 /**
  * TriangleFigure optimized for ZBuffer use only (e.g. shadows).
  */
 struct ZBufferTriangleFigure {
-	std::vector<Point3D> points;
-	std::vector<Face> faces;
+	std::pmr::vector<Point3D> points;
+	std::pmr::vector<Face> faces;
+	// Normals are never set.
+	InstancedMesh instanced;
 	bool can_cull;
 
-	ZBufferTriangleFigure(bool can_cull)
-		: can_cull(can_cull)
+	ZBufferTriangleFigure(bool can_cull, std::pmr::memory_resource *arena = std::pmr::get_default_resource())
+		: points(arena), faces(arena), instanced(arena), can_cull(can_cull)
 	{}
 
+	/**
+	 * \brief Copy the geometry of a figure into the same arena.
+	 */
 	ZBufferTriangleFigure(const TriangleFigure &fig)
-		: points(fig.points), faces(fig.faces), can_cull(fig.flags.can_cull())
-	{}
+		: points(fig.points, fig.arena())
+		, faces(fig.faces, fig.arena())
+		, instanced(fig.arena())
+		, can_cull(fig.flags.can_cull())
+	{
+		instanced.points = fig.instanced.points;
+		instanced.faces = fig.instanced.faces;
+		instanced.instances = fig.instanced.instances;
+	}
 
 	ZBufferTriangleFigure(const TriangleFigure &fig, const Matrix4D &mat)
-		: faces(fig.faces), can_cull(fig.flags.can_cull())
+		: points(fig.arena())
+		, faces(fig.faces, fig.arena())
+		, instanced(fig.arena())
+		, can_cull(fig.flags.can_cull())
 	{
 		points.reserve(fig.points.size());
 		for (auto &p : fig.points) {
 			points.push_back(p * mat);
 		}
+		instanced.points = fig.instanced.points;
+		instanced.faces = fig.instanced.faces;
+		instanced.instances = fig.instanced.instances;
+		instanced.transform(mat);
 	}
 
 	Rect bounds_projected() const;
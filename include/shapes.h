@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <array>
+#include <memory_resource>
 #include <optional>
 #include <ostream>
 #include <vector>
@@ -14,6 +15,7 @@
 #include "math/point3d.h"
 #include "math/vector3d.h"
 #include "render/color.h"
+#include "render/fragment.h"
 #include "render/lines.h"
 #include "render/triangle.h"
 
@@ -99,24 +101,53 @@ struct EdgeShape {
 };
 
 struct FaceShape {
-	std::vector<Point3D> points;
-	std::vector<Vector3D> normals;
-	std::vector<Point2D> uvs;
-	std::vector<render::Face> faces;
+	std::pmr::vector<Point3D> points;
+	std::pmr::vector<Vector3D> normals;
+	std::pmr::vector<Point2D> uvs;
+	std::pmr::vector<render::Face> faces;
+
+	// Copies of a mesh in addition to the faces above.
+	render::InstancedMesh instanced;
 
 	FaceShape() {}
 
+	/**
+	 * \brief Create an empty shape whose vectors are allocated from arena.
+	 */
+	explicit FaceShape(std::pmr::memory_resource *arena)
+		: points(arena), normals(arena), uvs(arena), faces(arena), instanced(arena)
+	{}
+
 	template<unsigned int points_c, unsigned int edges_c, unsigned int faces_c>
-	FaceShape(const ShapeTemplate<points_c, edges_c, faces_c> &t, bool point_normals)
-		: points({ t.points.begin(), t.points.end() })
-		, faces({ t.faces.begin(), t.faces.end() })
+	FaceShape(
+		const ShapeTemplate<points_c, edges_c, faces_c> &t,
+		bool point_normals,
+		std::pmr::memory_resource *arena = std::pmr::get_default_resource()
+	)
+		: points(t.points.begin(), t.points.end(), arena)
+		, normals(arena)
+		, uvs(arena)
+		, faces(t.faces.begin(), t.faces.end(), arena)
+		, instanced(arena)
 	{
 		if (point_normals) {
-			normals = { t.point_normals.begin(), t.point_normals.end() };
+			normals.assign(t.point_normals.begin(), t.point_normals.end());
 		} else {
-			normals = { t.face_normals.begin(), t.face_normals.end() };
+			normals.assign(t.face_normals.begin(), t.face_normals.end());
 		}
 	}
+
+	/**
+	 * \brief The arena the vectors of the shape are allocated from.
+	 */
+	std::pmr::memory_resource *arena() const {
+		return points.get_allocator().resource();
+	}
+
+	/**
+	 * \brief Append a copy of the instanced mesh for every instance to the faces.
+	 */
+	void flatten();
 };
 
 struct ShapeTemplateAny {
@@ -173,11 +204,27 @@ render::TriangleFigure convert(
 /**
  * \brief Generic face normal calculator.
  */
-std::vector<Vector3D> calculate_face_normals(const std::vector<Point3D> &points, const std::vector<render::Face> &faces);
+std::pmr::vector<Vector3D> calculate_face_normals(const std::pmr::vector<Point3D> &points, const std::pmr::vector<render::Face> &faces);
 
 img::EasyImage wireframe(const ini::Configuration &, bool with_z);
 
-img::EasyImage triangles(const ini::Configuration &, bool with_lighting);
+/**
+ * \brief Draw the triangle figures of a scene.
+ *
+ * \param stats If not null, counters & the time spent in each stage are added to it.
+ */
+img::EasyImage triangles(const ini::Configuration &, bool with_lighting, render::Stats *stats = nullptr);
+
+/**
+ * \brief Draw triangles in bands of at most band_height rows. See render::draw_bands().
+ */
+void triangles(
+	const ini::Configuration &,
+	bool with_lighting,
+	unsigned int band_height,
+	const render::BandSink &sink,
+	render::Stats *stats = nullptr
+);
 
 }
 }
@@ -6,10 +6,15 @@
 
 namespace engine {
 namespace shapes {
-	void circle(std::vector<Point3D> &points, unsigned int n, double z);
+	// These are instantiated for std::vector & std::pmr::vector.
 
-	void circle(std::vector<render::Face> &faces, unsigned int n, unsigned int offt);
+	template<typename A>
+	void circle(std::vector<Point3D, A> &points, unsigned int n, double z);
 
-	void circle_reversed(std::vector<render::Face> &faces, unsigned int n, unsigned int offt);
+	template<typename A>
+	void circle(std::vector<render::Face, A> &faces, unsigned int n, unsigned int offt);
+
+	template<typename A>
+	void circle_reversed(std::vector<render::Face, A> &faces, unsigned int n, unsigned int offt);
 }
 }
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "shapes.h"
+
+namespace engine {
+namespace shapes {
+
+/**
+ * \brief Directory with meshes that were generated or parsed by earlier renders.
+ *
+ * Every mesh is stored in a binary file that can be memory-mapped and copied straight into a
+ * FaceShape. Files are named after a key, which is either derived from the generator
+ * parameters of a figure or from the size & modification time of the file it was loaded from.
+ */
+class MeshCache {
+	std::string dir;
+
+public:
+	/**
+	 * \brief Create a cache in the given directory, which is created when needed.
+	 *
+	 * An empty path disables the cache.
+	 */
+	explicit MeshCache(std::string dir) : dir(std::move(dir)) {}
+
+	/**
+	 * \brief Create a cache in the directory given by the CGENGINE_MESH_CACHE environment
+	 * variable. The cache is disabled if it isn't set.
+	 */
+	static MeshCache from_env();
+
+	bool enabled() const {
+		return !dir.empty();
+	}
+
+	/**
+	 * \brief Determine the key of the mesh of a figure.
+	 *
+	 * \return An empty string if the mesh of this type of figure isn't worth caching.
+	 */
+	static std::string key(const std::string &type, const Configuration &conf);
+
+	/**
+	 * \brief Load a mesh.
+	 *
+	 * \param strings Extra data stored along with the mesh.
+	 *
+	 * \return false if there is no valid entry for the key.
+	 */
+	bool load(
+		const std::string &key,
+		FaceShape &shape,
+		bool &point_normals,
+		std::vector<std::string> &strings
+	) const;
+
+	/**
+	 * \brief Store a mesh. Failures are logged but otherwise ignored.
+	 */
+	void store(
+		const std::string &key,
+		const FaceShape &shape,
+		bool point_normals,
+		const std::vector<std::string> &strings
+	) const;
+};
+
+}
+}
@@ -8,9 +8,18 @@
 namespace engine {
 namespace shapes {
 
+/**
+ * \brief The material library & material a Wavefront file uses, if any.
+ */
+struct WavefrontMaterialRef {
+	std::string mtllib;
+	std::string usemtl;
+};
+
 class WavefrontParseException : public std::exception {
 	std::string reason;
-	friend void wavefront(const std::string &path, FaceShape &shape, Material &mat, bool &point_normals);
+	friend void wavefront_mesh(const std::string &path, FaceShape &shape, bool &point_normals, WavefrontMaterialRef &ref);
+	friend void wavefront_material(const WavefrontMaterialRef &ref, Material &mat);
 	WavefrontParseException(unsigned int line_i, std::string reason)
 		: reason(reason + " @ line " + std::to_string(line_i)) {}
 
@@ -20,6 +29,18 @@ public:
 	}
 };
 
+/**
+ * \brief Parse only the mesh of a Wavefront file.
+ *
+ * \param ref The material the file refers to, which can be loaded with wavefront_material().
+ */
+void wavefront_mesh(const std::string &path, FaceShape &shape, bool &point_normals, WavefrontMaterialRef &ref);
+
+/**
+ * \brief Load the material a Wavefront file refers to. Does nothing if it doesn't refer to any.
+ */
+void wavefront_material(const WavefrontMaterialRef &ref, Material &mat);
+
 void wavefront(const std::string &path, FaceShape &shape, Material &mat, bool &point_normals);
 
 void wavefront(const Configuration &conf, FaceShape &shape, Material &mat, bool &point_normals);
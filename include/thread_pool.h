@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace engine {
+namespace util {
+
+/**
+ * \brief A fixed-size pool of worker threads.
+ *
+ * Work is submitted as a range of task indices with run(). The calling thread participates
+ * too, so a pool of size 1 doesn't spawn any threads and simply runs all tasks inline.
+ *
+ * run() must not be called recursively nor from multiple threads at once.
+ */
+class ThreadPool {
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake, done;
+
+	const std::function<void(size_t)> *job = nullptr;
+	size_t job_size = 0;
+	std::atomic<size_t> next;
+	size_t active = 0;
+	unsigned int generation = 0;
+	bool stop = false;
+	std::exception_ptr error;
+
+	void work();
+
+	void drain();
+
+public:
+	/**
+	 * \brief Create a pool with the given amount of threads, including the calling thread.
+	 *
+	 * \param threads Amount of threads. 0 means "as many as there are cores".
+	 */
+	explicit ThreadPool(unsigned int threads);
+
+	ThreadPool(const ThreadPool &) = delete;
+
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	~ThreadPool();
+
+	/**
+	 * \brief Determine the amount of threads to actually use.
+	 *
+	 * The CGENGINE_THREADS environment variable, if set, overrides the requested amount.
+	 */
+	static unsigned int resolve(unsigned int threads);
+
+	/**
+	 * \brief Set the amount of threads used for pools that ask for "as many as there are
+	 * cores".
+	 *
+	 * Useful if multiple pools are used concurrently. 0 restores the default.
+	 */
+	static void set_default_threads(unsigned int threads);
+
+	unsigned int size() const {
+		return (unsigned int)workers.size() + 1;
+	}
+
+	/**
+	 * \brief Call f(i) for every i in [0, n) and wait until all calls are finished.
+	 *
+	 * If any call throws, the remaining tasks are skipped and the first exception
+	 * is rethrown.
+	 */
+	void run(size_t n, const std::function<void(size_t)> &f);
+};
+
+}
+}
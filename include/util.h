@@ -7,6 +7,20 @@
 #endif
 #define UNREACHABLE assert(!"unreachable")
 
+#ifdef __GNUC__
+# define PREFETCH(p) __builtin_prefetch(p)
+#else
+# define PREFETCH(p) ((void)(p))
+#endif
+
+// Put before a loop whose iterations don't depend on each other through memory, so it can be
+// vectorized without checking at runtime whether its arrays overlap.
+#if defined(__GNUC__) && !defined(__clang__)
+# define IVDEP _Pragma("GCC ivdep")
+#else
+# define IVDEP
+#endif
+
 // Returns -1 if lower than 0, otherwise 1.
 static inline int signum_or_one(int x) {
 	return x < 0 ? -1 : 1;
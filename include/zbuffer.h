@@ -1,12 +1,15 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
 #include <limits>
+#include <stdexcept>
 #include <vector>
 #include "math/point3d.h"
 #include "math/vector2d.h"
+#include "render/tiles.h"
 
 namespace engine {
 
@@ -25,36 +28,125 @@ namespace engine {
  * after all set() operations have been performed.
  */
 class ZBuffer {
-	std::vector<double> buffer;
+public:
+	/**
+	 * \brief Width & height of the blocks of the fine and coarse level of the occlusion
+	 * pyramid.
+	 *
+	 * These must divide the tile size of render::TileGrid so that concurrently filled tiles
+	 * never share a block.
+	 */
+	static constexpr unsigned int HIZ_FINE = 8, HIZ_COARSE = 64;
+
+	/**
+	 * \brief Type used to store 1/Z values.
+	 *
+	 * Values are still calculated and compared as doubles, only the stored value is rounded.
+	 */
+#if GRAPHICS_ZBUFFER_COMPACT
+	typedef float depth_t;
+#else
+	typedef double depth_t;
+#endif
+
+private:
+	std::vector<depth_t> buffer;
 	unsigned int width, height;
+	// Row of the image the bottom row of the buffer belongs to. Coordinates passed to and
+	// from the buffer are always those of the image.
+	unsigned int origin_y;
+
+	/**
+	 * \brief Largest 1/Z value in each block of pixels.
+	 *
+	 * Values in the buffer only ever decrease, so a stale maximum is still an upper bound.
+	 * Dirty blocks are only recalculated when an occlusion test needs a tighter bound.
+	 */
+	template<unsigned int size>
+	struct HiZLevel {
+		unsigned int columns;
+		std::vector<double> max;
+		std::vector<u_int8_t> dirty;
+
+		HiZLevel() : columns(0) {}
+
+		HiZLevel(unsigned int width, unsigned int height) : columns((width + size - 1) / size) {
+			max.resize(columns * ((height + size - 1) / size));
+			dirty.resize(max.size());
+		}
+
+		size_t index(unsigned int x, unsigned int y) const {
+			return x / size + y / size * columns;
+		}
+
+		void clear() {
+			std::fill(max.begin(), max.end(), std::numeric_limits<double>::infinity());
+			std::fill(dirty.begin(), dirty.end(), 0);
+		}
+	};
+
+	HiZLevel<HIZ_FINE> hiz_fine;
+	HiZLevel<HIZ_COARSE> hiz_coarse;
+
+	double refresh_fine(unsigned int bx, unsigned int by);
+
+	double refresh_coarse(unsigned int bx, unsigned int by);
 
 protected:
-	double &operator()(unsigned int x, unsigned int y) {
+	/**
+	 * \brief Index of a pixel in the buffer.
+	 */
+	size_t index(unsigned int x, unsigned int y) const {
 		assert(x < width);
-		assert(y < height);
-		return buffer.at(x + y * width);
+		assert(y - origin_y < height);
+		return x + (size_t)(y - origin_y) * width;
+	}
+
+	depth_t &operator()(unsigned int x, unsigned int y) {
+		return buffer.at(index(x, y));
+	}
+
+	/**
+	 * \brief Mark the occlusion pyramid blocks of a pixel as changed.
+	 */
+	void touch(unsigned int x, unsigned int y) {
+		hiz_fine.dirty[hiz_fine.index(x, y - origin_y)] = 1;
+		hiz_coarse.dirty[hiz_coarse.index(x, y - origin_y)] = 1;
 	}
 
 	template<typename F>
-	void triangle(
+	bool triangle(
 		Point3D a, Point3D b, Point3D c,
 		double d, Vector2D offset,
 		double bias,
+		const render::TileGrid::Tile &clip,
 		F callback
 	);
 
 public:
-	ZBuffer() : width(0), height(0) {}
+	ZBuffer() : width(0), height(0), origin_y(0) {}
 
-	ZBuffer(unsigned int width, unsigned int height) : width(width), height(height) {
-		buffer.resize(width * height);
+	/**
+	 * \param origin_y The row of the image the bottom row of the buffer belongs to, so a
+	 * buffer can hold just a band of rows of an image.
+	 */
+	ZBuffer(unsigned int width, unsigned int height, unsigned int origin_y = 0)
+		: width(width), height(height), origin_y(origin_y)
+		, hiz_fine(width, height), hiz_coarse(width, height)
+	{
+		buffer.resize((size_t)width * height);
 		clear();
 	}
 
 	double operator()(unsigned int x, unsigned int y) const {
-		assert(x < width);
-		assert(y < height);
-		return buffer.at(x + y * width);
+		return buffer.at(index(x, y));
+	}
+
+	/**
+	 * \brief Raw 1/Z values, row by row, starting at the bottom row of the buffer.
+	 */
+	const depth_t *data() const {
+		return buffer.data();
 	}
 
 	constexpr unsigned int get_width() const {
@@ -65,6 +157,19 @@ public:
 		return height;
 	}
 
+	constexpr unsigned int get_origin_y() const {
+		return origin_y;
+	}
+
+	/**
+	 * \brief Project a point to pixel coordinates the same way triangle() does.
+	 *
+	 * The Z coordinate is left untouched.
+	 */
+	static constexpr Point3D project(Point3D p, double d, Vector2D offset) {
+		return { p.x * (d / -p.z) + offset.x, p.y * (d / -p.z) + offset.y, p.z };
+	}
+
 	/**
 	 * \brief Replace a 1/Z value with a *lower* value.
 	 *
@@ -72,27 +177,56 @@ public:
 	 */
 	bool replace(unsigned int x, unsigned int y, double inv_z) {
 		bool lower = (*this)(x, y) > inv_z;
-		(*this)(x, y) = lower ? inv_z : (*this)(x, y);
+		(*this)(x, y) = lower ? (depth_t)inv_z : (*this)(x, y);
+		if (lower) {
+			touch(x, y);
+		}
 		return lower;
 	}
 
+	/**
+	 * \brief Check whether all pixels in a rectangle have a 1/Z value that is at most inv_z.
+	 *
+	 * If so, nothing with a 1/Z value of at least inv_z can be visible in that rectangle.
+	 *
+	 * \param x0, y0, x1, y1 Inclusive bounds of the rectangle.
+	 */
+	bool occluded(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1, double inv_z);
+
 	/**
 	 * \brief Place a triangle in the ZBuffer.
 	 *
 	 * \param d Scale factor.
+	 *
+	 * \return false if the triangle was skipped because it is hidden entirely.
 	 */
-	void triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, double bias);
+	bool triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, double bias);
 
 	void clear() {
 		for (auto &e : buffer) {
-			e = std::numeric_limits<double>::infinity();
+			e = std::numeric_limits<depth_t>::infinity();
 		}
+		hiz_fine.clear();
+		hiz_coarse.clear();
 	}
 };
 
+/**
+ * \brief ZBuffer that also stores which triangle is visible at each pixel.
+ *
+ * With GRAPHICS_ZBUFFER_COMPACT the figure & triangle ID are packed in a single 32-bit
+ * index into a list of all triangles of all figures, so a pixel takes 8 instead of 14
+ * bytes. set_figure_offsets() must be called before placing triangles in that case.
+ */
 class TaggedZBuffer : public ZBuffer {
+#if GRAPHICS_ZBUFFER_COMPACT
+	std::vector<u_int32_t> ids;
+	// Index of the first triangle of each figure.
+	std::vector<u_int32_t> figure_offsets;
+#else
 	std::vector<u_int16_t> figure_ids;
 	std::vector<u_int32_t> triangle_ids;
+#endif
 
 public:
 	struct IdPair {
@@ -116,11 +250,43 @@ public:
 
 	TaggedZBuffer() : ZBuffer() {}
 
-	TaggedZBuffer(unsigned int width, unsigned int height) : ZBuffer(width, height) {
-		figure_ids.resize(width * height);
-		triangle_ids.resize(width * height);
+	TaggedZBuffer(unsigned int width, unsigned int height, unsigned int origin_y = 0)
+		: ZBuffer(width, height, origin_y)
+	{
+#if GRAPHICS_ZBUFFER_COMPACT
+		ids.resize((size_t)width * height);
+#else
+		figure_ids.resize((size_t)width * height);
+		triangle_ids.resize((size_t)width * height);
+#endif
 		clear();
 	}
+
+	/**
+	 * \brief Set the amount of triangles of each figure that will be placed.
+	 *
+	 * This is only needed to pack IDs with GRAPHICS_ZBUFFER_COMPACT.
+	 *
+	 * \param begin, end Range of figures with a `triangles_count()` method.
+	 */
+	template<typename It>
+	void set_figure_offsets(It begin, It end) {
+#if GRAPHICS_ZBUFFER_COMPACT
+		figure_offsets.clear();
+		size_t n = 0;
+		for (auto it = begin; it != end; it++) {
+			figure_offsets.push_back(n);
+			n += it->triangles_count();
+		}
+		// UINT32_MAX is reserved for empty pixels.
+		if (n >= std::numeric_limits<u_int32_t>::max()) {
+			throw std::length_error("too many triangles for a compact ZBuffer");
+		}
+#else
+		(void)begin;
+		(void)end;
+#endif
+	}
 	
 	/**
 	 * \brief Set a figure & triangle ID at a pixel if the given 1/Z value is smaller.
@@ -129,9 +295,9 @@ public:
 		bool lower = (*this)(x, y) > pair.inv_z;
 		if (lower) {
 			(*this)(x, y) = pair.inv_z;
+			touch(x, y);
 			// Should be fine since the lengths of all buffers are equal
-			figure_ids[x + y * get_width()] = pair.figure_id;
-			triangle_ids[x + y * get_width()] = pair.triangle_id;
+			store_id(index(x, y), pair);
 		}
 	}
 
@@ -139,14 +305,8 @@ public:
 	 * \brief Get the figure & triangle ID at a pixel.
 	 */
 	IdPair get(unsigned int x, unsigned int y) {
-		assert(x < get_width());
-		assert(y < get_height());
 		auto inv_z = (*this)(x, y); // Take advantage of bounds check.
-		return {
-			figure_ids[x + y * get_width()],
-			triangle_ids[x + y * get_width()],
-			inv_z
-		};
+		return load_id(index(x, y), inv_z);
 	}
 
 	/**
@@ -154,17 +314,72 @@ public:
 	 *
 	 * \param d Scale factor.
 	 * \param pair Pair of figure-triangle IDs. It's inv_z value is ignored.
+	 *
+	 * \return false if the triangle was skipped because it is hidden entirely.
+	 */
+	bool triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, IdPair, double bias);
+
+	/**
+	 * \brief Place the part of a triangle that lies inside a tile in the ZBuffer.
+	 *
+	 * Triangles placed in different tiles never touch the same memory, so tiles can be
+	 * filled concurrently.
+	 *
+	 * \param writes Incremented for every pixel that is written to.
+	 *
+	 * \return false if the triangle was skipped because it is hidden entirely inside the
+	 * tile.
 	 */
-	void triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, IdPair, double bias);
+	bool triangle(
+		Point3D a, Point3D b, Point3D c,
+		double d, Vector2D offset,
+		IdPair, double bias,
+		const render::TileGrid::Tile &clip,
+		size_t &writes
+	);
 
 	void clear() {
 		ZBuffer::clear();
+#if GRAPHICS_ZBUFFER_COMPACT
+		for (auto &e : ids) {
+			e = std::numeric_limits<u_int32_t>::max();
+		}
+#else
 		for (auto &e : figure_ids) {
 			e = std::numeric_limits<u_int16_t>::max();
 		}
 		for (auto &e : triangle_ids) {
 			e = std::numeric_limits<u_int32_t>::max();
 		}
+#endif
+	}
+
+private:
+	void store_id(size_t i, IdPair pair) {
+#if GRAPHICS_ZBUFFER_COMPACT
+		assert(pair.figure_id < figure_offsets.size());
+		ids[i] = figure_offsets[pair.figure_id] + pair.triangle_id;
+#else
+		figure_ids[i] = pair.figure_id;
+		triangle_ids[i] = pair.triangle_id;
+#endif
+	}
+
+	IdPair load_id(size_t i, double inv_z) const {
+#if GRAPHICS_ZBUFFER_COMPACT
+		auto id = ids[i];
+		if (id == std::numeric_limits<u_int32_t>::max()) {
+			return {
+				std::numeric_limits<u_int16_t>::max(),
+				std::numeric_limits<u_int32_t>::max(),
+				inv_z
+			};
+		}
+		auto f = std::upper_bound(figure_offsets.begin(), figure_offsets.end(), id) - figure_offsets.begin() - 1;
+		return { (u_int16_t)f, id - figure_offsets[f], inv_z };
+#else
+		return { figure_ids[i], triangle_ids[i], inv_z };
+#endif
 	}
 };
 
@@ -0,0 +1,72 @@
+#include "arena.h"
+
+namespace engine {
+namespace util {
+
+using namespace std;
+
+void *Arena::Upstream::do_allocate(size_t bytes, size_t alignment) {
+	auto p = pmr::new_delete_resource()->allocate(bytes, alignment);
+	stats.blocks++;
+	stats.block_bytes += bytes;
+	return p;
+}
+
+void Arena::Upstream::do_deallocate(void *p, size_t bytes, size_t alignment) {
+	pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+bool Arena::Upstream::do_is_equal(const pmr::memory_resource &other) const noexcept {
+	return this == &other;
+}
+
+Arena::Arena()
+	: upstream(stats)
+	, blocks(ARENA_BLOCK_SIZE, &upstream)
+{}
+
+void *Arena::do_allocate(size_t bytes, size_t alignment) {
+	if (bytes >= ARENA_LARGE_SIZE) {
+		// The heap is thread-safe by itself.
+		auto p = pmr::new_delete_resource()->allocate(bytes, alignment);
+		lock_guard<mutex> guard(lock);
+		stats.allocations++;
+		stats.bytes += bytes;
+		stats.large_allocations++;
+		return p;
+	}
+	lock_guard<mutex> guard(lock);
+	stats.allocations++;
+	stats.bytes += bytes;
+	return blocks.allocate(bytes, alignment);
+}
+
+void Arena::do_deallocate(void *p, size_t bytes, size_t alignment) {
+	if (bytes >= ARENA_LARGE_SIZE) {
+		pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+		return;
+	}
+	lock_guard<mutex> guard(lock);
+	stats.bytes_abandoned += bytes;
+}
+
+bool Arena::do_is_equal(const pmr::memory_resource &other) const noexcept {
+	return this == &other;
+}
+
+Arena::Stats Arena::get_stats() {
+	lock_guard<mutex> guard(lock);
+	return stats;
+}
+
+ostream &operator<<(ostream &out, const Arena::Stats &stats) {
+	return out << stats.allocations << " allocations ("
+		<< stats.large_allocations << " large) of "
+		<< stats.bytes << " bytes, "
+		<< stats.bytes_abandoned << " bytes abandoned, "
+		<< stats.blocks << " blocks of "
+		<< stats.block_bytes << " bytes";
+}
+
+}
+}
@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <memory>
 #include <string>
 #include <vector>
 #include "math/point3d.h"
@@ -15,7 +16,9 @@
 #include "render/fragment.h"
 #include "render/geometry.h"
 #include "render/light.h"
+#include "render/shadow_cache.h"
 #include "render/triangle.h"
+#include "thread_pool.h"
 #include "zbuffer.h"
 
 using namespace std;
@@ -57,11 +60,16 @@ struct cgengine_context {
 	vector<TriangleFigure> triangle_figures;
 	Lights lights;
 	Frustum frustum;
+	Options opts;
+	mutable ShadowCache shadow_cache;
+	// Created on the first draw so the threads aren't started again for every frame.
+	mutable unique_ptr<util::ThreadPool> pool;
 };
 
 struct cgengine_framebuffer {
 	img::EasyImage img;
 	TaggedZBuffer zbuf;
+	Stats stats;
 };
 
 struct cgengine_error {
@@ -88,6 +96,7 @@ void cgengine_destroy_context(struct cgengine_context *ctx) {
 
 void cgengine_context_clear_figures(struct cgengine_context *ctx) {
 	ctx->triangle_figures.clear();
+	ctx->lights.zfigures.clear();
 }
 
 void cgengine_context_set_camera(struct cgengine_context *ctx, double fov, double aspect, double near, double far) {
@@ -107,6 +116,47 @@ void cgengine_context_move_camera(
 	ctx->lights.eye = look_direction(p, d, ctx->lights.inv_eye);
 }
 
+void cgengine_context_set_threads(struct cgengine_context *ctx, unsigned int threads) {
+	if (threads != ctx->opts.threads) {
+		ctx->pool.reset();
+	}
+	ctx->opts.threads = threads;
+}
+
+void cgengine_context_set_front_to_back(struct cgengine_context *ctx, int enable) {
+	ctx->opts.front_to_back = enable != 0;
+}
+
+void cgengine_context_add_point_light(
+	struct cgengine_context *ctx,
+	const struct cgengine_point3d *pos,
+	const struct cgengine_color *diffuse,
+	const struct cgengine_color *specular
+) {
+	Point3D p(pos->x, pos->y, pos->z);
+	ctx->lights.point.push_back({
+		p * ctx->lights.eye,
+		{ diffuse->r, diffuse->g, diffuse->b },
+		{ specular->r, specular->g, specular->b },
+		0, // Not a spot light
+		{ Matrix4D(), Matrix4D(), ZBuffer(0, 0), NAN, Vector2D() },
+		p,
+	});
+}
+
+void cgengine_context_clear_lights(struct cgengine_context *ctx) {
+	ctx->lights.point.clear();
+}
+
+void cgengine_context_set_shadows(struct cgengine_context *ctx, unsigned int mask) {
+	ctx->lights.shadows = mask > 0;
+	ctx->lights.shadow_mask = mask;
+}
+
+void cgengine_context_set_shadow_filter(struct cgengine_context *ctx, unsigned int radius) {
+	ctx->lights.shadow_filter = min(radius, Lights::SHADOW_FILTER_MAX);
+}
+
 void cgengine_context_add_face_shape(
 	struct cgengine_context *ctx,
 	const struct cgengine_face_shape *shape,
@@ -115,10 +165,16 @@ void cgengine_context_add_face_shape(
 	double scale,
 	int flags
 ) {
-	auto m = isometry_to_matrix(iso) * ctx->lights.eye;
+	auto world = isometry_to_matrix(iso);
 	bool with_point_normals = (flags & 1) > 0;
 	bool with_cubemap = (flags & 2) > 0;
-	ctx->triangle_figures.push_back(convert(shape->shape, mat->mat, m, scale, with_cubemap, with_point_normals));
+	ctx->triangle_figures.push_back(convert(shape->shape, mat->mat, world * ctx->lights.eye, scale, with_cubemap, with_point_normals));
+	if (ctx->lights.shadows) {
+		// We need the full object for shadowing. It is converted separately so it is exactly
+		// the same no matter where the camera is, which lets the shadow maps be reused.
+		auto f = convert(shape->shape, mat->mat, world, scale, with_cubemap, with_point_normals);
+		ctx->lights.zfigures.push_back(ZBufferTriangleFigure(f));
+	}
 	ctx->frustum.clip(ctx->triangle_figures.back());
 }
 
@@ -127,6 +183,9 @@ void cgengine_context_draw(
 	struct cgengine_framebuffer *fb,
 	unsigned int mode
 ) {
+	if (!ctx->pool) {
+		ctx->pool = make_unique<util::ThreadPool>(ctx->opts.threads);
+	}
 	Vector2D offset = { fb->img.get_width() / 2.0, fb->img.get_height() / 2.0 };
 	draw(
 		ctx->triangle_figures,
@@ -136,12 +195,16 @@ void cgengine_context_draw(
 		fb->img.get_width() / tan(ctx->frustum.fov / 2) / 2,
 		offset,
 		fb->img,
-		fb->zbuf
+		fb->zbuf,
+		ctx->opts,
+		*ctx->pool,
+		&fb->stats,
+		&ctx->shadow_cache
 	);
 }
 
 struct cgengine_framebuffer *cgengine_create_framebuffer(unsigned int width, unsigned int height) {
-	return new cgengine_framebuffer { { width, height }, { width, height } };
+	return new cgengine_framebuffer { { width, height }, { width, height }, {} };
 }
 
 void cgengine_destroy_framebuffer(struct cgengine_framebuffer *fb) {
@@ -172,6 +235,18 @@ void cgengine_framebuffer_clear(
 ) {
 	fb->img.clear({ bg->r, bg->g, bg->b });
 	fb->zbuf.clear();
+	fb->stats = {};
+}
+
+void cgengine_framebuffer_get_stats(
+	const struct cgengine_framebuffer *fb,
+	struct cgengine_stats *stats
+) {
+	stats->occluded_triangles = fb->stats.occluded_triangles;
+	stats->pixel_writes = fb->stats.pixel_writes;
+	stats->pixels_covered = fb->stats.pixels_covered;
+	stats->shadow_cache_hits = fb->stats.shadow_cache_hits;
+	stats->shadow_cache_misses = fb->stats.shadow_cache_misses;
 }
 
 struct cgengine_material *cgengine_create_material(
@@ -70,6 +70,37 @@ static size_t calc_size(unsigned int width, unsigned int height) {
 	return calc_meta_size() + ((width * 3 + 3) & ~3L) * height;
 }
 
+/**
+ * \brief Write the headers of a BMP file, including the 2 bytes of padding in front.
+ */
+static void write_header(void *data, unsigned int width, unsigned int height) {
+	bmpfile_magic *fm = (bmpfile_magic *)data;
+	bmpfile_header *fh = (bmpfile_header *)((char *)data + sizeof(*fm));
+	bmp_header *h = (bmp_header *)((char *)data + sizeof(*fm) + sizeof(*fh));
+
+	fm->padding[0] = 0;
+	fm->padding[1] = 0;
+	fm->magic[0] = 'B';
+	fm->magic[1] = 'M';
+
+	fh->file_size = htole32(calc_size(width, height) - 2);
+	fh->reserved_1 = 0;
+	fh->reserved_2 = 0;
+	fh->bmp_offset = htole32(calc_meta_size() - 2);
+
+	h->header_size = htole32(sizeof(*h));
+	h->width = htole32(width);
+	h->height = htole32(height);
+	h->nplanes = htole16(1);
+	h->bits_per_pixel = htole16(24); // 3bytes or 24 bits per pixel
+	h->compress_type = 0;                     // no compression
+	h->pixel_size = htole32(((width * 3 + 3) & ~3) * height);
+	h->hres = htole32(11811); // 11811 pixels/meter or 300dpi
+	h->vres = htole32(11811); // 11811 pixels/meter or 300dpi
+	h->ncolors = 0;                    // no color palette
+	h->nimpcolors = 0;                 // no important colors
+}
+
 // copy-pasted from lparser.cc to allow these classes to be used independently
 // from each other
 class enable_exceptions {
@@ -151,36 +182,18 @@ const char *img::UnsupportedFileTypeException::what() const throw() {
 img::EasyImage::EasyImage() : img::EasyImage::EasyImage(0, 0) {}
 
 img::EasyImage::EasyImage(unsigned int width, unsigned int height, Color color) {
-	// FIXME some bytes are unitialized. This isn't too bad right now but may leak secrets
-	// if this code is used elsewhere.
 	data = malloc(calc_size(width, height));
 	if (data == NULL)
 		throw std::bad_alloc();
 	row_size = (width * 3 + 3) & ~3; // Round up to multiple of 4
 
-	bmpfile_magic *fm = (bmpfile_magic *)data;
-	bmpfile_header *fh = (bmpfile_header *)((char *)data + sizeof(*fm));
-	bmp_header *h = (bmp_header *)((char *)data + sizeof(*fm) + sizeof(*fh));
+	write_header(data, width, height);
 
-	fm->padding[0] = 0;
-	fm->padding[1] = 0;
-	fm->magic[0] = 'B';
-	fm->magic[1] = 'M';
-
-	fh->file_size = htole32(calc_size(width, height) - 2);
-	fh->bmp_offset = htole32(calc_meta_size() - 2);
-
-	h->header_size = htole32(sizeof(*h));
-	h->width = htole32(width);
-	h->height = htole32(height);
-	h->nplanes = htole16(1);
-	h->bits_per_pixel = htole16(24); // 3bytes or 24 bits per pixel
-	h->compress_type = 0;                     // no compression
-	h->pixel_size = htole32(row_size * height);
-	h->hres = htole32(11811); // 11811 pixels/meter or 300dpi
-	h->vres = htole32(11811); // 11811 pixels/meter or 300dpi
-	h->ncolors = 0;                    // no color palette
-	h->nimpcolors = 0;                 // no important colors
+	// Rows are padded to a multiple of 4 bytes. Clear the padding so no stale memory ends up
+	// in files.
+	for (unsigned int y = 0; y < height; y++) {
+		memset((char *)data + calc_meta_size() + (size_t)row_size * y + width * 3, 0, row_size - width * 3);
+	}
 
 	clear(color);
 }
@@ -379,9 +392,26 @@ void img::EasyImage::draw_zbuf_line_clip(
 	);
 }
 
+std::string img::EasyImage::bmp_file_header(unsigned int width, unsigned int height) {
+	std::string header(calc_meta_size(), '\0');
+	write_header(header.data(), width, height);
+	return header.substr(2);
+}
+
+std::string_view img::EasyImage::bmp_pixels() const {
+	assert(data != nullptr && "Image was moved");
+	return { (const char *)data + calc_meta_size(), (size_t)row_size * get_height() };
+}
+
+std::string_view img::EasyImage::bmp_file() const {
+	assert(data != nullptr && "Image was moved");
+	return { (const char *)data + 2, calc_size(get_width(), get_height()) - 2 };
+}
+
 std::ostream &img::operator<<(std::ostream &out, EasyImage const &image) {
 	enable_exceptions(out, std::ios::badbit | std::ios::failbit);
-	out.write((char *)image.data + 2, calc_size(image.get_width(), image.get_height()) - 2);
+	auto file = image.bmp_file();
+	out.write(file.data(), file.size());
 	return out;
 }
 std::istream &img::operator>>(std::istream &in, EasyImage &image) {
@@ -1,18 +1,43 @@
 #include "easy_image.h"
 #include "engine.h"
+#include "image_writer.h"
 #include "ini_configuration.h"
 #include "intro.h"
 #include "l_system.h"
+#include "log.h"
+#include "render/fragment.h"
+#include "render/stats.h"
 #include "shapes.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
 
 namespace engine {
 
-img::EasyImage generate_image(const ini::Configuration &conf) {
+/**
+ * \brief How the statistics of each file are reported, if at all.
+ */
+enum StatsFormat {
+	STATS_NONE,
+	STATS_JSON,
+	STATS_CSV,
+};
+
+img::EasyImage generate_image(const ini::Configuration &conf, render::Stats *stats) {
 	auto type = conf["General"]["type"].as_string_or_die();
 
 	if (type == "IntroColorRectangle") {
@@ -28,68 +53,424 @@ img::EasyImage generate_image(const ini::Configuration &conf) {
 	} else if (type == "ZBufferedWireframe") {
 		return shapes::wireframe(conf, true);
 	} else if (type == "ZBuffering") {
-		return shapes::triangles(conf, false);
+		return shapes::triangles(conf, false, stats);
 	} else if (type == "LightedZBuffering") {
-		return shapes::triangles(conf, true);
+		return shapes::triangles(conf, true, stats);
 	} else {
 		throw TypeException(type);
 	}
 }
 
+/**
+ * \brief Generate an image in bands of rows, if its type supports it.
+ *
+ * \return false if it doesn't, in which case nothing is generated.
+ */
+static bool generate_image_bands(
+	const ini::Configuration &conf,
+	unsigned int band_height,
+	const render::BandSink &sink,
+	render::Stats *stats
+) {
+	auto type = conf["General"]["type"].as_string_or_die();
+
+	if (type == "ZBuffering") {
+		shapes::triangles(conf, false, band_height, sink, stats);
+	} else if (type == "LightedZBuffering") {
+		shapes::triangles(conf, true, band_height, sink, stats);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static void json_string(std::ostream &out, const std::string &s) {
+	out << '"';
+	for (char c : s) {
+		if (c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if ((unsigned char)c < 0x20) {
+			const char *hex = "0123456789abcdef";
+			out << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
 }
 
-int main(int argc, char const *argv[]) {
+static void csv_string(std::ostream &out, const std::string &s) {
+	out << '"';
+	for (char c : s) {
+		out << c;
+		if (c == '"') {
+			out << c;
+		}
+	}
+	out << '"';
+}
+
+/**
+ * \brief Write the statistics of rendering one file.
+ *
+ * The peak memory is that of the whole process, so with multiple jobs it includes the other
+ * files rendered so far.
+ *
+ * \param seconds The wall time of the whole file.
+ */
+static void write_stats(
+	std::ostream &out,
+	StatsFormat format,
+	const std::string &fileName,
+	const render::Stats &stats,
+	double seconds
+) {
+	struct rusage usage;
+	size_t peak = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+	double overdraw = stats.pixels_covered > 0 ? (double)stats.pixel_writes / stats.pixels_covered : 0;
+
+	// Name & value of every counter after the stages, in order. The overdraw comes last.
+	std::pair<const char *, size_t> fields[] = {
+		{ "triangles_in", stats.triangles_in },
+		{ "triangles_out", stats.triangles_out },
+		{ "occluded_triangles", stats.occluded_triangles },
+		{ "pixel_writes", stats.pixel_writes },
+		{ "pixels_covered", stats.pixels_covered },
+		{ "pixels_shaded", stats.pixels_shaded },
+		{ "shadow_cache_hits", stats.shadow_cache_hits },
+		{ "shadow_cache_misses", stats.shadow_cache_misses },
+		{ "peak_rss_kib", peak },
+	};
+
+	switch (format) {
+	case STATS_NONE:
+		break;
+	case STATS_JSON:
+		out << "{\"file\":";
+		json_string(out, fileName);
+		out << ",\"seconds\":" << seconds << ",\"stages\":{";
+		for (int i = 0; i < render::STAGES; i++) {
+			out << (i > 0 ? "," : "") << '"' << render::stage_name((render::Stage)i) << "\":"
+				<< stats.stage_seconds[i];
+		}
+		out << '}';
+		for (auto &f : fields) {
+			out << ",\"" << f.first << "\":" << f.second;
+		}
+		out << ",\"overdraw\":" << overdraw << "}\n";
+		break;
+	case STATS_CSV:
+		out << "file,seconds";
+		for (int i = 0; i < render::STAGES; i++) {
+			out << ',' << render::stage_name((render::Stage)i) << "_seconds";
+		}
+		for (auto &f : fields) {
+			out << ',' << f.first;
+		}
+		out << ",overdraw\n";
+		csv_string(out, fileName);
+		out << ',' << seconds;
+		for (int i = 0; i < render::STAGES; i++) {
+			out << ',' << stats.stage_seconds[i];
+		}
+		for (auto &f : fields) {
+			out << ',' << f.second;
+		}
+		out << ',' << overdraw << '\n';
+		break;
+	}
+}
+
+}
+
+/**
+ * \brief Render a single INI file to an image file next to it.
+ *
+ * The format can be overridden per file with General.outputFormat.
+ *
+ * If General.bandHeight is set, images that support it are drawn in bands of that many rows,
+ * which are written to the file as soon as they are done.
+ *
+ * If statistics are requested they are written next to the image once it is done, with the
+ * extension .stats.json or .stats.csv.
+ *
+ * std::bad_alloc is not caught.
+ *
+ * \return The exit code for this file.
+ */
+static int render_file(
+	std::string fileName,
+	std::ostream &out,
+	std::ostream &err,
+	engine::ImageFormat format,
+	engine::StatsFormat statsFormat
+) {
+	using engine::render::StageTimer;
 	int retVal = 0;
+	auto start = std::chrono::steady_clock::now();
+	engine::render::Stats stats;
+	auto *st = statsFormat != engine::STATS_NONE ? &stats : nullptr;
+	ini::Configuration conf;
+	out << "gen " << fileName << std::endl;
 	try {
-		std::vector<std::string> args =
-			std::vector<std::string>(argv + 1, argv + argc);
-		if (args.empty()) {
-			std::ifstream fileIn("filelist");
-			std::string filelistName;
-			while (std::getline(fileIn, filelistName)) {
-				args.push_back(filelistName);
+		StageTimer timer(st, engine::render::STAGE_PARSE);
+		std::ifstream fin(fileName);
+		fin >> conf;
+		fin.close();
+	} catch (ini::ParseException &ex) {
+		err << "Error parsing file: " << fileName << ": "
+			<< ex.what() << std::endl;
+		return 1;
+	}
+
+	std::string formatName;
+	if (conf["General"]["outputFormat"].as_string_if_exists(formatName)
+		&& !engine::image_format_from_name(formatName, format)) {
+		err << "Invalid image format: " << fileName << ": " << formatName << std::endl;
+		return 1;
+	}
+
+	auto withExtension = [&fileName](const std::string &extension) {
+		std::string::size_type pos = fileName.rfind('.');
+		if (pos == std::string::npos) {
+			// filename does not contain a '.' --> append the extension
+			return fileName + extension;
+		} else {
+			return fileName.substr(0, pos) + extension;
+		}
+	};
+	std::string imageName = withExtension(std::string(".") + engine::image_format_extension(format));
+
+	auto report = [&]() {
+		if (st == nullptr) {
+			return;
+		}
+		std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+		auto statsName = withExtension(statsFormat == engine::STATS_JSON ? ".stats.json" : ".stats.csv");
+		std::ofstream fout(statsName);
+		engine::write_stats(fout, statsFormat, fileName, stats, seconds.count());
+		fout.close();
+		if (!fout) {
+			err << "Failed to write statistics to file: " << statsName << std::endl;
+			retVal = 1;
+		}
+	};
+
+	auto bandHeight = conf["General"]["bandHeight"].as_int_or_default(0);
+	if (bandHeight > 0) {
+		std::optional<engine::ImageStream> stream;
+		// Errors of the stream are reported like those of write_image(), anything else is
+		// passed on.
+		std::string writeError;
+		auto writing = [&](auto f) {
+			try {
+				f();
+			} catch (const std::system_error &ex) {
+				writeError = ex.what();
+				throw;
 			}
+		};
+		engine::render::BandSink sink {
+			[&](unsigned int width, unsigned int height) {
+				StageTimer timer(st, engine::render::STAGE_WRITE);
+				writing([&]() { stream.emplace(imageName, width, height, format); });
+			},
+			[&](const img::EasyImage &band, unsigned int y) {
+				StageTimer timer(st, engine::render::STAGE_WRITE);
+				writing([&]() { stream->write(band, y); });
+			},
+		};
+		try {
+			if (engine::generate_image_bands(conf, bandHeight, sink, st)) {
+				if (stream.has_value()) {
+					{
+						StageTimer timer(st, engine::render::STAGE_WRITE);
+						writing([&]() { stream->close(); });
+					}
+					report();
+				} else {
+					out << "Could not generate image for " << fileName
+						<< std::endl;
+				}
+				return retVal;
+			}
+		} catch (const std::system_error &ex) {
+			if (writeError.empty()) {
+				throw;
+			}
+			err << "Failed to write image to file: " << writeError
+				<< std::endl;
+			return 1;
 		}
-		for (std::string fileName : args) {
-			ini::Configuration conf;
-			std::cout << "gen " << fileName << std::endl;
+	}
+
+	auto image = engine::generate_image(conf, st);
+	if (image.get_height() > 0 && image.get_width() > 0) {
+		try {
+			StageTimer timer(st, engine::render::STAGE_WRITE);
+			engine::write_image(imageName, image, format);
+		} catch (std::exception &ex) {
+			err << "Failed to write image to file: " << ex.what()
+				<< std::endl;
+			return 1;
+		}
+		report();
+	} else {
+		out << "Could not generate image for " << fileName
+			<< std::endl;
+	}
+	return retVal;
+}
+
+/**
+ * \brief Render files concurrently with the given amount of workers.
+ *
+ * The log of every file is buffered and printed in the same order as the files are given.
+ * Workers don't run further ahead than a few files past the oldest file that hasn't been
+ * printed yet, so at most that many images & logs are in memory at once.
+ *
+ * Running out of memory only fails the file that was being rendered.
+ *
+ * \return The exit code: 100 if any file ran out of memory, otherwise 1 if any file failed.
+ */
+static int render_batch(
+	const std::vector<std::string> &files,
+	unsigned int jobs,
+	engine::ImageFormat format,
+	engine::StatsFormat statsFormat
+) {
+	struct Job {
+		std::ostringstream out, err;
+		int retVal = 0;
+		bool done = false;
+	};
+	const size_t window = 4 * (size_t)jobs;
+
+	std::vector<Job> log(files.size());
+	std::mutex lock;
+	std::condition_variable finished, printed;
+	size_t next = 0, first_unprinted = 0;
+
+	// Split the cores between the files, unless a file asks for something else.
+	engine::util::ThreadPool::set_default_threads(std::max(std::thread::hardware_concurrency() / jobs, 1u));
+
+	auto work = [&]() {
+		for (;;) {
+			size_t i;
+			{
+				std::unique_lock<std::mutex> l(lock);
+				printed.wait(l, [&]() { return next >= files.size() || next < first_unprinted + window; });
+				if (next >= files.size()) {
+					return;
+				}
+				i = next++;
+			}
+			auto &job = log[i];
+			engine::set_log_stream(&job.out);
 			try {
-				std::ifstream fin(fileName);
-				fin >> conf;
-				fin.close();
-			} catch (ini::ParseException &ex) {
-				std::cerr << "Error parsing file: " << fileName << ": "
-						  << ex.what() << std::endl;
-				retVal = 1;
-				continue;
+				job.retVal = render_file(files[i], job.out, job.err, format, statsFormat);
+			} catch (const std::bad_alloc &exception) {
+				job.err << "Error: insufficient memory" << std::endl;
+				job.retVal = 100;
+			}
+			engine::set_log_stream(nullptr);
+			{
+				std::lock_guard<std::mutex> l(lock);
+				job.done = true;
 			}
+			finished.notify_all();
+		}
+	};
+	std::vector<std::thread> workers;
+	workers.reserve(jobs);
+	for (unsigned int i = 0; i < jobs; i++) {
+		workers.emplace_back(work);
+	}
+
+	int retVal = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		auto &job = log[i];
+		{
+			std::unique_lock<std::mutex> l(lock);
+			finished.wait(l, [&]() { return job.done; });
+		}
+		std::cout << job.out.str() << std::flush;
+		std::cerr << job.err.str() << std::flush;
+		retVal = std::max(retVal, job.retVal);
+		// Free the log before letting workers start another file
+		job.out = std::ostringstream();
+		job.err = std::ostringstream();
+		{
+			std::lock_guard<std::mutex> l(lock);
+			first_unprinted = i + 1;
+		}
+		printed.notify_all();
+	}
+
+	for (auto &w : workers) {
+		w.join();
+	}
+	return retVal;
+}
 
-			auto image = engine::generate_image(conf);
-			if (image.get_height() > 0 && image.get_width() > 0) {
-				std::string::size_type pos = fileName.rfind('.');
-				if (pos == std::string::npos) {
-					// filename does not contain a '.' --> append a '.bmp'
-					// suffix
-					fileName += ".bmp";
+int main(int argc, char const *argv[]) {
+	int retVal = 0;
+	try {
+		std::vector<std::string> args;
+		unsigned int jobs = 1;
+		auto format = engine::IMAGE_BMP;
+		auto statsFormat = engine::STATS_NONE;
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			if (arg == "--stats" || arg == "--stats=json") {
+				statsFormat = engine::STATS_JSON;
+			} else if (arg == "--stats=csv") {
+				statsFormat = engine::STATS_CSV;
+			} else if (arg.rfind("--stats=", 0) == 0) {
+				std::cerr << "Invalid statistics format: " << arg.substr(8) << std::endl;
+				return 1;
+			} else if (arg.rfind("-f", 0) == 0) {
+				// Accept both "-f FORMAT" and "-fFORMAT"
+				if (arg.size() == 2 && i + 1 < argc) {
+					arg = argv[++i];
+				} else {
+					arg = arg.substr(2);
+				}
+				if (!engine::image_format_from_name(arg, format)) {
+					std::cerr << "Invalid image format: " << arg << std::endl;
+					return 1;
+				}
+			} else if (arg.rfind("-j", 0) == 0) {
+				// Accept both "-j N" and "-jN"
+				if (arg.size() == 2 && i + 1 < argc) {
+					arg = argv[++i];
 				} else {
-					fileName = fileName.substr(0, pos) + ".bmp";
+					arg = arg.substr(2);
 				}
-				try {
-					std::ofstream f_out(fileName.c_str(), std::ios::trunc |
-															  std::ios::out |
-															  std::ios::binary);
-					f_out << image;
-
-				} catch (std::exception &ex) {
-					std::cerr << "Failed to write image to file: " << ex.what()
-							  << std::endl;
-					retVal = 1;
+				char *end;
+				auto n = strtoul(arg.c_str(), &end, 10);
+				if (arg.empty() || *end != '\0' || n == 0 || n > 1024) {
+					std::cerr << "Invalid amount of jobs: " << arg << std::endl;
+					return 1;
 				}
+				jobs = (unsigned int)n;
 			} else {
-				std::cout << "Could not generate image for " << fileName
-						  << std::endl;
+				args.push_back(arg);
 			}
 		}
+		if (args.empty()) {
+			std::ifstream fileIn("filelist");
+			std::string filelistName;
+			while (std::getline(fileIn, filelistName)) {
+				args.push_back(filelistName);
+			}
+		}
+		if (jobs > 1) {
+			return render_batch(args, jobs, format, statsFormat);
+		}
+		for (std::string fileName : args) {
+			retVal = std::max(retVal, render_file(fileName, std::cout, std::cerr, format, statsFormat));
+		}
 	} catch (const std::bad_alloc &exception) {
 		// When you run out of memory this exception is thrown. When this
 		// happens the return value of the program MUST be '100'. Basically this
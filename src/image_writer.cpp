@@ -0,0 +1,301 @@
+#include "image_writer.h"
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace engine {
+
+using namespace std;
+
+namespace {
+
+void put_be32(char *p, uint32_t v) {
+	p[0] = (char)(v >> 24);
+	p[1] = (char)(v >> 16);
+	p[2] = (char)(v >> 8);
+	p[3] = (char)v;
+}
+
+/**
+ * \brief Write the whole buffer, retrying on partial writes & interrupts.
+ */
+void write_all(int fd, const char *p, size_t n, const string &path) {
+	while (n > 0) {
+		auto w = write(fd, p, n);
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw system_error(errno, generic_category(), "can't write " + path);
+		}
+		p += w;
+		n -= w;
+	}
+}
+
+/**
+ * \brief Like write_all(), but at an offset & without moving the file position.
+ */
+void write_all_at(int fd, const char *p, size_t n, off_t offset, const string &path) {
+	while (n > 0) {
+		auto w = pwrite(fd, p, n, offset);
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw system_error(errno, generic_category(), "can't write " + path);
+		}
+		p += w;
+		n -= w;
+		offset += w;
+	}
+}
+
+/**
+ * \brief Create a new temporary file next to path to write the image to.
+ *
+ * The image is only moved to path once it is complete. Other processes may have the old file
+ * mapped, e.g. as a texture, so it must never be truncated or written in place.
+ */
+int open_for_writing(const string &path, string &tmp) {
+	tmp = path + ".tmpXXXXXX";
+	auto fd = mkostemp(&tmp[0], O_CLOEXEC);
+	if (fd < 0) {
+		throw system_error(errno, generic_category(), "can't open " + path);
+	}
+	// mkostemp() only allows the owner to read the file.
+	fchmod(fd, 0644);
+	return fd;
+}
+
+/**
+ * \brief Close the temporary file & move it to path.
+ */
+void finish_writing(int fd, const string &tmp, const string &path) {
+	if (::close(fd) < 0) {
+		auto e = errno;
+		unlink(tmp.c_str());
+		throw system_error(e, generic_category(), "can't write " + path);
+	}
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		auto e = errno;
+		unlink(tmp.c_str());
+		throw system_error(e, generic_category(), "can't write " + path);
+	}
+}
+
+/**
+ * \brief Close & remove a temporary file that won't be finished.
+ */
+void abandon_writing(int fd, const string &tmp) {
+	::close(fd);
+	unlink(tmp.c_str());
+}
+
+}
+
+bool image_format_from_name(const string &name, ImageFormat &format) {
+	if (name == "bmp") {
+		format = IMAGE_BMP;
+	} else if (name == "qoi") {
+		format = IMAGE_QOI;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+const char *image_format_extension(ImageFormat format) {
+	switch (format) {
+	case IMAGE_BMP: return "bmp";
+	case IMAGE_QOI: return "qoi";
+	}
+	return "bmp";
+}
+
+namespace {
+const unsigned char QOI_OP_INDEX = 0x00, QOI_OP_DIFF = 0x40, QOI_OP_LUMA = 0x80, QOI_OP_RUN = 0xc0, QOI_OP_RGB = 0xfe;
+const unsigned int QOI_MAX_RUN = 62;
+}
+
+void QoiEncoder::header(unsigned int width, unsigned int height, vector<char> &out) {
+	auto p = out.size();
+	out.resize(p + 14);
+	memcpy(&out[p], "qoif", 4);
+	put_be32(&out[p + 4], width);
+	put_be32(&out[p + 8], height);
+	out[p + 12] = 3; // RGB
+	out[p + 13] = 0; // sRGB with linear alpha
+}
+
+void QoiEncoder::rows(const img::EasyImage &image, vector<char> &out) {
+	auto w = image.get_width(), h = image.get_height();
+	// Room for every pixel as QOI_OP_RGB, plus the run left over from the previous rows.
+	auto start = out.size();
+	out.resize(start + (size_t)w * h * 4 + 1);
+	auto p = out.data() + start;
+
+	// Keep the state in locals so the compiler doesn't have to store it after every pixel.
+	auto pr = this->pr, pg = this->pg, pb = this->pb;
+	auto run = this->run;
+	// BMP rows are stored bottom-up, QOI rows top-down.
+	for (unsigned int y = h; y-- > 0; ) {
+		auto row = &image(0, y);
+		for (unsigned int x = 0; x < w; x++) {
+			auto r = row[x].r, g = row[x].g, b = row[x].b;
+			if (r == pr && g == pg && b == pb) {
+				if (++run == QOI_MAX_RUN) {
+					*p++ = (char)(QOI_OP_RUN | (run - 1));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0) {
+				*p++ = (char)(QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+
+			auto &slot = index[(r * 3 + g * 5 + b * 7 + 255 * 11) % 64];
+			if (slot.valid && slot.r == r && slot.g == g && slot.b == b) {
+				*p++ = (char)(QOI_OP_INDEX | (&slot - index));
+			} else {
+				slot = { r, g, b, true };
+				int8_t dr = r - pr, dg = g - pg, db = b - pb;
+				int8_t dr_dg = dr - dg, db_dg = db - dg;
+				if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+					*p++ = (char)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+				} else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+					*p++ = (char)(QOI_OP_LUMA | (dg + 32));
+					*p++ = (char)((dr_dg + 8) << 4 | (db_dg + 8));
+				} else {
+					*p++ = (char)QOI_OP_RGB;
+					*p++ = (char)r;
+					*p++ = (char)g;
+					*p++ = (char)b;
+				}
+			}
+			pr = r, pg = g, pb = b;
+		}
+	}
+	this->pr = pr, this->pg = pg, this->pb = pb;
+	this->run = run;
+	out.resize(p - out.data());
+}
+
+void QoiEncoder::finish(vector<char> &out) {
+	if (run > 0) {
+		out.push_back((char)(QOI_OP_RUN | (run - 1)));
+		run = 0;
+	}
+	const char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	out.insert(out.end(), end, end + sizeof(end));
+}
+
+vector<char> encode_qoi(const img::EasyImage &image) {
+	vector<char> out;
+	QoiEncoder qoi;
+	QoiEncoder::header(image.get_width(), image.get_height(), out);
+	qoi.rows(image, out);
+	qoi.finish(out);
+	return out;
+}
+
+void write_image(const string &path, const img::EasyImage &image, ImageFormat format) {
+	string tmp;
+	auto fd = open_for_writing(path, tmp);
+	try {
+		switch (format) {
+		case IMAGE_BMP: {
+			auto file = image.bmp_file();
+			write_all(fd, file.data(), file.size(), path);
+			break;
+		}
+		case IMAGE_QOI: {
+			auto file = encode_qoi(image);
+			write_all(fd, file.data(), file.size(), path);
+			break;
+		}
+		}
+	} catch (...) {
+		abandon_writing(fd, tmp);
+		throw;
+	}
+	finish_writing(fd, tmp, path);
+}
+
+ImageStream::ImageStream(const string &path, unsigned int width, unsigned int height, ImageFormat format)
+	: path(path)
+	, fd(open_for_writing(path, tmp))
+	, format(format)
+	, width(width)
+	, height(height)
+	, next_top(height)
+	, row_size(((size_t)width * 3 + 3) & ~(size_t)3)
+{
+	try {
+		switch (format) {
+		case IMAGE_BMP: {
+			auto header = img::EasyImage::bmp_file_header(width, height);
+			write_all(fd, header.data(), header.size(), path);
+			break;
+		}
+		case IMAGE_QOI:
+			QoiEncoder::header(width, height, buffer);
+			break;
+		}
+	} catch (...) {
+		abandon_writing(fd, tmp);
+		throw;
+	}
+}
+
+ImageStream::~ImageStream() {
+	if (fd >= 0) {
+		abandon_writing(fd, tmp);
+	}
+}
+
+void ImageStream::write(const img::EasyImage &band, unsigned int y) {
+	assert(fd >= 0);
+	assert(band.get_width() == width);
+	assert(y + band.get_height() <= height);
+	switch (format) {
+	case IMAGE_BMP: {
+		auto rows = band.bmp_pixels();
+		// The headers of a band are as large as those of the whole image.
+		auto header = band.bmp_file().size() - rows.size();
+		write_all_at(fd, rows.data(), rows.size(), header + row_size * y, path);
+		break;
+	}
+	case IMAGE_QOI:
+		if (y + band.get_height() != next_top) {
+			throw logic_error("QOI bands must be written from the top down");
+		}
+		next_top = y;
+		qoi.rows(band, buffer);
+		write_all(fd, buffer.data(), buffer.size(), path);
+		buffer.clear();
+		break;
+	}
+}
+
+void ImageStream::close() {
+	if (format == IMAGE_QOI) {
+		qoi.finish(buffer);
+		write_all(fd, buffer.data(), buffer.size(), path);
+		buffer.clear();
+	}
+	auto fd = this->fd;
+	this->fd = -1;
+	finish_writing(fd, tmp, path);
+}
+
+}
@@ -0,0 +1,18 @@
+#include "log.h"
+#include <iostream>
+
+namespace engine {
+
+using namespace std;
+
+static thread_local ostream *current = nullptr;
+
+ostream &log_stream() {
+	return current != nullptr ? *current : cout;
+}
+
+void set_log_stream(ostream *out) {
+	current = out;
+}
+
+}
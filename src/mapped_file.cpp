@@ -0,0 +1,48 @@
+#include "mapped_file.h"
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace engine {
+namespace util {
+
+using namespace std;
+
+MappedFile::MappedFile(const string &path, bool sequential) {
+	auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		throw system_error(errno, generic_category(), "can't open " + path);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		auto e = errno;
+		close(fd);
+		throw system_error(e, generic_category(), "can't stat " + path);
+	}
+	len = (size_t)st.st_size;
+	// Mapping 0 bytes fails, but an empty file is perfectly valid.
+	if (len > 0) {
+		auto p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			auto e = errno;
+			close(fd);
+			throw system_error(e, generic_category(), "can't map " + path);
+		}
+		madvise(p, len, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+		ptr = (const char *)p;
+	}
+	// The mapping stays valid after closing.
+	close(fd);
+}
+
+MappedFile::~MappedFile() {
+	if (ptr != nullptr) {
+		munmap((void *)ptr, len);
+	}
+}
+
+}
+}
@@ -0,0 +1,123 @@
+#include "render/cubemap.h"
+#include <algorithm>
+#include <cmath>
+#include "util.h"
+
+namespace engine {
+namespace render {
+
+using namespace std;
+
+namespace {
+
+/**
+ * \brief Where a face is in the cross & how the point where a ray hits the box maps to it.
+ *
+ * Faces are ordered by the axis they are perpendicular to, then by the direction of the ray.
+ */
+struct FaceLayout {
+	double u, v;
+	unsigned char u_axis, v_axis;
+	bool flip_u, flip_v;
+};
+
+// Note that -Z is forward, Y is top and X is right
+const FaceLayout LAYOUT[6] = {
+	// Back / front
+	{ 0.25, 1.0 / 3, 1, 2, false, false },
+	{ 0.75, 1.0 / 3, 1, 2, true, false },
+	// Right / left
+	{ 0, 1.0 / 3, 0, 2, false, false },
+	{ 0.5, 1.0 / 3, 0, 2, true, false },
+	// Top / bottom
+	{ 0.25, 0, 1, 0, false, false },
+	{ 0.25, 2.0 / 3, 1, 0, false, true },
+};
+
+ALWAYS_INLINE unsigned int to_pixel(double max, double t) {
+	return round_up(max * clamp(t, 0.0, 1.0));
+}
+
+}
+
+Cubemap::Cubemap(const Texture &cross, double size)
+	: max_x(cross.get_width() - 1)
+	, max_y(cross.get_height() - 1)
+	, size(size)
+{
+	for (size_t i = 0; i < faces.size(); i++) {
+		auto &l = LAYOUT[i];
+		auto &f = faces[i];
+		// Rays that hit the box right at an edge may end up a pixel outside the face due to
+		// rounding errors.
+		f.x0 = max(to_pixel(max_x, l.u), 1u) - 1;
+		f.y0 = max(to_pixel(max_y, l.v), 1u) - 1;
+		f.x1 = min(to_pixel(max_x, l.u + 1.0 / 4) + 1, cross.get_width() - 1);
+		f.y1 = min(to_pixel(max_y, l.v + 1.0 / 3) + 1, cross.get_height() - 1);
+		f.pixels.reserve((size_t)(f.x1 - f.x0 + 1) * (f.y1 - f.y0 + 1));
+		for (auto y = f.y0; y <= f.y1; y++) {
+			for (auto x = f.x0; x <= f.x1; x++) {
+				f.pixels.push_back(cross(x, y));
+			}
+		}
+	}
+}
+
+void Cubemap::sample(const Matrix4D &inv_eye, const Rays &rays, unsigned int count, Color *out) const {
+	static thread_local vector<double> hits;
+	static thread_local vector<unsigned int> faces_hit;
+	hits.resize(count * 3);
+	faces_hit.resize(count);
+	auto hx = hits.data(), hy = hx + count, hz = hy + count;
+	auto face_ids = faces_hit.data();
+	auto rpx = rays.px.data(), rpy = rays.py.data(), rpz = rays.pz.data();
+	auto rnx = rays.nx.data(), rny = rays.ny.data(), rnz = rays.nz.data();
+
+	// Intersect all rays with the box first. This loop has no branches & only touches arrays, so
+	// it is vectorized.
+	//
+	// The transformations are spelled out the same way as Point3D & Vector3D * Matrix4D so the
+	// results don't change.
+	auto m0 = inv_eye[0], m1 = inv_eye[1], m2 = inv_eye[2];
+	auto size = this->size;
+	IVDEP
+	for (unsigned int i = 0; i < count; i++) {
+		auto x = rnx[i], y = rny[i], z = rnz[i];
+		auto nx = (x * m0.x + y * m0.y) + (z * m0.z + 0 * m0.w);
+		auto ny = (x * m1.x + y * m1.y) + (z * m1.z + 0 * m1.w);
+		auto nz = (x * m2.x + y * m2.y) + (z * m2.z + 0 * m2.w);
+		x = rpx[i], y = rpy[i], z = rpz[i];
+		auto px = (x * m0.x + y * m0.y) + (z * m0.z + 1 * m0.w);
+		auto py = (x * m1.x + y * m1.y) + (z * m1.z + 1 * m1.w);
+		auto pz = (x * m2.x + y * m2.y) + (z * m2.z + 1 * m2.w);
+
+		auto fx = abs((copysign(size, nx) - px) / nx);
+		auto fy = abs((copysign(size, ny) - py) / ny);
+		auto fz = abs((copysign(size, nz) - pz) / nz);
+		auto f = min(fx, min(fy, fz));
+		// Pick the first axis with the nearest side, like the ray would.
+		int on_x = f == fx;
+		int on_y = !on_x & (f == fy);
+		int on_z = 1 - on_x - on_y;
+		face_ids[i] = on_y * 2 + on_z * 4 + on_x * (nx < 0) + on_y * (ny > 0) + on_z * (nz > 0);
+
+		// Map to [0, 1]
+		hx[i] = ((px + nx * f) + size) / (size * 2);
+		hy[i] = ((py + ny * f) + size) / (size * 2);
+		hz[i] = ((pz + nz * f) + size) / (size * 2);
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		auto &l = LAYOUT[face_ids[i]];
+		auto &f = faces[face_ids[i]];
+		double h[3] = { hx[i], hy[i], hz[i] };
+		auto pu = l.flip_u ? 1.0 - h[l.u_axis] : h[l.u_axis];
+		auto pv = l.flip_v ? 1.0 - h[l.v_axis] : h[l.v_axis];
+		auto x = clamp(to_pixel(max_x, l.u + pu / 4), f.x0, f.x1);
+		auto y = clamp(to_pixel(max_y, l.v + pv / 3), f.y0, f.y1);
+		out[i] = Color(f.pixels[(size_t)(y - f.y0) * (f.x1 - f.x0 + 1) + (x - f.x0)]);
+	}
+}
+
+}
+}
@@ -1,4 +1,6 @@
 #include "render/fragment.h"
+#include <atomic>
+#include <cfloat>
 #include "math/point2d.h"
 #include "math/point3d.h"
 #include "math/matrix2d.h"
@@ -7,9 +9,12 @@
 #include "engine.h"
 #include "lines.h"
 #include "easy_image.h"
-#include "render/aabb.h"
 #include "render/geometry.h"
+#include "render/raster.h"
 #include "render/rect.h"
+#include "render/shadow_cache.h"
+#include "render/tiles.h"
+#include "thread_pool.h"
 
 /** If something looks off (vs examples), try changing these values **/
 
@@ -19,6 +24,11 @@
 // Ditto
 #define Z_SHADOW_BIAS (1.5e-6)
 
+#if GRAPHICS_ZBUFFER_COMPACT
+// Rounding 1/Z values to floats must not undo the bias.
+static_assert(Z_BIAS - 1 > 16 * FLT_EPSILON);
+#endif
+
 using namespace std;
 
 namespace engine {
@@ -58,54 +68,187 @@ static ALWAYS_INLINE optional<Color> directional_light(const TriangleFigure &f,
 }
 
 /**
- * \brief Determine if a shadow is cast at the given point.
+ * \brief Maximum amount of points shadow_row() handles at once.
  */
-static ALWAYS_INLINE bool shadowed(const PointLight &p, Point3D point) {
-	auto l = point * p.cached.eye;
-	auto lx = l.x / -l.z * p.cached.d + p.cached.offset.x;
-	auto ly = l.y / -l.z * p.cached.d + p.cached.offset.y;
-	assert(!isinf(lx) && !isnan(lx));
-	assert(!isinf(ly) && !isnan(ly));
-	auto fx = floor(lx);
-	auto fy = floor(ly);
-	auto cx = fx + 1;
-	auto cy = fy + 1;
-	auto get_z = [&p](unsigned int x, unsigned int y) {
-		return x < p.cached.zbuf.get_width() && y < p.cached.zbuf.get_height()
-			? ((const ZBuffer &)p.cached.zbuf)(x, y)
-			: numeric_limits<double>::infinity();
-	};
-	auto cxa = lx - fx;
-	auto cya = ly - fy;
-	auto fxa = 1 - cxa;
-	auto fya = 1 - cya;
-	assert(1 >= fxa && fxa >= 0);
-	assert(1 >= fya && fya >= 0);
-	assert(1 >= cxa && cxa >= 0);
-	assert(1 >= cya && cya >= 0);
-	auto inv_z = (
-		(
-			+ get_z(fx, fy) * fxa
-			+ get_z(cx, fy) * cxa
-		) * fya + (
-			+ get_z(fx, cy) * fxa
-			+ get_z(cx, cy) * cxa
-		) * cya
-	);
-	assert(!isnan(inv_z) && "shadow 1/z is NaN");
-
-	return inv_z + Z_SHADOW_BIAS < 1 / l.z;
+#define SHADOW_BATCH (64)
+
+/**
+ * \brief Determine how much light of a point light reaches each point in a row.
+ *
+ * With a radius of 0 the 1/Z values of the 4 texels around the projection of a point are
+ * interpolated and compared against the point, which gives hard shadows.
+ *
+ * Otherwise percentage-closer filtering is used: every texel in a (2 * radius)^2 area around
+ * the projection is compared against the point and the results are averaged, with the texels
+ * on the border weighted like a bilinear lookup. Each texel is only fetched & compared once,
+ * so a small kernel costs about as much as hard shadows. To avoid sloped surfaces shadowing
+ * themselves each texel is compared against the plane of the surface at that texel instead
+ * of the point itself.
+ *
+ * The loops are kept simple so the compiler can vectorize them.
+ *
+ * \param normals Normals of the surfaces the points lie on. Only used for PCF.
+ * \param lit Fraction of the light of each point that isn't blocked.
+ */
+template<unsigned int radius>
+static void shadow_row(
+	const PointLight &p,
+	const Point3D *points,
+	const Vector3D *normals,
+	unsigned int n,
+	double *lit
+) {
+	static_assert(radius <= Lights::SHADOW_FILTER_MAX);
+	assert(n <= SHADOW_BATCH);
+
+	// The light sees all geometry edge-on, so nothing casts a shadow. The masked loads below
+	// need at least one texel.
+	auto &zbuf = p.cached.zbuf;
+	unsigned int w = zbuf.get_width(), h = zbuf.get_height();
+	if (w == 0 || h == 0) {
+		fill(lit, lit + n, 1.0);
+		return;
+	}
+
+	// Project onto the shadow map
+	double fxa[SHADOW_BATCH], fya[SHADOW_BATCH], cxa[SHADOW_BATCH], cya[SHADOW_BATCH];
+	double inv_lz[SHADOW_BATCH];
+	int fx[SHADOW_BATCH], fy[SHADOW_BATCH];
+	auto &eye = p.cached.eye;
+	auto d = p.cached.d;
+	auto offset = p.cached.offset;
+	for (unsigned int i = 0; i < n; i++) {
+		auto l = points[i] * eye;
+		auto lx = l.x / -l.z * d + offset.x;
+		auto ly = l.y / -l.z * d + offset.y;
+		// Keep the coordinates of points way off the map in range of an int. -1 is off the
+		// map too.
+		lx = abs(lx) < 1e9 ? lx : -1;
+		ly = abs(ly) < 1e9 ? ly : -1;
+		auto flx = floor(lx);
+		auto fly = floor(ly);
+		fx[i] = flx;
+		fy[i] = fly;
+		cxa[i] = lx - flx;
+		cya[i] = ly - fly;
+		fxa[i] = 1 - cxa[i];
+		fya[i] = 1 - cya[i];
+		inv_lz[i] = 1 / l.z;
+	}
+
+	// 1/Z of the plane is linear in the shadow map coordinates. Determine how much it changes
+	// per texel and what it is at the first texel, minus the bias.
+	double gx[SHADOW_BATCH], gy[SHADOW_BATCH], plane[SHADOW_BATCH];
+	constexpr unsigned int t = max(2 * radius, 2u), first = t / 2 - 1;
+	if (radius > 0) {
+		for (unsigned int i = 0; i < n; i++) {
+			auto l = points[i] * eye;
+			auto nl = normals[i] * eye;
+			auto dot = nl.x * l.x + nl.y * l.y + nl.z * l.z;
+			// Parallel to the rays of the light, so it's not lit anyways.
+			auto g = dot != 0 ? -1 / (d * dot) : 0;
+			gx[i] = nl.x * g;
+			gy[i] = nl.y * g;
+			plane[i] = inv_lz[i] - Z_SHADOW_BIAS
+				- gx[i] * (cxa[i] + first)
+				- gy[i] * (cya[i] + first);
+		}
+	}
+
+	// Fetch all texels around the projections. Texels outside the map are infinitely far
+	// away. For PCF the texels are compared immediately.
+	double z[t * t][SHADOW_BATCH];
+	auto *data = zbuf.data();
+	for (unsigned int ty = 0; ty < t; ty++) {
+		for (unsigned int tx = 0; tx < t; tx++) {
+			auto *row = z[tx + ty * t];
+			for (unsigned int i = 0; i < n; i++) {
+				unsigned int x = fx[i] - first + tx, y = fy[i] - first + ty;
+				bool inside = x < w && y < h;
+				// Mask instead of branch so the load is always done, which allows gathers.
+				double v = data[(x + y * w) & -(unsigned int)inside];
+				row[i] = inside ? v : numeric_limits<double>::infinity();
+			}
+			if (radius > 0) {
+				for (unsigned int i = 0; i < n; i++) {
+					row[i] = !(row[i] < plane[i] + gx[i] * tx + gy[i] * ty);
+				}
+			}
+		}
+	}
+
+	if (radius == 0) {
+		auto *z00 = z[0], *z10 = z[1], *z01 = z[2], *z11 = z[3];
+		for (unsigned int i = 0; i < n; i++) {
+			auto inv_z = (
+				(
+					+ z00[i] * fxa[i]
+					+ z10[i] * cxa[i]
+				) * fya[i] + (
+					+ z01[i] * fxa[i]
+					+ z11[i] * cxa[i]
+				) * cya[i]
+			);
+			lit[i] = !(inv_z + Z_SHADOW_BIAS < inv_lz[i]);
+		}
+		return;
+	}
+
+	// Weigh the results of the texels on the border like a bilinear lookup. The weights of
+	// every row & column add up to t - 1.
+	fill(lit, lit + n, 0.0);
+	for (unsigned int ty = 0; ty < t; ty++) {
+		double sum[SHADOW_BATCH];
+		auto *first = z[ty * t], *last = z[t - 1 + ty * t];
+		for (unsigned int i = 0; i < n; i++) {
+			sum[i] = first[i] * fxa[i] + last[i] * cxa[i];
+		}
+		for (unsigned int tx = 1; tx < t - 1; tx++) {
+			auto *row = z[tx + ty * t];
+			for (unsigned int i = 0; i < n; i++) {
+				sum[i] += row[i];
+			}
+		}
+		if (ty == 0 || ty == t - 1) {
+			auto *wy = ty == 0 ? fya : cya;
+			for (unsigned int i = 0; i < n; i++) {
+				lit[i] += sum[i] * wy[i];
+			}
+		} else {
+			for (unsigned int i = 0; i < n; i++) {
+				lit[i] += sum[i];
+			}
+		}
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		lit[i] /= (t - 1) * (t - 1);
+	}
 }
 
+typedef void (*shadow_row_t)(const PointLight &, const Point3D *, const Vector3D *, unsigned int, double *);
+
+/**
+ * \brief shadow_row() for every supported filter radius.
+ */
+static constexpr shadow_row_t shadow_rows[] = {
+	shadow_row<0>,
+	shadow_row<1>,
+	shadow_row<2>,
+	shadow_row<3>,
+};
+static_assert(size(shadow_rows) == Lights::SHADOW_FILTER_MAX + 1);
+
 /**
  * \brief Apply point light.
+ *
+ * \param lit Fraction of the light that isn't blocked by shadows.
  */
-static ALWAYS_INLINE optional<Color> point_light(const TriangleFigure &f, const PointLight &light, Point3D point, bool shadows, Vector3D n, Vector3D cam_dir) {
+static ALWAYS_INLINE optional<Color> point_light(const TriangleFigure &f, const PointLight &light, Point3D point, double lit, Vector3D n, Vector3D cam_dir) {
 	auto direction = (point - light.point).normalize();
 	auto dot = n.dot(-direction);
 	if (dot > 0) {
 		// Check if shadowed
-		if (shadows && shadowed(light, point)) {
+		if (lit <= 0) {
 			return optional<Color>();
 		}
 		// Diffuse
@@ -115,115 +258,114 @@ static ALWAYS_INLINE optional<Color> point_light(const TriangleFigure &f, const
 		if (s.has_value()) {
 			color += *s;
 		}
-		return optional(color);
+		return optional(lit < 1 ? color * lit : color);
 	}
 	return optional<Color>();
 }
 
 /**
- * \brief Determine P and Q interpolation factors for BA and CA respectively for
- * a triangle ABC.
+ * \brief Call f with the points of each instance transformed by mat, one instance at a time.
  */
-static ALWAYS_INLINE Vector2D calc_pq(const TriangleFigure &f, Face t, Point3D point) {
-	return calc_pq(f.points[t.a], f.points[t.b], f.points[t.c], point);
+template<typename F>
+static void transform_instances(const InstancedMesh &m, const Matrix4D &mat, F f) {
+	if (m.instances.empty()) {
+		return;
+	}
+	// Instances are only scaled & moved, so the mesh needs to be rotated only once.
+	static thread_local vector<Vector3D> base;
+	static thread_local vector<Point3D> points;
+	base.resize(m.points.size());
+	points.resize(m.points.size());
+	for (size_t i = 0; i < m.points.size(); i++) {
+		base[i] = m.points[i].to_vector() * mat;
+	}
+	for (auto &inst : m.instances) {
+		auto o = Point3D(inst.offset) * mat;
+		for (size_t i = 0; i < base.size(); i++) {
+			points[i] = o + base[i] * inst.scale;
+		}
+		f(points);
+	}
 }
 
 /**
  * \brief Get the color at a point from an associated texture.
+ *
+ * \param footprint See Texture::sample.
  */
-static ALWAYS_INLINE Color texture_color(const TriangleFigure &f, Face t, Vector2D pq) {
+static ALWAYS_INLINE Color texture_color(const TriangleFigure &f, Face t, Vector2D pq, double footprint) {
 	auto uv = interpolate(f.uv[t.a].to_vector(), f.uv[t.b].to_vector(), f.uv[t.c].to_vector(), pq);
-	return Color(f.texture.value().get_clamped(uv));
+	return f.texture.value().sample(uv, footprint);
 }
 
 /**
- * \brief Get the color of a cubemap texture at a pixel
+ * \brief Determine how many texels apart the samples of a pixel & its neighbours are.
+ *
+ * The rays through the next pixel on the row & on the column are intersected with the plane of
+ * the triangle, as the ZBuffer may hold other triangles at those pixels.
  */
-static ALWAYS_INLINE Color cubemap_color(
-	const Lights &lights,
-	Point3D point,
-	Vector3D normal
+static double texture_footprint(
+	const TriangleFigure &f,
+	Face t,
+	const Triangle &tri,
+	unsigned int x,
+	unsigned int y,
+	double d,
+	Vector2D offset
 ) {
-	// Current layout of cubemap:
-	//
-	//   T
-	//   F R B L
-	//   B
-	//
-	// Note that -Z is forward, Y is top and X is right
-	Point2D uv;
-
-	Aabb aabb {
-		Vector3D(-1,-1,-1) * lights.cubemap_size,
-		Vector3D(1,1,1) * lights.cubemap_size,
+	auto n = (tri.b - tri.a).cross(tri.c - tri.a);
+	auto na = n.dot(tri.a - Point3D());
+	auto uv = [&](double px, double py) {
+		Vector3D dir((px - offset.x) / d, (py - offset.y) / d, -1);
+		auto pq = calc_pq(tri.a, tri.b, tri.c, Point3D() + dir * (na / n.dot(dir)));
+		return interpolate(f.uv[t.a].to_vector(), f.uv[t.b].to_vector(), f.uv[t.c].to_vector(), pq);
 	};
-	normal *= lights.inv_eye;
-	point *= lights.inv_eye;
-	auto f3 = (
-		normal.sign().max(Vector3D()) * aabb.max.to_vector()
-		- normal.sign().min(Vector3D()) * aabb.min.to_vector()
-		- point.to_vector()
-	) / normal;
-
-	double f = f3.abs().min();
-	point += normal * f;
-
-	auto p3 = (point - aabb.min) / aabb.size();
-
-	Vector2D p;
-	if (f == f3.abs().x) {
-		// Back / front
-		uv = { normal.x < 0 ? 0.75 : 0.25, 1.0 / 3 };
-		p = { normal.x < 0 ? 1.0 - p3.y : p3.y, p3.z };
-	} else if (f == f3.abs().y) {
-		// Right / left
-		uv = { normal.y > 0 ? 0.5 : 0, 1.0 / 3 };
-		p = { normal.y > 0 ? 1.0 - p3.x : p3.x, p3.z };
-	} else {
-		// Top / bottom
-		uv = { 0.25, normal.z > 0 ? 2.0 / 3 : 0 };
-		p = { p3.y, normal.z > 0 ? 1.0 - p3.x : p3.x };
-	}
-
-	p.x /= 4;
-	p.y /= 3;
-
-	return Color(lights.cubemap->get_clamped(uv + p));
+	auto &tex = f.texture.value();
+	auto w = tex.get_width() - 1.0, h = tex.get_height() - 1.0;
+	auto c = uv(x, y);
+	auto dx = uv(x + 1, y) - c;
+	auto dy = uv(x, y + 1) - c;
+	return sqrt(max(
+		dx.x * dx.x * w * w + dx.y * dx.y * h * h,
+		dy.x * dy.x * w * w + dy.y * dy.y * h * h
+	));
 }
 
-void draw(const std::vector<TriangleFigure> &figures, const Lights &lights, double d, Vector2D offset, img::EasyImage &img, TaggedZBuffer &zbuf) {
-	struct Tri {
-		Point3D a, b, c;
-	};
-	auto f2p = [](auto &f, auto &t) {
-		return Tri {
-			f.points[t.a],
-			f.points[t.b],
-			f.points[t.c],
-		};
-	};
-
-	// Process point light shadows first
+/**
+ * \brief Build the shadow maps of the point lights, one light per thread.
+ *
+ * \param reused Lights whose map is already there, e.g. from a ShadowCache.
+ */
+static void build_shadow_maps(const Lights &lights, const vector<char> &reused, util::ThreadPool &pool) {
 	if (lights.shadows) {
-		auto &inv_project = lights.inv_eye;
-
-		for (size_t pi = 0; pi < lights.point.size(); pi++) {
+		pool.run(lights.point.size(), [&](size_t pi) {
 			auto &p = lights.point[pi];
+			if (reused[pi]) {
+				return;
+			}
 
-			// Project from camera perspective & determine bounds
-			auto pt = p.point * inv_project;
-			p.cached.eye = inv_project * look_direction(pt, -(pt - Point3D()));
+			// The points that are drawn are in camera space, the figures usually in world
+			// space.
+			auto pt = lights.zfigures_camera ? p.point * lights.inv_eye : p.world;
+			p.cached.light_eye = look_direction(pt, -(pt - Point3D()));
+			p.cached.eye = lights.inv_eye * p.cached.light_eye;
+			auto &light_eye = lights.zfigures_camera ? p.cached.eye : p.cached.light_eye;
 
-			vector<ZBufferTriangleFigure> zfigs = lights.zfigures;
+			// Determine bounds
 
 			Rect rect;
 			rect.min.x = rect.min.y = +numeric_limits<double>::infinity();
 			rect.max.x = rect.max.y = -numeric_limits<double>::infinity();
-			for (auto &f : zfigs) {
-				for (auto &a : f.points) {
-					a *= p.cached.eye;
+			for (auto &f : lights.zfigures) {
+				for (auto a : f.points) {
+					a *= light_eye;
 					rect |= project(a);
 				}
+				transform_instances(f.instanced, light_eye, [&rect](auto &points) {
+					for (auto a : points) {
+						rect |= project(a);
+					}
+				});
 			}
 
 			// Create ZBuffer
@@ -233,40 +375,69 @@ void draw(const std::vector<TriangleFigure> &figures, const Lights &lights, doub
 				p.cached.zbuf = ZBuffer(round_up(dim.x), round_up(dim.y));
 			}
 
-			// Fill in ZBuffer with figure & triangle IDs
-			assert(figures.size() < UINT16_MAX);
-			for (u_int16_t i = 0; i < zfigs.size(); i++) {
-				auto &f = zfigs[i];
-				assert(f.faces.size() < UINT32_MAX);
-				for (u_int32_t k = 0; k < f.faces.size(); k++) {
-					auto &t = f.faces[k];
-					auto a = f.points[t.a], b = f.points[t.b], c = f.points[t.c];
-					auto norm = (b - a).cross(c - a);
-					if (!f.can_cull || norm.dot(a - Point3D()) <= 0) {
-						p.cached.zbuf.triangle(a, b, c, p.cached.d, p.cached.offset, 1);
-					}
+			// Transform the points of one figure at a time so memory use doesn't scale with
+			// the amount of lights. The buffer is reused for every light this thread handles.
+			static thread_local vector<Point3D> points;
+
+			// Fill in ZBuffer
+			for (auto &f : lights.zfigures) {
+				points.resize(f.points.size());
+				for (size_t i = 0; i < f.points.size(); i++) {
+					points[i] = f.points[i] * light_eye;
 				}
+				auto draw = [&](auto &points, auto &faces) {
+					for (auto &t : faces) {
+						auto a = points[t.a], b = points[t.b], c = points[t.c];
+						auto norm = (b - a).cross(c - a);
+						if (!f.can_cull || norm.dot(a - Point3D()) <= 0) {
+							p.cached.zbuf.triangle(a, b, c, p.cached.d, p.cached.offset, 1);
+						}
+					}
+				};
+				draw(points, f.faces);
+				transform_instances(f.instanced, light_eye, [&](auto &q) {
+					draw(q, f.instanced.faces);
+				});
 			}
-		}
+		});
 	}
+}
 
-	// Fill in ZBuffer with figure & triangle IDs
-	assert(figures.size() < UINT16_MAX);
-	for (u_int16_t i = 0; i < figures.size(); i++) {
-		auto &f = figures[i];
-		assert(f.faces.size() < UINT32_MAX);
-		for (u_int32_t k = 0; k < f.faces.size(); k++) {
-			auto &t = f.faces[k];
-			auto abc = f2p(f, t);
-			auto a = abc.a, b = abc.b, c = abc.c;
-#if GRAPHICS_DEBUG_Z == 2 || GRAPHICS_DEBUG_FACES == 2
-			{
-#else
-			if (!f.flags.can_cull() || (b -a).cross(c - a).dot(a - Point3D()) <= 0) {
+/**
+ * \brief Draw triangle figures to an image & ZBuffer once the shadow maps are built.
+ *
+ * \param triangles If not null, only these triangles are drawn. See bin_bands().
+ */
+static void draw_shaded(
+	const std::vector<TriangleFigure> &figures,
+	const Lights &lights,
+	double d,
+	Vector2D offset,
+	img::EasyImage &img,
+	TaggedZBuffer &zbuf,
+	const Options &opts,
+	util::ThreadPool &pool,
+	Stats *stats,
+	const Rect *window,
+	const vector<TriangleRef> *triangles
+) {
+	Stats unused;
+	auto &st = stats != nullptr ? *stats : unused;
+
+#if GRAPHICS_DEBUG_NORMALS > 0 || GRAPHICS_DEBUG_EDGES > 0
+	auto f2p = [](auto &f, auto &t) {
+		return Triangle {
+			f.points[t.a],
+			f.points[t.b],
+			f.points[t.c],
+		};
+	};
 #endif
-				zbuf.triangle(a, b, c, d, offset, {i, k, NAN}, Z_BIAS);
-			}
-		}
+
+	// Fill in ZBuffer with figure & triangle IDs
+	{
+		StageTimer timer(stats, STAGE_RASTERIZE);
+		rasterize(figures, d, offset, Z_BIAS, zbuf, pool, opts, stats, window, triangles);
 	}
 
 #if GRAPHICS_DEBUG > 0 || GRAPHICS_DEBUG_NORMALS > 0 || GRAPHICS_DEBUG_FACES > 0
@@ -313,96 +484,172 @@ void draw(const std::vector<TriangleFigure> &figures, const Lights &lights, doub
 #endif
 
 	// Draw triangle colors
-	// A custom iterator would be neat but C++'s iterators are cursed so nah.
-	for (unsigned int y = 0; y < img.get_height(); y++) {
-		for (unsigned int x = 0; x < img.get_width(); x++) {
-			auto pair = zbuf.get(x, y);
-			Point3D point;
-			Vector3D n;
-			Color color;
-			if (pair.is_valid()) {
-				auto &f = figures[pair.figure_id];
-				auto &t = f.faces[pair.triangle_id];
-
-				// Invert perspective projection
-				// Given: x', y', 1/z, dx, dy
-				// x' = x / -z * d + dx => x = (x' - dx) * -z / d, ditto for y
-				point = {
-					(x - offset.x) / (d * -pair.inv_z),
-					(y - offset.y) / (d * -pair.inv_z),
-					1 / pair.inv_z
-				};
+	//
+	// Every pixel only depends on the finished ZBuffer, so split the image in tiles and
+	// shade those in parallel.
+	//
+	// If the ZBuffer only holds a band of the image, the image holds the same band.
+	StageTimer shade_timer(stats, STAGE_SHADE);
+	auto origin_y = zbuf.get_origin_y();
+	TileGrid grid(img.get_width(), img.get_height());
+	assert(grid.size <= SHADOW_BATCH);
+	atomic<size_t> pixels_shaded(0);
+	pool.run(grid.count(), [&](size_t i) {
+		auto tile = grid[i];
+		size_t shaded = 0;
+		tile.y0 += origin_y;
+		tile.y1 += origin_y;
+		// Shadows are looked up for all covered pixels of a row at once, per light.
+		vector<double> lit(lights.shadows ? lights.point.size() * SHADOW_BATCH : 0);
+		// Likewise for the cubemap, which needs the lit color, point & normal of every pixel.
+		auto cubemap_batch = lights.cubemap.has_value() ? SHADOW_BATCH : 0;
+		vector<Color> colors(cubemap_batch), cubemap_colors(cubemap_batch);
+		Cubemap::Rays cubemap_rays(cubemap_batch);
+		for (unsigned int y = tile.y0; y < tile.y1; y++) {
+			// Invert perspective projection
+			// Given: x', y', 1/z, dx, dy
+			// x' = x / -z * d + dx => x = (x' - dx) * -z / d, ditto for y
+			auto unproject = [&](unsigned int x, double inv_z) {
+				return Point3D(
+					(x - offset.x) / (d * -inv_z),
+					(y - offset.y) / (d * -inv_z),
+					1 / inv_z
+				);
+			};
 
-				auto cam_dir = (point - Point3D()).normalize();
+			if (lights.shadows) {
+				Point3D points[SHADOW_BATCH];
+				Vector3D normals[SHADOW_BATCH];
+				unsigned int covered = 0;
+				for (unsigned int x = tile.x0; x < tile.x1; x++) {
+					auto pair = zbuf.get(x, y);
+					if (pair.is_valid()) {
+						if (lights.shadow_filter > 0) {
+							auto &f = figures[pair.figure_id];
+							auto m = f.triangle(pair.triangle_id);
+							normals[covered] = (m.b - m.a).cross(m.c - m.a);
+						}
+						points[covered++] = unproject(x, pair.inv_z);
+					}
+				}
+				auto shadow_row = shadow_rows[lights.shadow_filter];
+				for (size_t pi = 0; covered > 0 && pi < lights.point.size(); pi++) {
+					auto *l = &lit[pi * SHADOW_BATCH];
+					shadow_row(lights.point[pi], points, normals, covered, l);
+				}
+			}
 
-				auto pq = calc_pq(f, t, point);
+			auto put = [&](unsigned int x, Color color) {
+#if GRAPHICS_DEBUG_Z != 2 && GRAPHICS_DEBUG_Z > 0
+				color = Color(1, 1, 1) * (zbuf.get(x, y).inv_z - min_inv_z) / (max_inv_z - min_inv_z);
+#endif
+				assert(color.r >= 0 && "Colors can't be negative");
+				assert(color.g >= 0 && "Colors can't be negative");
+				assert(color.b >= 0 && "Colors can't be negative");
+				img(x, y - origin_y) = color.to_img_color();
+			};
 
-				if (f.flags.separate_normals()) {
-					n = interpolate(f.normals[t.a], f.normals[t.b], f.normals[t.c], pq);
-					n = n.normalize();
-					if (f.flags.clipped()) {
-						auto m = f2p(f, t);
-						n = (m.b - m.a).cross(m.c - m.a).dot(cam_dir) > 0 ? -n : n;
+			// Index of the pixel in the shadow lookups
+			unsigned int slot = 0;
+			for (unsigned int x = tile.x0; x < tile.x1; x++) {
+				auto pair = zbuf.get(x, y);
+				Point3D point;
+				Vector3D n;
+				Color color;
+				if (pair.is_valid()) {
+					auto &f = figures[pair.figure_id];
+					auto tri = f.triangle(pair.triangle_id);
+
+					point = {
+						(x - offset.x) / (d * -pair.inv_z),
+						(y - offset.y) / (d * -pair.inv_z),
+						1 / pair.inv_z
+					};
+
+					auto cam_dir = (point - Point3D()).normalize();
+
+					auto pq = calc_pq(tri.a, tri.b, tri.c, point);
+
+					if (f.flags.separate_normals()) {
+						auto ns = f.triangle_normals(pair.triangle_id);
+						n = interpolate(ns[0], ns[1], ns[2], pq);
+						n = n.normalize();
+						if (f.flags.clipped()) {
+							n = (tri.b - tri.a).cross(tri.c - tri.a).dot(cam_dir) > 0 ? -n : n;
+						}
+					} else if (!f.normals.empty() || !f.instanced.normals.empty()) {
+						n = f.triangle_normals(pair.triangle_id)[0];
+						if (f.flags.clipped()) {
+							n = n.dot(cam_dir) > 0 ? -n : n;
+						}
 					}
-				} else if (!f.normals.empty()) {
-					n = f.normals[pair.triangle_id];
-					if (f.flags.clipped()) {
-						n = n.dot(cam_dir) > 0 ? -n : n;
-					}
-				}
 
-				color = f.ambient * lights.ambient;
+					color = f.ambient * lights.ambient;
 #if GRAPHICS_DEBUG_Z > 0
-				color = Color();
+					color = Color();
 #endif
 
-				for (auto &d : lights.directional) {
-					auto c = directional_light(f, d, n, cam_dir);
-					if (c.has_value()) {
-						color += *c;
+					for (auto &d : lights.directional) {
+						auto c = directional_light(f, d, n, cam_dir);
+						if (c.has_value()) {
+							color += *c;
+						}
 					}
-				}
-				for (auto &p : lights.point) {
-					auto c = point_light(f, p, point, lights.shadows, n, cam_dir);
-					if (c.has_value()) {
-						color += *c;
+					for (size_t pi = 0; pi < lights.point.size(); pi++) {
+						auto l = lights.shadows ? lit[pi * SHADOW_BATCH + slot] : 1;
+						auto c = point_light(f, lights.point[pi], point, l, n, cam_dir);
+						if (c.has_value()) {
+							color += *c;
+						}
+					}
+					slot++;
+					shaded++;
+
+					if (f.texture.has_value()) {
+						// Textured figures are never instanced.
+						auto &t = f.faces[pair.triangle_id];
+						auto footprint = f.texture->get_filter() == TEXTURE_TRILINEAR
+							? texture_footprint(f, t, tri, x, y, d, offset)
+							: 0;
+						color *= texture_color(f, t, pq, footprint);
 					}
-				}
-
-				if (f.texture.has_value()) {
-					color *= texture_color(f, f.faces[pair.triangle_id], pq);
-				}
 
 #if GRAPHICS_DEBUG_FACES == 2
-				auto cg = (color.r + color.g + color.b) / 3;
-				color = (f.points[t.b] - f.points[t.a]).cross(f.points[t.c] - f.points[t.a]).dot(cam_dir) > 0
-					? Color(cg, 0, 0)
-					: Color(0, cg, 0);
+					auto cg = (color.r + color.g + color.b) / 3;
+					color = (tri.b - tri.a).cross(tri.c - tri.a).dot(cam_dir) > 0
+						? Color(cg, 0, 0)
+						: Color(0, cg, 0);
 #elif GRAPHICS_DEBUG_FACES > 0
-				color = Color(colors_pool[pair.triangle_id % color_pool_size]);
+					color = Color(colors_pool[pair.triangle_id % color_pool_size]);
 #endif
-			} else if (lights.cubemap.has_value()) {
-				// Draw cubemap background (skybox)
-				point = Point3D() * lights.eye;
-				n = { (x - offset.x) / d, (y - offset.y) / d, -1 };
-				color = { 1, 1, 1 };
+				} else if (lights.cubemap.has_value()) {
+					// Draw cubemap background (skybox)
+					point = Point3D() * lights.eye;
+					n = { (x - offset.x) / d, (y - offset.y) / d, -1 };
+					color = { 1, 1, 1 };
+				}
+
+				if (lights.cubemap.has_value()) {
+					auto i = x - tile.x0;
+					colors[i] = color;
+					cubemap_rays.set(i, point, n);
+				} else {
+					put(x, color);
+				}
 			}
 
 			if (lights.cubemap.has_value()) {
-				color *= cubemap_color(lights, point, n);
+				auto count = tile.x1 - tile.x0;
+				lights.cubemap->sample(lights.inv_eye, cubemap_rays, count, cubemap_colors.data());
+				for (unsigned int i = 0; i < count; i++) {
+					put(tile.x0 + i, colors[i] * cubemap_colors[i]);
+				}
 			}
-
-#if GRAPHICS_DEBUG_Z != 2 && GRAPHICS_DEBUG_Z > 0
-			color = Color(1, 1, 1) * (pair.inv_z - min_inv_z) / (max_inv_z - min_inv_z);
-#endif
-
-			assert(color.r >= 0 && "Colors can't be negative");
-			assert(color.g >= 0 && "Colors can't be negative");
-			assert(color.b >= 0 && "Colors can't be negative");
-			img(x, y) = color.to_img_color();
-
 		}
-	}
+		pixels_shaded += shaded;
+	});
+	st.pixels_shaded += pixels_shaded;
+	shade_timer.stop();
 
 #if GRAPHICS_DEBUG_NORMALS > 0
 	for (auto &f : figures) {
@@ -481,21 +728,79 @@ void draw(const std::vector<TriangleFigure> &figures, const Lights &lights, doub
 #endif
 }
 
-img::EasyImage draw(const vector<TriangleFigure> &figures, const Lights &lights, unsigned int size, Color background) {
-	if (figures.empty()) {
-		return img::EasyImage(0, 0);
+void draw(
+	const std::vector<TriangleFigure> &figures,
+	const Lights &lights,
+	double d,
+	Vector2D offset,
+	img::EasyImage &img,
+	TaggedZBuffer &zbuf,
+	const Options &opts,
+	util::ThreadPool &pool,
+	Stats *stats,
+	ShadowCache *cache,
+	const Rect *window
+) {
+	Stats unused;
+	auto &st = stats != nullptr ? *stats : unused;
+
+	// Reuse shadow maps from previous draws if possible
+	StageTimer shadows_timer(stats, STAGE_SHADOWS);
+	u_int64_t geometry = 0;
+	vector<char> reused(lights.point.size());
+	assert(cache == nullptr || !lights.zfigures_camera);
+	if (lights.shadows && cache != nullptr) {
+		geometry = ShadowCache::hash(lights.zfigures);
+		for (size_t pi = 0; pi < lights.point.size(); pi++) {
+			reused[pi] = cache->take(lights.point[pi], lights, geometry);
+			st.shadow_cache_hits += reused[pi];
+			st.shadow_cache_misses += !reused[pi];
+		}
+		// Whatever is left won't be used anymore
+		cache->clear();
 	}
+	build_shadow_maps(lights, reused, pool);
+	shadows_timer.stop();
+
+	draw_shaded(figures, lights, d, offset, img, zbuf, opts, pool, stats, window, nullptr);
 
+	if (lights.shadows && cache != nullptr) {
+		for (auto &p : lights.point) {
+			cache->put(p, lights, geometry);
+		}
+	}
+}
+
+/**
+ * \brief Determine the projected bounds of everything that is drawn.
+ */
+static Rect image_bounds(const vector<TriangleFigure> &figures, const Rect *window) {
 	Rect dim;
 	dim.min.x = dim.min.y = +numeric_limits<double>::infinity();
 	dim.max.x = dim.max.y = -numeric_limits<double>::infinity();
 	for (auto &f : figures) {
-		dim |= f.bounds_projected();
+		dim |= window != nullptr ? f.bounds_projected(*window) : f.bounds_projected();
+	}
+	return dim;
+}
+
+img::EasyImage draw(
+	const vector<TriangleFigure> &figures,
+	const Lights &lights,
+	unsigned int size,
+	Color background,
+	const Options &opts,
+	util::ThreadPool &pool,
+	Stats *stats,
+	const Rect *window
+) {
+	if (figures.empty()) {
+		return img::EasyImage(0, 0);
 	}
 
 	double d;
 	Vector2D offset;
-	auto img = create_img(dim, size, background, d, offset);
+	auto img = create_img(image_bounds(figures, window), size, background, d, offset);
 
 	assert(!isnan(d));
 	assert(!isnan(offset.x));
@@ -503,10 +808,59 @@ img::EasyImage draw(const vector<TriangleFigure> &figures, const Lights &lights,
 
 	TaggedZBuffer zbuf(img.get_width(), img.get_height());
 
-	draw(figures, lights, d, offset, img, zbuf);
+	draw(figures, lights, d, offset, img, zbuf, opts, pool, stats, nullptr, window);
 
 	return img;
 }
 
+void draw_bands(
+	const vector<TriangleFigure> &figures,
+	const Lights &lights,
+	unsigned int size,
+	Color background,
+	const Options &opts,
+	util::ThreadPool &pool,
+	unsigned int band_height,
+	const BandSink &sink,
+	Stats *stats,
+	const Rect *window
+) {
+	assert(band_height > 0);
+	if (figures.empty()) {
+		return;
+	}
+
+	double d;
+	Vector2D offset, dim;
+	calc_image_parameters(image_bounds(figures, window), size, d, offset, dim);
+	unsigned int width = round_up(dim.x), height = round_up(dim.y);
+	if (width == 0 || height == 0) {
+		return;
+	}
+
+	vector<vector<TriangleRef>> bands;
+	{
+		StageTimer timer(stats, STAGE_RASTERIZE);
+		bands = bin_bands(figures, d, offset, width, height, band_height, pool, opts);
+	}
+
+	// The shadow maps are the same for every band.
+	{
+		StageTimer timer(stats, STAGE_SHADOWS);
+		build_shadow_maps(lights, vector<char>(lights.point.size()), pool);
+	}
+
+	sink.start(width, height);
+	for (auto i = bands.size(); i-- > 0; ) {
+		auto y = (unsigned int)i * band_height;
+		auto rows = min(band_height, height - y);
+		img::EasyImage img(width, rows, background.to_img_color());
+		TaggedZBuffer zbuf(width, rows, y);
+		draw_shaded(figures, lights, d, offset, img, zbuf, opts, pool, stats, window, &bands[i]);
+		bands[i] = vector<TriangleRef>();
+		sink.band(img, y);
+	}
+}
+
 }
 }
@@ -1,29 +1,241 @@
 #include "render/geometry.h"
+#include <algorithm>
 #include <cassert>
+#include <memory_resource>
+#include <vector>
 #include "render/triangle.h"
+#include "thread_pool.h"
 
 namespace engine {
 namespace render {
 
+using namespace std;
+
+enum Plane {
+	NEAR,
+	FAR,
+	RIGHT,
+	LEFT,
+	TOP,
+	DOWN,
+	PLANES,
+};
+
+/**
+ * \brief Extra outcode bit for points outside the view but still inside the guard band.
+ */
+#define OUTSIDE_VIEW (1 << PLANES)
+
+/**
+ * \brief The planes of a frustum.
+ */
+struct Planes {
+	double near, far, right, top;
+
+	ALWAYS_INLINE bool outside(Point3D p, unsigned int plane) const {
+		switch (plane) {
+			case NEAR : return -p.z < near;
+			case FAR  : return -p.z > far;
+			case RIGHT: return p.x * near > right * -p.z;
+			case LEFT : return p.x * near < -right * -p.z;
+			case TOP  : return p.y * near > top * -p.z;
+			case DOWN : return p.y * near < -top * -p.z;
+			default:
+				assert(!"Invalid direction");
+				return false;
+		}
+	}
+
+	/**
+	 * \brief Determine a bitmask of all the planes a point is outside of.
+	 */
+	ALWAYS_INLINE u_int8_t outcode(Point3D p) const {
+		return (u_int8_t)(
+			outside(p, NEAR) << NEAR
+			| outside(p, FAR) << FAR
+			| outside(p, RIGHT) << RIGHT
+			| outside(p, LEFT) << LEFT
+			| outside(p, TOP) << TOP
+			| outside(p, DOWN) << DOWN
+		);
+	}
+
+	/**
+	 * \brief Determine where a line from & to crosses a plane.
+	 */
+	ALWAYS_INLINE double crossing(Point3D from, Point3D to, unsigned int plane) const {
+		switch (plane) {
+			case NEAR:
+				return (-near - to.z) / (from.z - to.z);
+			case FAR:
+				return (-far - to.z) / (from.z - to.z);
+			case RIGHT:
+				return (to.x * near + to.z * right) /
+					((to.x - from.x) * near + (to.z - from.z) * right);
+			case LEFT:
+				return (to.x * near + to.z * -right) /
+					((to.x - from.x) * near + (to.z - from.z) * -right);
+			case TOP:
+				return (to.y * near + to.z * top) /
+					((to.y - from.y) * near + (to.z - from.z) * top);
+			case DOWN:
+				return (to.y * near + to.z * -top) /
+					((to.y - from.y) * near + (to.z - from.z) * -top);
+			default:
+				assert(!"Invalid direction");
+				return NAN;
+		}
+	}
+};
+
+/**
+ * \brief Amount of faces or points handled per task.
+ */
+#define CLIP_CHUNK_SIZE (1 << 14)
+
 /**
- * \brief Apply frustum clipping.
+ * \brief Classify every instance by its bounding box.
+ *
+ * Instances completely outside a plane are removed and instances that cross any plane are
+ * moved to the regular faces so they can be clipped like any other face.
  */
-template<typename B, typename P>
-static void frustum_apply(TriangleFigure &f, B bitfield, P project, bool disable_cull) {
+template<typename F>
+static void clip_instances(TriangleFigure &f, F outcode) {
+	auto &m = f.instanced;
+	if (m.instances.empty() || m.faces.empty()) {
+		m.instances.clear();
+		return;
+	}
+
+	Point3D lo = m.points[0], hi = m.points[0];
+	for (auto p : m.points) {
+		lo = { min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z) };
+		hi = { max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z) };
+	}
+
+	size_t kept = 0;
+	for (auto &i : m.instances) {
+		u_int8_t all = 0xff, any = 0;
+		for (unsigned int k = 0; k < 8; k++) {
+			auto c = i.apply({ k & 1 ? hi.x : lo.x, k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z });
+			auto code = outcode(c);
+			all &= code;
+			any |= code;
+		}
+		if ((all & ~OUTSIDE_VIEW) != 0) {
+			f.flags.clipped(true);
+			continue;
+		}
+		if ((any & ~OUTSIDE_VIEW) != 0) {
+			auto o = (unsigned int)f.points.size();
+			for (auto t : m.faces) {
+				f.faces.push_back({ t.a + o, t.b + o, t.c + o });
+			}
+			for (auto p : m.points) {
+				f.points.push_back(i.apply(p));
+			}
+			f.normals.insert(f.normals.end(), m.normals.begin(), m.normals.end());
+			continue;
+		}
+		if (any != 0) {
+			// Sticks out of the view, so it is drawn partially.
+			f.flags.clipped(true);
+		}
+		m.instances[kept++] = i;
+	}
+	m.instances.resize(kept);
+}
+
+void Frustum::clip(TriangleFigure &f, util::ThreadPool *pool) const {
 	assert(f.flags.separate_normals() || (f.faces.size() == f.normals.size() && "faces & normals out of sync"));
 	assert(!f.flags.separate_normals() || (f.points.size() == f.normals.size() && "faces & normals out of sync"));
-	size_t faces_count = f.faces.size();
-	size_t added = 0;
-	auto proj = [&f, &project](auto base_i, auto from_i, auto to_i) {
+
+	auto run = [pool](size_t count, const auto &task) {
+		size_t chunks = (count + CLIP_CHUNK_SIZE - 1) / CLIP_CHUNK_SIZE;
+		auto g = [&](size_t i) {
+			task(i, i * CLIP_CHUNK_SIZE, min((i + 1) * CLIP_CHUNK_SIZE, count));
+		};
+		if (pool != nullptr) {
+			pool->run(chunks, g);
+		} else {
+			for (size_t i = 0; i < chunks; i++) {
+				g(i);
+			}
+		}
+	};
+
+	auto right = near * tan(fov / 2);
+	auto guard = max(guard_band, 1.0);
+	// The side planes are moved outwards to the edges of the guard band.
+	Planes planes { near, far, right * guard, right / aspect * guard };
+	Planes view { near, far, right, right / aspect };
+	auto outcode = [&](Point3D p) {
+		auto code = planes.outcode(p);
+		return (u_int8_t)(code | (view.outcode(p) != code ? OUTSIDE_VIEW : 0));
+	};
+
+	clip_instances(f, outcode);
+
+	// Scratch space grows along with the figure, so keep it in the same arena.
+	auto arena = f.arena();
+
+	// Classify all points at once
+	pmr::vector<u_int8_t> codes(f.points.size(), arena);
+	run(codes.size(), [&](size_t, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			codes[i] = outcode(f.points[i]);
+		}
+	});
+
+	// Find all faces that are outside any plane. The others are left alone.
+	//
+	// Faces completely outside the view but inside the guard band are kept too: removing
+	// them costs more than letting the rasterizer skip them.
+	auto face_dirty = [&codes](const Face &t) {
+		return ((codes[t.a] | codes[t.b] | codes[t.c]) & ~OUTSIDE_VIEW) != 0;
+	};
+	pmr::vector<u_int8_t> dirty(f.faces.size(), arena);
+	pmr::vector<pmr::vector<unsigned int>> chunk_dirty((f.faces.size() + CLIP_CHUNK_SIZE - 1) / CLIP_CHUNK_SIZE, arena);
+	pmr::vector<u_int8_t> chunk_outside(chunk_dirty.size(), arena);
+	run(dirty.size(), [&](size_t c, size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++) {
+			auto &t = f.faces[i];
+			dirty[i] = face_dirty(t);
+			if (dirty[i]) {
+				chunk_dirty[c].push_back((unsigned int)i);
+			}
+			chunk_outside[c] |= (codes[t.a] | codes[t.b] | codes[t.c]) & OUTSIDE_VIEW;
+		}
+	});
+	// Faces sticking out of the view are drawn partially, even if they aren't clipped.
+	for (auto o : chunk_outside) {
+		if (o != 0) {
+			f.flags.clipped(true);
+		}
+	}
+	// Positions of dirty faces, in ascending order
+	pmr::vector<unsigned int> positions(arena);
+	for (auto &c : chunk_dirty) {
+		positions.insert(positions.end(), c.begin(), c.end());
+	}
+	if (positions.empty()) {
+		return;
+	}
+
+	// Clip plane by plane. The faces are reordered exactly as if every face was visited,
+	// since the order decides which face wins if two have the same depth.
+	const bool face_normals = !f.flags.separate_normals() && !f.normals.empty();
+	auto proj = [&](unsigned int plane, unsigned int base_i, unsigned int from_i, unsigned int to_i) {
 		assert(from_i < f.points.size());
 		assert(to_i < f.points.size());
 		auto base = f.points[base_i];
 		auto from = f.points[from_i];
 		auto to = f.points[to_i];
-		auto p = to.interpolate(from, project(from, to));
+		auto p = to.interpolate(from, planes.crossing(from, to, plane));
 		auto pq = calc_pq(base, from, to, p);
 
 		f.points.push_back(p);
+		codes.push_back(outcode(p));
 
 		if (f.flags.separate_normals()) {
 			f.normals.push_back(interpolate(f.normals[base_i], f.normals[from_i], f.normals[to_i], pq).normalize());
@@ -34,185 +246,131 @@ static void frustum_apply(TriangleFigure &f, B bitfield, P project, bool disable
 
 		return (unsigned int)(f.points.size() - 1);
 	};
-	auto mark_clipped = [&]() {
-		if (disable_cull) {
-			f.flags.can_cull(false);
-		}
-		f.flags.clipped(true);
-	};
-	auto swap_remove = [&](size_t i) {
-		// Swap, then remove. This is always O(1)
-		if (i < faces_count) {
-			f.faces[i] = f.faces[faces_count - 1];
-			if (!f.flags.separate_normals() && !f.normals.empty()) {
-				f.normals[i] = f.normals[faces_count - 1];
-			}
-		}
-		faces_count--;
-		mark_clipped();
-	};
-	auto split = [&](auto i, auto &out, auto inl, auto inr) {
-		auto p = proj(inr, out, inl);
-		auto q = proj(inl, out, inr);
-		out = p;
-		f.faces.push_back({ q, p, inr });
 
-		if (f.normals.size() > 0 && !f.flags.separate_normals())
-			f.normals.push_back(f.normals[i]);
-
-		added++;
-		mark_clipped();
-	};
-	for (size_t i = 0; i < faces_count; i++) {
-		auto &t = f.faces[i];
-		switch(bitfield(t)) {
-		// Nothing to do
-		case 0b000:
-			break;
-		// Split triangle
-		case 0b100:
-			split(i, t.a, t.b, t.c);
-			break;
-		case 0b010:
-			split(i, t.b, t.c, t.a);
-			break;
-		case 0b001:
-			split(i, t.c, t.a, t.b);
-			break;
-		// Shrink triangle
-		case 0b011:
-			t.b = proj(t.c, t.b, t.a);
-			t.c = proj(t.b, t.c, t.a);
-			mark_clipped();
-			break;
-		case 0b101:
-			t.c = proj(t.a, t.c, t.b);
-			t.a = proj(t.c, t.a, t.b);
-			mark_clipped();
-			break;
-		case 0b110:
-			t.a = proj(t.b, t.a, t.c);
-			t.b = proj(t.a, t.b, t.c);
-			mark_clipped();
-			break;
-		// Remove triangle
-		case 0b111:
-			swap_remove(i--);
-			break;
-		default:
-			UNREACHABLE;
-		}
-	}
+	pmr::vector<Face> added(arena);
+	pmr::vector<Vector3D> added_normals(arena);
+	pmr::vector<unsigned int> moved(arena);
+	for (unsigned int plane = 0; plane < PLANES; plane++) {
+		size_t faces_count = f.faces.size();
+		added.clear();
+		added_normals.clear();
+		moved.clear();
 
-	// Copy added faces over deleted faces.
-	{
-		size_t i = faces_count, j = f.faces.size() - added;
-		size_t new_size = faces_count + added;
-		assert(i <= j);
-		while (added --> 0) {
-			f.faces[i] = f.faces[j];
-			if (f.normals.size() > 0)
-				f.normals[i] = f.normals[j];
-			i++, j++;
-		}
-		f.faces.resize(new_size);
-		if (f.normals.size() > 0 && !f.flags.separate_normals())
-			f.normals.resize(new_size);
-	}
-}
+		auto bitfield = [&](const Face &t) {
+			return (codes[t.a] >> plane & 1) << 2
+				| (codes[t.b] >> plane & 1) << 1
+				| (codes[t.c] >> plane & 1);
+		};
+		auto split = [&](size_t i, unsigned int &out, unsigned int inl, unsigned int inr) {
+			auto p = proj(plane, inr, out, inl);
+			auto q = proj(plane, inl, out, inr);
+			out = p;
+			added.push_back({ q, p, inr });
+			if (face_normals) {
+				added_normals.push_back(f.normals[i]);
+			}
+		};
 
-void Frustum::clip(TriangleFigure &f) const {
-	// Near & far plane
-	enum Plane {
-		NEAR,
-		FAR,
-		RIGHT,
-		LEFT,
-		TOP,
-		DOWN,
-	};
-	auto outside = [this](Point3D p, int plane, double v) {
-		switch (plane) {
-			case NEAR : return -p.z < near;
-			case FAR  : return -p.z > far;
-			case RIGHT: return p.x * near > v * -p.z;
-			case LEFT : return p.x * near < v * -p.z;
-			case TOP  : return p.y * near > v * -p.z;
-			case DOWN : return p.y * near < v * -p.z;
-			default:
-				assert(!"Invalid direction");
-				return false;
+		for (auto i : positions) {
+			// Faces that were moved to the back were already handled
+			while (i < faces_count && dirty[i]) {
+				auto &t = f.faces[i];
+				auto bits = bitfield(t);
+				if (bits == 0b111) {
+					// Swap, then remove. The face that takes its place is handled next.
+					t = f.faces[faces_count - 1];
+					dirty[i] = dirty[faces_count - 1];
+					if (face_normals) {
+						f.normals[i] = f.normals[faces_count - 1];
+					}
+					faces_count--;
+					moved.push_back(i);
+					if (plane == NEAR) {
+						f.flags.can_cull(false);
+					}
+					f.flags.clipped(true);
+					continue;
+				}
+				switch (bits) {
+				// Nothing to do
+				case 0b000:
+					break;
+				// Split triangle
+				case 0b100:
+					split(i, t.a, t.b, t.c);
+					break;
+				case 0b010:
+					split(i, t.b, t.c, t.a);
+					break;
+				case 0b001:
+					split(i, t.c, t.a, t.b);
+					break;
+				// Shrink triangle
+				case 0b011:
+					t.b = proj(plane, t.c, t.b, t.a);
+					t.c = proj(plane, t.b, t.c, t.a);
+					break;
+				case 0b101:
+					t.c = proj(plane, t.a, t.c, t.b);
+					t.a = proj(plane, t.c, t.a, t.b);
+					break;
+				case 0b110:
+					t.a = proj(plane, t.b, t.a, t.c);
+					t.b = proj(plane, t.a, t.b, t.c);
+					break;
+				default:
+					UNREACHABLE;
+				}
+				if (bits != 0) {
+					if (plane == NEAR) {
+						f.flags.can_cull(false);
+					}
+					f.flags.clipped(true);
+					dirty[i] = face_dirty(t);
+				}
+				break;
+			}
 		}
-	};
-	auto outside_mask = [&f, &outside](Face &t, int plane, double v) {
-		assert(t.a < f.points.size());
-		assert(t.b < f.points.size());
-		assert(t.c < f.points.size());
-		return (int)outside(f.points[t.a], plane, v) << 2
-			| (int)outside(f.points[t.b], plane, v) << 1
-			| (int)outside(f.points[t.c], plane, v);
-	};
 
-	// Near & far
-	auto dnear = near, dfar = far;
-	{
-		frustum_apply(f,
-			[&outside_mask](auto &t) { return outside_mask(t, NEAR, NAN); },
-			[dnear, dfar](Point3D from, Point3D to) {
-				return (-dnear - to.z) / (from.z - to.z);
-			},
-			true
-		);
-		frustum_apply(f,
-			[&outside_mask](auto &t) { return outside_mask(t, FAR, NAN); },
-			[dnear, dfar](Point3D from, Point3D to) {
-				return (-dfar - to.z) / (from.z - to.z);
-			},
-			false
-		);
-	}
+		// Put the added faces after the remaining faces and determine which faces may still
+		// need clipping.
+		pmr::vector<unsigned int> next(arena);
+		for (auto i : positions) {
+			if (i < faces_count && dirty[i]) {
+				next.push_back(i);
+			}
+		}
+		for (auto i : moved) {
+			if (i < faces_count && dirty[i]) {
+				next.push_back(i);
+			}
+		}
+		sort(next.begin(), next.end());
+		next.erase(unique(next.begin(), next.end()), next.end());
 
-	// Left & right plane
-	auto right = dnear * tan(fov / 2);
-	{
-		frustum_apply(f,
-			[&outside_mask, right](auto &t) { return outside_mask(t, RIGHT, right); },
-			[dnear, right](Point3D from, Point3D to) {
-				return (to.x * dnear + to.z * right) /
-					((to.x - from.x) * dnear + (to.z - from.z) * right);
-			},
-			false
-		);
-		frustum_apply(f,
-			[&outside_mask, right](auto &t) { return outside_mask(t, LEFT, -right); },
-			[dnear, right](Point3D from, Point3D to) {
-				return (to.x * dnear + to.z * -right) /
-					((to.x - from.x) * dnear + (to.z - from.z) * -right);
-			},
-			false
-		);
+		f.faces.resize(faces_count);
+		dirty.resize(faces_count);
+		if (face_normals) {
+			f.normals.resize(faces_count);
+		}
+		for (size_t k = 0; k < added.size(); k++) {
+			if (face_dirty(added[k])) {
+				next.push_back((unsigned int)f.faces.size());
+			}
+			dirty.push_back(face_dirty(added[k]));
+			f.faces.push_back(added[k]);
+			if (face_normals) {
+				f.normals.push_back(added_normals[k]);
+			}
+		}
+		positions = move(next);
 	}
+}
 
-	// Top & down plane
+Rect Frustum::window() const {
+	auto right = near * tan(fov / 2);
 	auto top = right / aspect;
-	{
-		frustum_apply(f,
-			[&outside_mask, top](auto &t) { return outside_mask(t, TOP, top); },
-			[dnear, top](Point3D from, Point3D to) {
-				return (to.y * dnear + to.z * top) /
-					((to.y - from.y) * dnear + (to.z - from.z) * top);
-			},
-			false
-		);
-		frustum_apply(f,
-			[&outside_mask, top](auto &t) { return outside_mask(t, DOWN, -top); },
-			[dnear, top](Point3D from, Point3D to) {
-				return (to.y * dnear + to.z * -top) /
-					((to.y - from.y) * dnear + (to.z - from.z) * -top);
-			},
-			false
-		);
-	}
+	return { { -right / near, -top / near }, { right / near, top / near } };
 }
 
 }
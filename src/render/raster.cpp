@@ -0,0 +1,305 @@
+#include "render/raster.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "math/point3d.h"
+#include "render/tiles.h"
+
+namespace engine {
+namespace render {
+
+using namespace std;
+
+/**
+ * \brief Amount of consecutive triangles that are sorted as a whole.
+ */
+#define CLUSTER_SIZE (256)
+
+namespace {
+
+/**
+ * \brief A range of consecutive triangles of a single figure.
+ */
+struct Cluster {
+	u_int16_t figure_id;
+	u_int32_t from, to;
+	double near;
+};
+
+/**
+ * \brief Split figures in clusters and sort them from front to back, if requested.
+ */
+vector<Cluster> clusters(const vector<TriangleFigure> &figures, bool front_to_back) {
+	vector<Cluster> list;
+	for (size_t i = 0; i < figures.size(); i++) {
+		auto &f = figures[i];
+		auto count = f.triangles_count();
+		assert(count < UINT32_MAX);
+		if (!front_to_back) {
+			list.push_back({ (u_int16_t)i, 0, (u_int32_t)count, NAN });
+			continue;
+		}
+		for (u_int32_t k = 0; k < count; k += CLUSTER_SIZE) {
+			Cluster c { (u_int16_t)i, k, (u_int32_t)min(count, (size_t)k + CLUSTER_SIZE), -INFINITY };
+			// The camera looks along -Z, so the nearest point has the largest Z.
+			for (auto t = c.from; t < c.to; t++) {
+				auto tri = f.triangle(t);
+				c.near = max({ c.near, tri.a.z, tri.b.z, tri.c.z });
+			}
+			list.push_back(c);
+		}
+	}
+	if (front_to_back) {
+		stable_sort(list.begin(), list.end(), [](auto &a, auto &b) { return a.near > b.near; });
+	}
+	return list;
+}
+
+/**
+ * \brief Index of the first triangle of each cluster if all triangles were put in one list.
+ *
+ * The last element is the total amount of triangles.
+ */
+vector<size_t> cluster_offsets(const vector<Cluster> &list) {
+	vector<size_t> first;
+	first.reserve(list.size() + 1);
+	first.push_back(0);
+	for (auto &c : list) {
+		first.push_back(first.back() + c.to - c.from);
+	}
+	return first;
+}
+
+/**
+ * \brief Call f with the figure & triangle ID of the triangles from index from up to to in
+ * the list of all triangles of the clusters.
+ */
+template<typename F>
+void for_each_in_clusters(const vector<Cluster> &list, const vector<size_t> &first, size_t from, size_t to, F f) {
+	size_t li = upper_bound(first.begin(), first.end(), from) - first.begin() - 1;
+	for (size_t g = from; g < to; g++) {
+		while (g >= first[li + 1]) {
+			li++;
+		}
+		f(list[li].figure_id, (u_int32_t)(list[li].from + (g - first[li])));
+	}
+}
+
+/**
+ * \brief Determine which pixels inside scissor a triangle may cover.
+ *
+ * \return false if the triangle is culled or covers none of the pixels.
+ */
+bool pixel_bounds(
+	const TriangleFigure &f,
+	u_int32_t k,
+	double d,
+	Vector2D offset,
+	const TileGrid::Tile &scissor,
+	TileGrid::Tile &bounds
+) {
+	auto t = f.triangle(k);
+	auto a = t.a, b = t.b, c = t.c;
+	bool visible = !f.flags.can_cull() || (b - a).cross(c - a).dot(a - Point3D()) <= 0;
+#if GRAPHICS_DEBUG_Z == 2 || GRAPHICS_DEBUG_FACES == 2
+	visible = true;
+#endif
+	if (!visible) {
+		return false;
+	}
+	a = ZBuffer::project(a, d, offset);
+	b = ZBuffer::project(b, d, offset);
+	c = ZBuffer::project(c, d, offset);
+
+	// Add a pixel of slack on each side so rounding errors can't cause us to miss
+	// a tile.
+	auto min_x = floor(min({ a.x, b.x, c.x })) - 1;
+	auto min_y = floor(min({ a.y, b.y, c.y })) - 1;
+	auto max_x = floor(max({ a.x, b.x, c.x })) + 1;
+	auto max_y = floor(max({ a.y, b.y, c.y })) + 1;
+	min_x = max(min_x, (double)scissor.x0);
+	min_y = max(min_y, (double)scissor.y0);
+	max_x = min(max_x, scissor.x1 - 1.0);
+	max_y = min(max_y, scissor.y1 - 1.0);
+	// Also catches NaNs
+	if (!(min_x <= max_x && min_y <= max_y)) {
+		return false;
+	}
+	bounds = { (unsigned int)min_x, (unsigned int)min_y, (unsigned int)max_x + 1, (unsigned int)max_y + 1 };
+	return true;
+}
+
+}
+
+vector<vector<TriangleRef>> bin_bands(
+	const vector<TriangleFigure> &figures,
+	double d,
+	Vector2D offset,
+	unsigned int width,
+	unsigned int height,
+	unsigned int band_height,
+	util::ThreadPool &pool,
+	const Options &opts
+) {
+	assert(figures.size() < UINT16_MAX);
+	assert(band_height > 0);
+
+	auto list = clusters(figures, opts.front_to_back);
+	auto first = cluster_offsets(list);
+	auto total = first.back();
+	auto bands = (height + band_height - 1) / band_height;
+	TileGrid::Tile scissor { 0, 0, width, height };
+
+	// Like rasterize(), bin contiguous chunks separately & concatenate them afterwards.
+	size_t chunks = min(total, (size_t)pool.size() * 4);
+	vector<vector<vector<TriangleRef>>> bins(chunks, vector<vector<TriangleRef>>(bands));
+	pool.run(chunks, [&](size_t ci) {
+		size_t from = total * ci / chunks, to = total * (ci + 1) / chunks;
+		for_each_in_clusters(list, first, from, to, [&](u_int16_t fi, u_int32_t k) {
+			TileGrid::Tile b;
+			if (pixel_bounds(figures[fi], k, d, offset, scissor, b)) {
+				for (auto band = b.y0 / band_height; band <= (b.y1 - 1) / band_height; band++) {
+					bins[ci][band].push_back({ fi, k });
+				}
+			}
+		});
+	});
+
+	vector<vector<TriangleRef>> result(bands);
+	for (unsigned int band = 0; band < bands; band++) {
+		size_t n = 0;
+		for (auto &bin : bins) {
+			n += bin[band].size();
+		}
+		result[band].reserve(n);
+		for (auto &bin : bins) {
+			result[band].insert(result[band].end(), bin[band].begin(), bin[band].end());
+			// Free chunks early, the lists of all bands together may be large.
+			bin[band] = vector<TriangleRef>();
+		}
+	}
+	return result;
+}
+
+void rasterize(
+	const vector<TriangleFigure> &figures,
+	double d,
+	Vector2D offset,
+	double bias,
+	TaggedZBuffer &zbuf,
+	util::ThreadPool &pool,
+	const Options &opts,
+	Stats *stats,
+	const Rect *window,
+	const vector<TriangleRef> *triangles
+) {
+	assert(figures.size() < UINT16_MAX);
+
+	// Tiles are in the coordinates of the buffer, everything else in those of the image.
+	TileGrid grid(zbuf.get_width(), zbuf.get_height());
+	if (grid.count() == 0) {
+		return;
+	}
+	auto origin_y = zbuf.get_origin_y();
+
+	// Pixels that may be drawn to. x1 and y1 are exclusive.
+	TileGrid::Tile scissor { 0, origin_y, grid.width, origin_y + grid.height };
+	if (window != nullptr) {
+		auto clamp_to = [](double v, unsigned int min, unsigned int max) {
+			return (unsigned int)clamp(v, (double)min, (double)max);
+		};
+		auto s = scissor;
+		scissor.x0 = clamp_to(ceil(window->min.x * d + offset.x), s.x0, s.x1);
+		scissor.y0 = clamp_to(ceil(window->min.y * d + offset.y), s.y0, s.y1);
+		scissor.x1 = clamp_to(floor(window->max.x * d + offset.x) + 1, s.x0, s.x1);
+		scissor.y1 = clamp_to(floor(window->max.y * d + offset.y) + 1, s.y0, s.y1);
+		if (scissor.x1 <= scissor.x0 || scissor.y1 <= scissor.y0) {
+			return;
+		}
+	}
+
+	zbuf.set_figure_offsets(figures.begin(), figures.end());
+	vector<Cluster> list;
+	vector<size_t> first;
+	size_t total;
+	if (triangles != nullptr) {
+		total = triangles->size();
+	} else {
+		list = clusters(figures, opts.front_to_back);
+		first = cluster_offsets(list);
+		total = first.back();
+	}
+
+	// Bin contiguous chunks of triangles separately so binning can be done in parallel too.
+	// Concatenating the chunks of a tile restores the order of the clusters.
+	size_t chunks = min(total, (size_t)pool.size() * 4);
+	vector<vector<vector<TriangleRef>>> bins(chunks, vector<vector<TriangleRef>>(grid.count()));
+
+	pool.run(chunks, [&](size_t ci) {
+		size_t from = total * ci / chunks, to = total * (ci + 1) / chunks;
+		auto &bin = bins[ci];
+		auto add = [&](u_int16_t fi, u_int32_t k) {
+			TileGrid::Tile b;
+			if (!pixel_bounds(figures[fi], k, d, offset, scissor, b)) {
+				return;
+			}
+			for (auto ty = (b.y0 - origin_y) / grid.size; ty <= (b.y1 - 1 - origin_y) / grid.size; ty++) {
+				for (auto tx = b.x0 / grid.size; tx <= (b.x1 - 1) / grid.size; tx++) {
+					bin[tx + ty * grid.columns()].push_back({ fi, k });
+				}
+			}
+		};
+		if (triangles != nullptr) {
+			for (size_t g = from; g < to; g++) {
+				add((*triangles)[g].figure_id, (*triangles)[g].triangle_id);
+			}
+		} else {
+			for_each_in_clusters(list, first, from, to, add);
+		}
+	});
+
+	vector<Stats> tile_stats(grid.count());
+	pool.run(grid.count(), [&](size_t i) {
+		auto tile = grid[i];
+		tile.y0 += origin_y;
+		tile.y1 += origin_y;
+		auto &st = tile_stats[i];
+		// Triangles may stick out of the scissor, so clip the tile to it.
+		auto clip = tile;
+		clip.x0 = max(clip.x0, scissor.x0);
+		clip.y0 = max(clip.y0, scissor.y0);
+		clip.x1 = max(min(clip.x1, scissor.x1), clip.x0);
+		clip.y1 = max(min(clip.y1, scissor.y1), clip.y0);
+		for (auto &bin : bins) {
+			for (auto r : bin[i]) {
+				auto &f = figures[r.figure_id];
+				auto t = f.triangle(r.triangle_id);
+				st.occluded_triangles += !zbuf.triangle(
+					t.a, t.b, t.c,
+					d, offset,
+					{ r.figure_id, r.triangle_id, NAN },
+					bias,
+					clip,
+					st.pixel_writes
+				);
+			}
+		}
+		if (stats != nullptr) {
+			for (auto y = tile.y0; y < tile.y1; y++) {
+				for (auto x = tile.x0; x < tile.x1; x++) {
+					st.pixels_covered += zbuf.get(x, y).is_valid();
+				}
+			}
+		}
+	});
+	if (stats != nullptr) {
+		for (auto &st : tile_stats) {
+			stats->occluded_triangles += st.occluded_triangles;
+			stats->pixel_writes += st.pixel_writes;
+			stats->pixels_covered += st.pixels_covered;
+		}
+	}
+}
+
+}
+}
@@ -0,0 +1,78 @@
+#include "render/shadow_cache.h"
+#include <algorithm>
+#include <cstring>
+
+namespace engine {
+namespace render {
+
+using namespace std;
+
+namespace {
+
+/**
+ * \brief 64-bit FNV-1a hash, but with 8 bytes at a time since geometry can be large.
+ */
+struct Fnv1a {
+	u_int64_t state = 0xcbf29ce484222325;
+
+	void add(const void *data, size_t len) {
+		auto p = (const unsigned char *)data;
+		for (; len > 0; ) {
+			u_int64_t w = 0;
+			auto n = min(len, sizeof(w));
+			memcpy(&w, p, n);
+			state ^= w;
+			state *= 0x100000001b3;
+			p += n;
+			len -= n;
+		}
+	}
+
+	template<typename T, typename A>
+	void add(const vector<T, A> &v) {
+		auto n = v.size();
+		add(&n, sizeof(n));
+		add(v.data(), v.size() * sizeof(T));
+	}
+};
+
+bool same(const Point3D &a, const Point3D &b) {
+	return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+}
+
+u_int64_t ShadowCache::hash(const vector<ZBufferTriangleFigure> &figures) {
+	Fnv1a h;
+	for (auto &f : figures) {
+		h.add(f.points);
+		h.add(f.faces);
+		h.add(f.instanced.points);
+		h.add(f.instanced.faces);
+		h.add(f.instanced.instances);
+		h.add(&f.can_cull, sizeof(f.can_cull));
+	}
+	return h.state;
+}
+
+bool ShadowCache::take(const PointLight &light, const Lights &lights, u_int64_t geometry) {
+	for (auto it = entries.begin(); it != entries.end(); it++) {
+		if (same(it->point, light.world)
+			&& it->shadow_mask == lights.shadow_mask
+			&& it->geometry == geometry
+		) {
+			light.cached = std::move(it->map);
+			light.cached.eye = lights.inv_eye * light.cached.light_eye;
+			entries.erase(it);
+			return true;
+		}
+	}
+	return false;
+}
+
+void ShadowCache::put(const PointLight &light, const Lights &lights, u_int64_t geometry) {
+	entries.push_back({ light.world, lights.shadow_mask, geometry, std::move(light.cached) });
+}
+
+}
+}
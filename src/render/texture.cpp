@@ -0,0 +1,182 @@
+#include "render/texture.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <system_error>
+#include <unordered_map>
+#include <endian.h>
+#include <sys/stat.h>
+#include "mapped_file.h"
+
+namespace engine {
+namespace render {
+
+using namespace std;
+
+namespace {
+
+/**
+ * \brief A texture loaded from a file & the state of the file at the time.
+ */
+struct CacheEntry {
+	Texture texture;
+	off_t size;
+	struct timespec mtime;
+};
+
+mutex cache_lock;
+unordered_map<string, CacheEntry> cache;
+
+uint32_t read_le32(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+uint16_t read_le16(const char *p) {
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return le16toh(v);
+}
+
+}
+
+/**
+ * \brief State shared by all copies of a texture.
+ */
+struct Texture::Shared {
+	// Keeps the pixels alive.
+	shared_ptr<const void> owner;
+	once_flag mips_once;
+	vector<MipLevel> mips;
+};
+
+MipLevel::MipLevel(unsigned int width, unsigned int height)
+	: width(width)
+	, height(height)
+	, tiles_x((width + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE)
+	, texels((size_t)tiles_x * ((height + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE)
+{}
+
+Texture::Texture(
+	shared_ptr<const void> owner,
+	const char *pixels,
+	unsigned int width,
+	unsigned int height,
+	ptrdiff_t row_size
+)
+	: shared(make_shared<Shared>())
+	, pixels(pixels)
+	, width(width)
+	, height(height)
+	, row_size(row_size)
+{
+	shared->owner = move(owner);
+}
+
+Texture::Texture(img::EasyImage &&img) {
+	auto image = make_shared<img::EasyImage>(move(img));
+	width = image->get_width();
+	height = image->get_height();
+	row_size = (width * 3 + 3) & ~3;
+	pixels = width > 0 && height > 0 ? (const char *)&(*image)(0, 0) : nullptr;
+	shared = make_shared<Shared>();
+	shared->owner = move(image);
+}
+
+Texture Texture::filtered(TextureFilter filter) const {
+	Texture t = *this;
+	t.filter = filter;
+	if (filter == TEXTURE_NEAREST || width == 0 || height == 0) {
+		t.filter = TEXTURE_NEAREST;
+		return t;
+	}
+
+	call_once(shared->mips_once, [this]() {
+		auto &mips = shared->mips;
+		mips.emplace_back(width, height);
+		for (unsigned int y = 0; y < height; y++) {
+			for (unsigned int x = 0; x < width; x++) {
+				mips[0].set(x, y, Color((*this)(x, y)));
+			}
+		}
+		// Each level averages 2x2 texels of the previous one. The last row or column of
+		// odd-sized levels is merged into the one before it.
+		while (mips.back().width > 1 || mips.back().height > 1) {
+			auto &prev = mips.back();
+			MipLevel next(max(prev.width / 2, 1u), max(prev.height / 2, 1u));
+			for (unsigned int y = 0; y < next.height; y++) {
+				auto y0 = min(y * 2, prev.height - 1);
+				auto y1 = min(y * 2 + 1, prev.height - 1);
+				for (unsigned int x = 0; x < next.width; x++) {
+					auto x0 = min(x * 2, prev.width - 1);
+					auto x1 = min(x * 2 + 1, prev.width - 1);
+					auto c = prev.get(x0, y0) + prev.get(x1, y0) + prev.get(x0, y1) + prev.get(x1, y1);
+					next.set(x, y, c / 4);
+				}
+			}
+			mips.push_back(move(next));
+		}
+	});
+	t.mips = &shared->mips;
+	return t;
+}
+
+Texture Texture::load(const string &path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0) {
+		throw system_error(errno, generic_category(), "can't stat " + path);
+	}
+
+	lock_guard<mutex> l(cache_lock);
+	auto it = cache.find(path);
+	if (it != cache.end()) {
+		auto &e = it->second;
+		if (e.size == st.st_size && e.mtime.tv_sec == st.st_mtim.tv_sec && e.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+			return e.texture;
+		}
+		cache.erase(it);
+	}
+
+	auto file = make_shared<util::MappedFile>(path, false);
+	auto d = file->data();
+	auto size = file->size();
+
+	// BITMAPFILEHEADER followed by at least a BITMAPINFOHEADER.
+	if (size < 2 || d[0] != 'B' || d[1] != 'M') {
+		throw img::UnsupportedFileTypeException("magic does not match BM");
+	}
+	if (size < 14 + 40) {
+		throw img::UnsupportedFileTypeException("header is truncated");
+	}
+	auto offset = read_le32(d + 10);
+	auto w = (int32_t)read_le32(d + 18);
+	auto h = (int32_t)read_le32(d + 22);
+	if (read_le16(d + 28) != 24 || read_le32(d + 30) != 0) {
+		throw img::UnsupportedFileTypeException("only uncompressed 24-bit images are supported");
+	}
+	if (w <= 0 || h == 0 || h == INT32_MIN) {
+		throw img::UnsupportedFileTypeException("invalid dimensions");
+	}
+	unsigned int width = w, height = h < 0 ? -h : h;
+	size_t row = ((size_t)width * 3 + 3) & ~(size_t)3;
+	if (offset > size || (size - offset) / row < height) {
+		throw img::UnsupportedFileTypeException("pixel data is truncated");
+	}
+
+	auto pixels = d + offset;
+	ptrdiff_t row_size = row;
+	if (h < 0) {
+		// Stored top-down.
+		pixels += row * (height - 1);
+		row_size = -row_size;
+	}
+	Texture tex(move(file), pixels, width, height, row_size);
+	cache.emplace(path, CacheEntry { tex, st.st_size, st.st_mtim });
+	return tex;
+}
+
+}
+}
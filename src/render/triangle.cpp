@@ -15,6 +15,16 @@ using namespace std;
 namespace engine {
 namespace render {
 
+void InstancedMesh::transform(const Matrix4D &mat) {
+	// The mesh only needs the linear part, the instances get the translation.
+	for (auto &p : points) {
+		p = Point3D(p.to_vector() * mat);
+	}
+	for (auto &i : instances) {
+		i.offset = (Point3D(i.offset) * mat).to_vector();
+	}
+}
+
 Rect TriangleFigure::bounds_projected() const {
 	Rect r;
 	r.min.x = r.min.y = +numeric_limits<double>::infinity();
@@ -22,14 +32,86 @@ Rect TriangleFigure::bounds_projected() const {
 	if (flags.clipped()) {
 		// There may still be points that are now unused, so iterate over the triangles to find
 		// the active points.
-		for (auto &t : faces) {
-			r = r | project(points[t.a]) | project(points[t.b]) | project(points[t.c]);
-		}
+		for_each_triangle([&r](Triangle t) {
+			r = r | project(t.a) | project(t.b) | project(t.c);
+		});
 	} else {
 		for (auto &p : points) {
 			r |= project(p);
 		}
+		for (auto &i : instanced.instances) {
+			for (auto &p : instanced.points) {
+				r |= project(i.apply(p));
+			}
+		}
+	}
+	return r;
+}
+
+/**
+ * \brief Add the part of triangle ABC inside window to r.
+ */
+static void clip_bounds(Point2D a, Point2D b, Point2D c, const Rect &window, Rect &r) {
+	// A triangle clipped to 4 edges has at most 7 corners.
+	Point2D poly[2][7] = {{ a, b, c }};
+	unsigned int n = 3;
+	unsigned int cur = 0;
+	// Clip against one edge at a time. axis is 0 for X and 1 for Y.
+	auto edge = [&](unsigned int axis, double bound, bool upper) {
+		auto get = [axis](Point2D p) { return axis == 0 ? p.x : p.y; };
+		auto inside = [&](Point2D p) { return upper ? get(p) <= bound : get(p) >= bound; };
+		auto &in = poly[cur];
+		auto &out = poly[cur ^ 1];
+		unsigned int m = 0;
+		for (unsigned int i = 0; i < n; i++) {
+			auto p = in[i], q = in[(i + 1) % n];
+			if (inside(p)) {
+				out[m++] = p;
+			}
+			if (inside(p) != inside(q)) {
+				auto t = (bound - get(p)) / (get(q) - get(p));
+				auto x = p + (q - p) * t;
+				// Avoid rounding errors putting the point just outside the edge.
+				(axis == 0 ? x.x : x.y) = bound;
+				out[m++] = x;
+			}
+		}
+		n = m;
+		cur ^= 1;
+	};
+	edge(0, window.min.x, false);
+	edge(0, window.max.x, true);
+	edge(1, window.min.y, false);
+	edge(1, window.max.y, true);
+	for (unsigned int i = 0; i < n; i++) {
+		r |= poly[cur][i];
+	}
+}
+
+Rect TriangleFigure::bounds_projected(const Rect &window) const {
+	if (!flags.clipped()) {
+		return bounds_projected();
 	}
+	Rect r;
+	r.min.x = r.min.y = +numeric_limits<double>::infinity();
+	r.max.x = r.max.y = -numeric_limits<double>::infinity();
+	for_each_triangle([&](Triangle t) {
+		auto a = project(t.a), b = project(t.b), c = project(t.c);
+		auto bounds = Rect { a, a } | b | c;
+		if (bounds.max.x < window.min.x || window.max.x < bounds.min.x
+			|| bounds.max.y < window.min.y || window.max.y < bounds.min.y
+		) {
+			// Completely outside, which is common with a guard band.
+			return;
+		}
+		if (window.min.x <= bounds.min.x && bounds.max.x <= window.max.x
+			&& window.min.y <= bounds.min.y && bounds.max.y <= window.max.y
+		) {
+			r |= bounds;
+		} else {
+			clip_bounds(a, b, c, window, r);
+		}
+	});
 	return r;
 }
 
@@ -40,6 +122,11 @@ Rect ZBufferTriangleFigure::bounds_projected() const {
 	for (auto &p : points) {
 		r |= project(p);
 	}
+	for (auto &i : instanced.instances) {
+		for (auto &p : instanced.points) {
+			r |= project(i.apply(p));
+		}
+	}
 	return r;
 }
 
@@ -1,11 +1,12 @@
 #include "shapes.h"
 #include <algorithm>
-#include <fstream>
 #include <initializer_list>
 #include <limits>
 #include <vector>
+#include "arena.h"
 #include "engine.h"
 #include "ini_configuration.h"
+#include "log.h"
 #include "math/matrix2d.h"
 #include "math/matrix4d.h"
 #include "math/vector3d.h"
@@ -21,6 +22,7 @@
 #include "shapes/dodecahedron.h"
 #include "shapes/fractal.h"
 #include "shapes/icosahedron.h"
+#include "shapes/mesh_cache.h"
 #include "shapes/mengersponge.h"
 #include "shapes/tetrahedron.h"
 #include "shapes/octahedron.h"
@@ -28,6 +30,7 @@
 #include "shapes/thicken.h"
 #include "shapes/torus.h"
 #include "shapes/wavefront.h"
+#include "thread_pool.h"
 #include "wireframe.h"
 
 namespace engine {
@@ -95,8 +98,8 @@ Color color_from_conf(const ini::Section &conf) {
 	return color_from_conf(conf["color"]);
 }
 
-vector<Vector3D> calculate_face_normals(const vector<Point3D> &points, const vector<Face> &faces) {
-	vector<Vector3D> normals;
+pmr::vector<Vector3D> calculate_face_normals(const pmr::vector<Point3D> &points, const pmr::vector<Face> &faces) {
+	pmr::vector<Vector3D> normals(points.get_allocator());
 	normals.reserve(faces.size());
 	for (auto &f : faces) {
 		assert(f.a < points.size());
@@ -110,6 +113,24 @@ vector<Vector3D> calculate_face_normals(const vector<Point3D> &points, const vec
 	return normals;
 }
 
+void FaceShape::flatten() {
+	auto &m = instanced;
+	points.reserve(points.size() + m.points.size() * m.instances.size());
+	faces.reserve(faces.size() + m.faces.size() * m.instances.size());
+	normals.reserve(normals.size() + m.normals.size() * m.instances.size());
+	for (auto &i : m.instances) {
+		auto o = (unsigned int)points.size();
+		for (auto f : m.faces) {
+			faces.push_back({ f.a + o, f.b + o, f.c + o });
+		}
+		for (auto p : m.points) {
+			points.push_back(i.apply(p));
+		}
+		normals.insert(normals.end(), m.normals.begin(), m.normals.end());
+	}
+	instanced = render::InstancedMesh(arena());
+}
+
 TriangleFigure convert(
 	const FaceShape &shape,
 	const Material &mat,
@@ -118,7 +139,7 @@ TriangleFigure convert(
 	bool with_cubemap,
 	bool with_point_normals
 ) {
-	TriangleFigure fig;
+	TriangleFigure fig(shape.arena());
 	fig.points = shape.points;
 	fig.faces = shape.faces;
 	fig.ambient = mat.ambient;
@@ -142,11 +163,16 @@ TriangleFigure convert(
 	fig.flags.cubemap(with_cubemap);
 	fig.flags.separate_normals(with_point_normals);
 	fig.normals = shape.normals;
-	assert(!fig.normals.empty() && "shape has no normals");
+	fig.instanced = shape.instanced;
+	assert((!fig.normals.empty() || fig.faces.empty()) && "shape has no normals");
+	assert((!fig.instanced.normals.empty() || fig.instanced.faces.empty()) && "shape has no normals");
 
 	for (auto &p : fig.normals) {
 		p *= transform;
 	}
+	for (auto &p : fig.instanced.normals) {
+		p *= transform;
+	}
 
 	Matrix4D mat_scale, m;
 	mat_scale(1, 1) = mat_scale(2, 2) = mat_scale(3, 3) = scale;
@@ -155,6 +181,7 @@ TriangleFigure convert(
 	for (auto &p : fig.points) {
 		p *= m;
 	}
+	fig.instanced.transform(m);
 
 	return fig;
 }
@@ -170,16 +197,19 @@ static TriangleFigure convert(FaceShape &shape, Material &mat, const Configurati
 		mat.ambient = color_from_conf(section);
 	}
 
+    if (!conf.point_normals && shape.normals.empty()) { // TODO should already be done
+        shape.normals = calculate_face_normals(shape.points, shape.faces);
+    }
+	if (!conf.point_normals && shape.instanced.normals.empty()) {
+		shape.instanced.normals = calculate_face_normals(shape.instanced.points, shape.instanced.faces);
+	}
+
 	// Load texture, if any
 	string tex_path;
 	if (section["texture"].as_string_if_exists(tex_path)) {
-		{
-			ifstream f(tex_path);
-			img::EasyImage img;
-			f >> img;
-			Texture tex(std::move(img));
-			mat.texture.emplace(std::move(tex));
-		}
+		// UVs are per point, which instances can't have.
+		shape.flatten();
+		mat.texture.emplace(Texture::load(tex_path));
 
 		// Generate UVs (flat mapping by default)
 		if (shape.uvs.empty()) {
@@ -198,10 +228,10 @@ static TriangleFigure convert(FaceShape &shape, Material &mat, const Configurati
 			}
 		}
 	}
-
-    if (!conf.point_normals && shape.normals.empty()) { // TODO should already be done
-        shape.normals = calculate_face_normals(shape.points, shape.faces);
-    }
+	if (mat.texture.has_value()) {
+		auto filter = clamp(section["textureFilter"].as_int_or_default(0), 0, (int)TEXTURE_FILTER_MAX);
+		mat.texture = mat.texture->filtered((TextureFilter)filter);
+	}
 
 	auto with_cubemap = section["cubeMap"].as_bool_or_default(false);
 
@@ -237,6 +267,7 @@ static void common_conf(
 		frustum.far = conf["General"]["dFar"].as_double_or_die();
 		frustum.fov = deg2rad(conf["General"]["hfov"].as_double_or_die());
 		frustum.aspect = conf["General"]["aspectRatio"].as_double_or_die();
+		frustum.guard_band = conf["General"]["guardBand"].as_double_or_default(GUARD_BAND);
 	} else {
 		frustum_use = false;
 		dir = Point3D() - eye;
@@ -381,7 +412,112 @@ img::EasyImage wireframe(const ini::Configuration &conf, bool with_z) {
 	return render::draw(figures, size, bg, with_z);
 }
 
-img::EasyImage triangles(const ini::Configuration &conf, bool with_lighting) {
+/**
+ * \brief Generate or load the mesh of a figure.
+ *
+ * \param strings Extra data to store along with the mesh in a cache.
+ */
+static void generate(
+	const string &type,
+	const ini::Section &section,
+	FaceShape &shape,
+	bool &smooth,
+	vector<string> &strings
+) {
+	bool nogen = true;
+
+	auto f_b = [&](auto s, const auto &t) {
+		if (type == s) {
+			assert(nogen);
+			shape = FaceShape(t, smooth, shape.arena());
+			nogen = false;
+		}
+	};
+	auto f_g = [&](auto s, void (*g)(const Configuration &, FaceShape &)) {
+		if (type == s) {
+			assert(nogen);
+			g({ section, smooth }, shape);
+			nogen = false;
+		}
+	};
+	auto f_f = [&](auto s, const auto &t) {
+		if (type == s) {
+			assert(nogen);
+			fractal({ section, smooth }, t, shape);
+			nogen = false;
+		}
+	};
+	auto f_t = [&](auto s, const auto &f) {
+		if (type == s) {
+			assert(nogen);
+			thicken({ section, smooth }, f, shape);
+			nogen = false;
+		}
+	};
+
+	f_b("BuckyBall", buckyball);
+	f_b("Cube", cube);
+	f_b("Tetrahedron", tetrahedron);
+	f_b("Octahedron", octahedron);
+	f_b("Icosahedron", icosahedron);
+	f_b("Dodecahedron", dodecahedron);
+	f_g("Cylinder", cylinder);
+	f_g("Cone", cone);
+	f_g("MengerSponge", mengersponge);
+	f_g("Sphere", sphere);
+	f_g("Torus", torus);
+	f_f("FractalBuckyBall", buckyball);
+	f_f("FractalCube", cube);
+	f_f("FractalTetrahedron", tetrahedron);
+	f_f("FractalOctahedron", octahedron);
+	f_f("FractalIcosahedron", icosahedron);
+	f_f("FractalDodecahedron", dodecahedron);
+
+	if (type == "ThickLineDrawing") {
+		EdgeShape templ;
+		wireframe::line_drawing(section, templ);
+		thicken({ section, smooth }, ShapeTemplateAny(templ), shape);
+		nogen = false;
+	}
+	if (type == "Thick3DLSystem") {
+		EdgeShape templ;
+		wireframe::l_system(section, templ);
+		thicken({ section, smooth }, ShapeTemplateAny(templ), shape);
+		nogen = false;
+	}
+	f_t("ThickBuckyBall", buckyball);
+	f_t("ThickCube", cube);
+	f_t("ThickDodecahedron", dodecahedron);
+	f_t("ThickIcosahedron", icosahedron);
+	f_t("ThickOctahedron", octahedron);
+	f_t("ThickTetrahedron", tetrahedron);
+
+	if (type == "Object") {
+		assert(nogen);
+		WavefrontMaterialRef ref;
+		wavefront_mesh(section["file"].as_string_or_die(), shape, smooth, ref);
+		strings = { ref.mtllib, ref.usemtl };
+		nogen = false;
+	}
+
+	if (nogen) {
+		throw TypeException(type);
+	}
+}
+
+/**
+ * \brief Parse the lights & figures of a scene and pass them to draw.
+ *
+ * The geometry of the figures is allocated from an arena that is released all at once when
+ * drawing is done.
+ */
+template<typename F>
+static auto triangles(const ini::Configuration &conf, bool with_lighting, Stats *stats, F draw) {
+	util::Arena arena;
+	auto log_arena = [&arena]() {
+		log_stream() << "Arena: " << arena.get_stats() << endl;
+	};
+
 	Color bg;
 	int size, nr_fig;
 	Frustum frustum;
@@ -390,10 +526,15 @@ img::EasyImage triangles(const ini::Configuration &conf, bool with_lighting) {
 
 	common_conf(conf, bg, size, lights.eye, lights.inv_eye, nr_fig, frustum, frustum_use);
 
+	Options opts;
+	opts.threads = (unsigned int)max(conf["General"]["threads"].as_int_or_default(0), 0);
+	opts.front_to_back = conf["General"]["frontToBack"].as_bool_or_default(false);
+
 	// Parse lights
 	if (with_lighting) {
 		lights.shadows = conf["General"]["shadowEnabled"].as_bool_or_default(false);
 		lights.shadow_mask = lights.shadows ? conf["General"]["shadowMask"].as_int_or_die(): 0;
+		lights.shadow_filter = clamp(conf["General"]["shadowFilter"].as_int_or_default(0), 0, (int)Lights::SHADOW_FILTER_MAX);
 
 		int nr_light = conf["General"]["nrLights"];
 		for (int i = 0; i < nr_light; i++) {
@@ -411,13 +552,13 @@ img::EasyImage triangles(const ini::Configuration &conf, bool with_lighting) {
 				} else {
 					auto d = tup_to_point3d(section["location"].as_double_tuple_or_die());
 					auto a = deg2rad(section["spotAngle"].as_double_or_default(90)); // 91 to ensure >= 1.0 works
-					d *= lights.eye;
 					lights.point.push_back({
-						d,
+						d * lights.eye,
 						try_color_from_conf(diffuse),
 						try_color_from_conf(specular),
 						cos(a),
-						{ Matrix4D(), ZBuffer(0, 0), NAN, Vector2D() },
+						{ Matrix4D(), Matrix4D(), ZBuffer(0, 0), NAN, Vector2D() },
+						d,
 					});
 				}
 			}
@@ -449,120 +590,107 @@ img::EasyImage triangles(const ini::Configuration &conf, bool with_lighting) {
 	{
 		string path;
 		if (conf["General"]["cubeMap"].as_string_if_exists(path)) {
-			ifstream f(path);
-			img::EasyImage img;
-			f >> img;
-			lights.cubemap.emplace(Texture(std::move(img)));
-			lights.cubemap_size = conf["General"]["cubeMapSize"].as_double_or_die();
+			lights.cubemap.emplace(Texture::load(path), conf["General"]["cubeMapSize"].as_double_or_die());
 		}
 	}
 
 	// Parse figures
+	auto mesh_cache = MeshCache::from_env();
 	vector<TriangleFigure> figures;
 	figures.reserve(nr_fig);
 	for (int i = 0; i < nr_fig; i++) {
-		cout << "Loading Figure" << i << endl;
+		log_stream() << "Loading Figure" << i << endl;
 		auto section = conf[string("Figure") + to_string(i)];
 		auto type = section["type"].as_string_or_die();
-		FaceShape shape;
+		FaceShape shape(&arena);
 		auto smooth = section["smooth"].as_bool_or_default(false);
-		bool nogen = true;
 		Material mat;
 
-		auto f_b = [&](auto s, const auto &t) {
-			if (type == s) {
-				assert(nogen);
-				shape = FaceShape(t, smooth);
-				nogen = false;
-			}
-		};
-		auto f_g = [&](auto s, void (*g)(const Configuration &, FaceShape &)) {
-			if (type == s) {
-				assert(nogen);
-				g({ section, smooth }, shape);
-				nogen = false;
-			}
-		};
-		auto f_f = [&](auto s, const auto &t) {
-			if (type == s) {
-				assert(nogen);
-				fractal({ section, smooth }, t, shape);
-				nogen = false;
-			}
-		};
-		auto f_t = [&](auto s, const auto &f) {
-			if (type == s) {
-				assert(nogen);
-				thicken({ section, smooth }, f, shape);
-				nogen = false;
+		auto key = mesh_cache.enabled() ? MeshCache::key(type, { section, smooth }) : "";
+		vector<string> strings;
+		{
+			StageTimer timer(stats, STAGE_GENERATE);
+			if (!mesh_cache.load(key, shape, smooth, strings)) {
+				generate(type, section, shape, smooth, strings);
+				mesh_cache.store(key, shape, smooth, strings);
 			}
-		};
-
-		f_b("BuckyBall", buckyball);
-		f_b("Cube", cube);
-		f_b("Tetrahedron", tetrahedron);
-		f_b("Octahedron", octahedron);
-		f_b("Icosahedron", icosahedron);
-		f_b("Dodecahedron", dodecahedron);
-		f_g("Cylinder", cylinder);
-		f_g("Cone", cone);
-		f_g("MengerSponge", mengersponge);
-		f_g("Sphere", sphere);
-		f_g("Torus", torus);
-		f_f("FractalBuckyBall", buckyball);
-		f_f("FractalCube", cube);
-		f_f("FractalTetrahedron", tetrahedron);
-		f_f("FractalOctahedron", octahedron);
-		f_f("FractalIcosahedron", icosahedron);
-		f_f("FractalDodecahedron", dodecahedron);
-
-		if (type == "ThickLineDrawing") {
-			EdgeShape templ;
-			wireframe::line_drawing(section, templ);
-			thicken({ section, smooth }, ShapeTemplateAny(templ), shape);
-			nogen = false;
-		}
-		if (type == "Thick3DLSystem") {
-			EdgeShape templ;
-			wireframe::l_system(section, templ);
-			thicken({ section, smooth }, ShapeTemplateAny(templ), shape);
-			nogen = false;
 		}
-		f_t("ThickBuckyBall", buckyball);
-		f_t("ThickCube", cube);
-		f_t("ThickDodecahedron", dodecahedron);
-		f_t("ThickIcosahedron", icosahedron);
-		f_t("ThickOctahedron", octahedron);
-		f_t("ThickTetrahedron", tetrahedron);
 
+		StageTimer timer(stats, STAGE_CONVERT);
 		if (type == "Object") {
-			assert(nogen);
-			wavefront({ section, smooth }, shape, mat, smooth);
-			nogen = false;
-		}
-
-		if (nogen) {
-			throw TypeException(type);
+			wavefront_material({ strings.at(0), strings.at(1) }, mat);
 		}
-
 		figures.push_back(convert(shape, mat, { section, smooth }, with_lighting, lights.eye));
 	}
 
 	if (lights.shadows) {
-		// We need the full objects for shadowing
+		// We need the full objects for shadowing. The shadow maps aren't reused, so keep them
+		// in camera space instead of transforming everything back to world space.
+		StageTimer timer(stats, STAGE_CONVERT);
 		lights.zfigures = ZBufferTriangleFigure::convert(figures);
+		lights.zfigures_camera = true;
+	}
+
+	auto count_triangles = [&figures]() {
+		size_t n = 0;
+		for (auto &f : figures) {
+			n += f.triangles_count();
+		}
+		return n;
+	};
+	if (stats != nullptr) {
+		stats->triangles_in += count_triangles();
 	}
 
 	// Clipping
+	//
+	// Only a guard band lets triangles stick out of the view, so only then must the image be
+	// fit to & cut off at the window. Exact clipping keeps the old bounds.
+	Rect window;
+	const Rect *scissor = nullptr;
+	util::ThreadPool pool(opts.threads);
 	if (frustum_use) {
+		StageTimer timer(stats, STAGE_CLIP);
 		for (auto &f : figures) {
-			frustum.clip(f);
+			frustum.clip(f, &pool);
+		}
+		window = frustum.window();
+		if (frustum.guard_band > 1) {
+			scissor = &window;
 		}
 	}
+	if (stats != nullptr) {
+		stats->triangles_out += count_triangles();
+	}
 
 	// Draw
-	cout << "Drawing" << endl;
-	return draw(std::move(figures), lights, size, bg);
+	log_stream() << "Drawing" << endl;
+	if constexpr (is_void_v<decltype(draw(figures, lights, size, bg, opts, pool, scissor))>) {
+		draw(figures, lights, size, bg, opts, pool, scissor);
+		log_arena();
+	} else {
+		auto img = draw(figures, lights, size, bg, opts, pool, scissor);
+		log_arena();
+		return img;
+	}
+}
+
+img::EasyImage triangles(const ini::Configuration &conf, bool with_lighting, Stats *stats) {
+	return triangles(conf, with_lighting, stats, [stats](auto &figures, auto &lights, auto size, auto bg, auto &opts, auto &pool, auto window) {
+		return draw(figures, lights, size, bg, opts, pool, stats, window);
+	});
+}
+
+void triangles(
+	const ini::Configuration &conf,
+	bool with_lighting,
+	unsigned int band_height,
+	const BandSink &sink,
+	Stats *stats
+) {
+	triangles(conf, with_lighting, stats, [&](auto &figures, auto &lights, auto size, auto bg, auto &opts, auto &pool, auto window) {
+		draw_bands(figures, lights, size, bg, opts, pool, band_height, sink, stats, window);
+	});
 }
 
 }
@@ -11,7 +11,8 @@ namespace shapes {
 using namespace std;
 using namespace render;
 
-void circle(vector<Point3D> &points, unsigned int n, double z) {
+template<typename A>
+void circle(vector<Point3D, A> &points, unsigned int n, double z) {
 	Rotation d(-2 * M_PI / n), r;
 	for (unsigned int i = 0; i < n; i++) {
 		points.push_back({ r.u, r.v, z });
@@ -19,17 +20,24 @@ void circle(vector<Point3D> &points, unsigned int n, double z) {
 	}
 }
 
-void circle(vector<Face> &faces, unsigned int n, unsigned int offt) {
+template<typename A>
+void circle(vector<Face, A> &faces, unsigned int n, unsigned int offt) {
 	for (unsigned int i = 0; i < n - 2; i++) {
 		faces.push_back({ offt + i + 1, offt + i + 2, offt });
 	}
 }
 
-void circle_reversed(vector<Face> &faces, unsigned int n, unsigned int offt) {
+template<typename A>
+void circle_reversed(vector<Face, A> &faces, unsigned int n, unsigned int offt) {
 	for (unsigned int i = 0; i < n - 2; i++) {
 		faces.push_back({ offt + i + 2, offt + i + 1, offt });
 	}
 }
 
+template void circle(vector<Point3D> &, unsigned int, double);
+template void circle(pmr::vector<Point3D> &, unsigned int, double);
+template void circle(pmr::vector<Face> &, unsigned int, unsigned int);
+template void circle_reversed(pmr::vector<Face> &, unsigned int, unsigned int);
+
 }
 }
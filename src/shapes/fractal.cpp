@@ -1,4 +1,5 @@
 #include "shapes/fractal.h"
+#include <memory_resource>
 #include <vector>
 #include "ini_configuration.h"
 #include "shapes.h"
@@ -12,83 +13,79 @@ using namespace std;
 using namespace render;
 
 /**
- * \brief Generate points to create a fractal.
+ * \brief Determine where to place the copies of a shape to create a fractal.
+ *
+ * \param arena Where the instances & intermediate copies are allocated.
  */
-static void fractal(vector<Point3D> &points, vector<Vector3D> &normals, double inv_scale, unsigned int iterations) {
+template<typename A>
+static pmr::vector<Instance> fractal(
+	const vector<Point3D, A> &points,
+	double inv_scale,
+	unsigned int iterations,
+	pmr::memory_resource *arena
+) {
 	// Operations:
-	// - scale original points & determine shift
-	// - place copy of original points at current points
+	// - scale original points
+	// - place a copy at each point of the current copies, such that the copy's point with the
+	//   same index lines up with it
 	// - repeat
-	
-	// Shifts for 0th iteration
-	// Shift is relative to current point
-	vector<Vector3D> shift;
-	shift.reserve(points.size());
-	for (auto p : points) {
-		shift.push_back(p.to_vector() * inv_scale);
-	}
+	//
+	// A point i of copy k then lies at prev[i] + offset of the copy it was placed on.
 
 	// Iteration state
-	vector<Point3D> cur_points(points);
+	pmr::vector<Instance> cur({ { Vector3D(), 1 } }, arena);
+	pmr::vector<Point3D> prev(points.begin(), points.end(), arena), next(prev, arena);
+	double scale = 1;
 
 	while (iterations --> 0) {
-		// Scale & shift
-		for (auto &p : points) {
+		// Scale
+		for (auto &p : next) {
 			p = p.to_vector() * inv_scale;
 		}
+		scale *= inv_scale;
 		// Place copies
-		vector<Point3D> new_points;
-		new_points.reserve(cur_points.size() * points.size());
-		for (size_t k = 0; k < cur_points.size(); k++) {
-			auto c = cur_points[k].to_vector();
-			auto s = shift[k % shift.size()];
+		pmr::vector<Instance> new_cur(arena);
+		new_cur.reserve(cur.size() * points.size());
+		for (auto &c : cur) {
 			for (size_t i = 0; i < points.size(); i++) {
-				new_points.push_back(points[i] + c - s);
+				new_cur.push_back({ c.offset + (prev[i] - next[i]), scale });
 			}
 		}
 		// Repeat
-		cur_points = new_points;
-		for (auto &s : shift) {
-			s *= inv_scale;
-		}
+		cur = move(new_cur);
+		prev = next;
 	}
 
-	// Copy normals
-	size_t old_ns = normals.size();
-	size_t ns = old_ns * cur_points.size() / points.size();
-	normals.reserve(ns);
-	while (normals.size() < ns) {
-		normals.push_back(normals[normals.size() - old_ns]);
-	}
-
-	points = cur_points;
+	return cur;
 }
 
 void fractal(double scale, unsigned int iterations, EdgeShape &f) {
-	auto old_points_count = f.points.size();
-	vector<Vector3D> normals;
-	fractal(f.points, normals, 1 / scale, iterations);
-	auto old_edges_size = f.edges.size();
-	f.edges.reserve(f.edges.size() * f.points.size() / old_points_count);
-	for (unsigned int i = old_points_count; i < f.points.size(); i += old_points_count) {
-		for (size_t k = 0; k < old_edges_size; k++) {
-			auto e = f.edges[k];
-			f.edges.push_back({e.a + i, e.b + i});
+	auto instances = fractal(f.points, 1 / scale, iterations, pmr::get_default_resource());
+	vector<Point3D> points;
+	vector<Edge> edges;
+	points.reserve(f.points.size() * instances.size());
+	edges.reserve(f.edges.size() * instances.size());
+	for (auto &i : instances) {
+		auto o = (unsigned int)points.size();
+		for (auto e : f.edges) {
+			edges.push_back({e.a + o, e.b + o});
+		}
+		for (auto p : f.points) {
+			points.push_back(i.apply(p));
 		}
 	}
+	f.points = move(points);
+	f.edges = move(edges);
 }
 
 void fractal(double scale, unsigned int iterations, FaceShape &f) {
-	auto old_points_count = f.points.size();
-	fractal(f.points, f.normals, 1 / scale, iterations);
-	auto old_faces_size = f.faces.size();
-	f.faces.reserve(f.faces.size() * f.points.size() / old_points_count);
-	for (unsigned int i = old_points_count; i < f.points.size(); i += old_points_count) {
-		for (size_t k = 0; k < old_faces_size; k++) {
-			auto e = f.faces[k];
-			f.faces.push_back({e.a + i, e.b + i, e.c + i});
-		}
-	}
+	f.instanced.instances = fractal(f.points, 1 / scale, iterations, f.arena());
+	f.instanced.points = move(f.points);
+	f.instanced.normals = move(f.normals);
+	f.instanced.faces = move(f.faces);
+	f.points.clear();
+	f.normals.clear();
+	f.faces.clear();
 }
 
 void fractal(const Configuration &conf, const ShapeTemplateAny &shape, EdgeShape &f) {
@@ -102,11 +99,13 @@ void fractal(const Configuration &conf, const ShapeTemplateAny &shape, EdgeShape
 void fractal(const Configuration &conf, const ShapeTemplateAny &shape, FaceShape &f) {
 	auto scale = conf.section["fractalScale"].as_double_or_die();
 	auto iterations = (unsigned int)conf.section["nrIterations"].as_int_or_die();
-	f.points = { shape.points, shape.points + shape.points_size };
-	f.faces = { shape.faces, shape.faces + shape.faces_size };
-	f.normals = conf.point_normals
-		? vector<Vector3D>(shape.point_normals, shape.point_normals + shape.point_normals_size)
-		: vector<Vector3D>(shape.face_normals, shape.face_normals + shape.face_normals_size);
+	f.points.assign(shape.points, shape.points + shape.points_size);
+	f.faces.assign(shape.faces, shape.faces + shape.faces_size);
+	if (conf.point_normals) {
+		f.normals.assign(shape.point_normals, shape.point_normals + shape.point_normals_size);
+	} else {
+		f.normals.assign(shape.face_normals, shape.face_normals + shape.face_normals_size);
+	}
 	fractal(scale, iterations, f);
 }
 
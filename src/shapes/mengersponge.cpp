@@ -51,14 +51,10 @@ void mengersponge(const Configuration &conf, EdgeShape &shape) {
 }
 
 void mengersponge(const Configuration &conf, FaceShape &shape) {
+	shape.instanced.points = { cube.points.begin(), cube.points.end() };
+	shape.instanced.faces = { cube.faces.begin(), cube.faces.end() };
 	gen_points(conf.section["nrIterations"].as_int_or_die(), [&](auto orig, auto size) {
-		auto o = (unsigned int)shape.points.size();
-		for (auto f : cube.faces) { 
-			shape.faces.push_back({ o + f.a, o + f.b, o + f.c });
-		}
-		for (auto p : cube.points) { 
-			shape.points.push_back(orig + p.to_vector() * size);
-		}
+		shape.instanced.instances.push_back({ orig.to_vector(), size });
 	});
 }
 
@@ -0,0 +1,320 @@
+#include "shapes/mesh_cache.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+#include "mapped_file.h"
+
+namespace engine {
+namespace shapes {
+
+using namespace std;
+
+/**
+ * \brief Version of the file format. Bump it whenever the layout of the file or of any
+ * stored type changes or when a generator produces a different mesh for the same parameters.
+ */
+#define MESH_CACHE_VERSION (1)
+
+/**
+ * \brief Meshes with fewer triangles are not stored, as generating them is cheaper than
+ * reading a file.
+ */
+#define MESH_CACHE_MIN_TRIANGLES (1 << 12)
+
+namespace {
+
+// The file starts with a header followed by the key, the extra strings each terminated by
+// a zero & the arrays in the order of the counts. Every section starts at a multiple of
+// 8 bytes so the arrays can be read in place.
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t key_size;
+	uint64_t strings_size;
+	uint64_t counts[8];
+};
+
+constexpr char MAGIC[8] = { 'C', 'G', 'M', 'E', 'S', 'H', '\r', '\n' };
+
+enum Flags : uint32_t {
+	POINT_NORMALS = 1 << 0,
+};
+
+// Every parameter a generator reads from its figure. A parameter missing from this list means
+// meshes that only differ in that parameter share an entry.
+const char *const GENERATOR_PARAMETERS[] = {
+	"n", "m", "height", "r", "R", "radius", "fractalScale", "nrIterations",
+};
+
+static_assert(is_trivially_copyable_v<Point3D>);
+static_assert(is_trivially_copyable_v<Vector3D>);
+static_assert(is_trivially_copyable_v<Point2D>);
+static_assert(is_trivially_copyable_v<render::Face>);
+static_assert(is_trivially_copyable_v<render::Instance>);
+
+constexpr size_t pad(size_t n) {
+	return (n + 7) & ~(size_t)7;
+}
+
+bool starts_with(const string &s, const char *prefix) {
+	return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+/**
+ * \brief Append the path, size & modification time of a file to a key.
+ *
+ * \return false if the file can't be accessed.
+ */
+bool add_file(string &key, const string &path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0) {
+		return false;
+	}
+	key += " file=" + path;
+	key += " size=" + to_string(st.st_size);
+	key += " mtime=" + to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec);
+	return true;
+}
+
+string file_name(const string &key) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325;
+	for (unsigned char c : key) {
+		h ^= c;
+		h *= 0x100000001b3;
+	}
+	char s[32];
+	snprintf(s, sizeof(s), "%016llx.mesh", (unsigned long long)h);
+	return s;
+}
+
+/**
+ * \brief Bounds-checked reader for the sections of a mapped file.
+ */
+struct Reader {
+	const char *data;
+	size_t size;
+	size_t pos = 0;
+
+	bool take(size_t n, const char *&p) {
+		if (n > size - pos) {
+			return false;
+		}
+		p = data + pos;
+		pos += pad(n);
+		if (pos > size) {
+			pos = size;
+		}
+		return true;
+	}
+
+	template<typename T, typename A>
+	bool read(vector<T, A> &v, uint64_t n) {
+		const char *p;
+		if (n > (size - pos) / sizeof(T) || !take(n * sizeof(T), p)) {
+			return false;
+		}
+		v.assign((const T *)p, (const T *)p + n);
+		return true;
+	}
+};
+
+template<typename T>
+void write(ofstream &out, const T *data, size_t n) {
+	static const char zeroes[8] = {};
+	out.write((const char *)data, n * sizeof(T));
+	out.write(zeroes, pad(n * sizeof(T)) - n * sizeof(T));
+}
+
+}
+
+MeshCache MeshCache::from_env() {
+	auto env = getenv("CGENGINE_MESH_CACHE");
+	return MeshCache(env != nullptr ? env : "");
+}
+
+string MeshCache::key(const string &type, const Configuration &conf) {
+	string key = type;
+	key += conf.point_normals ? " smooth" : " flat";
+	if (type == "Object") {
+		return add_file(key, conf.section["file"].as_string_or_die()) ? key : "";
+	}
+	if (type == "Thick3DLSystem") {
+		if (!add_file(key, conf.section["inputfile"].as_string_or_die())) {
+			return "";
+		}
+	} else if (
+		!(type == "Cylinder" || type == "Cone" || type == "MengerSponge" || type == "Sphere" || type == "Torus")
+		&& !starts_with(type, "Fractal")
+		&& !(starts_with(type, "Thick") && type != "ThickLineDrawing")
+	) {
+		// The platonic solids are constants and the points & lines of line drawings are
+		// given in the INI file itself.
+		return "";
+	}
+	for (auto name : GENERATOR_PARAMETERS) {
+		double v;
+		if (conf.section[name].as_double_if_exists(v)) {
+			char s[64];
+			snprintf(s, sizeof(s), " %s=%a", name, v);
+			key += s;
+		}
+	}
+	return key;
+}
+
+bool MeshCache::load(
+	const string &key,
+	FaceShape &shape,
+	bool &point_normals,
+	vector<string> &strings
+) const {
+	if (!enabled() || key.empty()) {
+		return false;
+	}
+	auto path = dir + "/" + file_name(key);
+	optional<util::MappedFile> file;
+	try {
+		file.emplace(path);
+	} catch (system_error &) {
+		return false;
+	}
+
+	Reader r { file->data(), file->size() };
+	Header h;
+	const char *p;
+	if (!r.take(sizeof(h), p)) {
+		return false;
+	}
+	memcpy(&h, p, sizeof(h));
+	if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != MESH_CACHE_VERSION) {
+		return false;
+	}
+	// Different keys may have the same file name.
+	if (h.key_size != key.size() || !r.take(key.size(), p) || key.compare(0, key.size(), p, key.size()) != 0) {
+		return false;
+	}
+	if (!r.take(h.strings_size, p)) {
+		return false;
+	}
+	strings.clear();
+	for (auto s = string_view(p, h.strings_size); !s.empty(); ) {
+		auto end = s.find('\0');
+		if (end == string_view::npos) {
+			return false;
+		}
+		strings.emplace_back(s.substr(0, end));
+		s.remove_prefix(end + 1);
+	}
+
+	FaceShape s;
+	auto &inst = s.instanced;
+	auto ok = r.read(s.points, h.counts[0])
+		&& r.read(s.normals, h.counts[1])
+		&& r.read(s.uvs, h.counts[2])
+		&& r.read(s.faces, h.counts[3])
+		&& r.read(inst.points, h.counts[4])
+		&& r.read(inst.normals, h.counts[5])
+		&& r.read(inst.faces, h.counts[6])
+		&& r.read(inst.instances, h.counts[7]);
+	if (!ok) {
+		return false;
+	}
+	shape = move(s);
+	point_normals = (h.flags & POINT_NORMALS) != 0;
+	log_stream() << "Loaded cached mesh " << path << endl;
+	return true;
+}
+
+void MeshCache::store(
+	const string &key,
+	const FaceShape &shape,
+	bool point_normals,
+	const vector<string> &strings
+) const {
+	if (!enabled() || key.empty()) {
+		return;
+	}
+	if (shape.faces.size() + shape.instanced.triangles_count() < MESH_CACHE_MIN_TRIANGLES) {
+		return;
+	}
+
+	string joined;
+	for (auto &s : strings) {
+		joined += s;
+		joined += '\0';
+	}
+
+	auto &inst = shape.instanced;
+	Header h;
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = MESH_CACHE_VERSION;
+	h.flags = point_normals ? (uint32_t)POINT_NORMALS : 0;
+	h.key_size = key.size();
+	h.strings_size = joined.size();
+	uint64_t counts[8] = {
+		shape.points.size(),
+		shape.normals.size(),
+		shape.uvs.size(),
+		shape.faces.size(),
+		inst.points.size(),
+		inst.normals.size(),
+		inst.faces.size(),
+		inst.instances.size(),
+	};
+	memcpy(h.counts, counts, sizeof(counts));
+
+	// Write to a temporary file first so concurrent renders never see a partial entry. The
+	// name must be unique per writer, as the jobs of a batch share one process.
+	auto path = dir + "/" + file_name(key);
+	auto tmp = path + ".tmpXXXXXX";
+	error_code e;
+	filesystem::create_directories(dir, e);
+	{
+		auto fd = mkstemp(&tmp[0]);
+		if (fd < 0) {
+			log_stream() << "Can't write cached mesh " << tmp << endl;
+			return;
+		}
+		// mkstemp() only allows the owner to read the file.
+		fchmod(fd, 0644);
+		::close(fd);
+
+		ofstream out(tmp, ios::binary | ios::trunc);
+		write(out, &h, 1);
+		write(out, key.data(), key.size());
+		write(out, joined.data(), joined.size());
+		write(out, shape.points.data(), shape.points.size());
+		write(out, shape.normals.data(), shape.normals.size());
+		write(out, shape.uvs.data(), shape.uvs.size());
+		write(out, shape.faces.data(), shape.faces.size());
+		write(out, inst.points.data(), inst.points.size());
+		write(out, inst.normals.data(), inst.normals.size());
+		write(out, inst.faces.data(), inst.faces.size());
+		write(out, inst.instances.data(), inst.instances.size());
+		out.close();
+		if (!out) {
+			log_stream() << "Can't write cached mesh " << tmp << endl;
+			remove(tmp.c_str());
+			return;
+		}
+	}
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		log_stream() << "Can't write cached mesh " << path << endl;
+		remove(tmp.c_str());
+	}
+}
+
+}
+}
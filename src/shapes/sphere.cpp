@@ -1,4 +1,9 @@
 #include "shapes/sphere.h"
+#include <array>
+#include <cassert>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <vector>
 #include "shapes.h"
 #include "shapes/icosahedron.h"
@@ -10,64 +15,181 @@ namespace shapes {
 using namespace std;
 using namespace render;
 
-static void bisect(vector<Point3D> &points, vector<Edge> &edges, vector<Face> &faces) {
-	vector<Edge> new_edges;
-	vector<Face> new_faces;
-	new_edges.reserve(edges.size() * 3);
-	new_faces.reserve(faces.size() * 4);
+/**
+ * \brief Amount of bisections for which the result is kept around for later calls.
+ *
+ * Deeper levels are built from the deepest cached level each time so they don't take up
+ * memory for the rest of the process.
+ */
+#define SPHERE_CACHE_LEVELS (7)
 
-	map<Edge, unsigned int> edge_to_new_point;
+namespace {
+
+/**
+ * \brief An icosahedron bisected a number of times.
+ *
+ * Cached levels live on the heap, deeper levels in the arena of the shape they are for.
+ */
+struct Level {
+	// Points before moving them onto the sphere, which further bisections are based on.
+	pmr::vector<Point3D> points;
+	// Points moved onto the unit sphere.
+	pmr::vector<Point3D> sphere_points;
+	pmr::vector<Edge> edges;
+	pmr::vector<Face> faces;
+	// Indices of the edges AB, BC & CA of each face.
+	pmr::vector<array<unsigned int, 3>> face_edges;
+
+	explicit Level(pmr::memory_resource *arena = pmr::get_default_resource())
+		: points(arena), sphere_points(arena), edges(arena), faces(arena), face_edges(arena)
+	{}
+
+	void normalize() {
+		sphere_points.reserve(points.size());
+		for (auto p : points) {
+			sphere_points.push_back(Point3D(Vector3D(p.x, p.y, p.z).normalize()));
+		}
+	}
+};
+
+Level icosahedron_level() {
+	Level l;
+	l.points.assign(icosahedron.points.begin(), icosahedron.points.end());
+	l.edges.assign(icosahedron.edges.begin(), icosahedron.edges.end());
+	l.faces.assign(icosahedron.faces.begin(), icosahedron.faces.end());
+
+	auto find = [&l](unsigned int a, unsigned int b) {
+		for (unsigned int i = 0; i < l.edges.size(); i++) {
+			auto e = l.edges[i];
+			if ((e.a == a && e.b == b) || (e.a == b && e.b == a)) {
+				return i;
+			}
+		}
+		assert(!"Face without edge");
+		return 0u;
+	};
+	for (auto g : l.faces) {
+		l.face_edges.push_back({ find(g.a, g.b), find(g.b, g.c), find(g.c, g.a) });
+	}
+	return l;
+}
+
+/**
+ * \brief Split every face in 4.
+ *
+ * The new point on an edge gets the index of the edge plus the amount of old points and
+ * every edge & face is split in a fixed order, so all indices can be derived directly.
+ *
+ * \param with_face_edges Whether to determine the edges of each face too, which is only
+ * needed to bisect the result again.
+ */
+Level bisect(const Level &l, bool with_face_edges, pmr::memory_resource *arena) {
+	Level n(arena);
+	auto points_count = (unsigned int)l.points.size();
+	auto edges_count = (unsigned int)l.edges.size();
+	n.points.reserve(l.points.size() + l.edges.size());
+	n.edges.reserve(l.edges.size() * 2 + l.faces.size() * 3);
+	n.faces.reserve(l.faces.size() * 4);
 
 	// Use edges to add points & determine new edges
-	for (auto e : edges) {
-		unsigned int i = points.size();
-		points.push_back(Point3D::center({ points[e.a], points[e.b] }));
-		new_edges.push_back({e.a, i});
-		new_edges.push_back({i, e.b});
-		edge_to_new_point[e] = i;
+	n.points.insert(n.points.end(), l.points.begin(), l.points.end());
+	for (unsigned int k = 0; k < edges_count; k++) {
+		auto e = l.edges[k];
+		unsigned int i = points_count + k;
+		n.points.push_back(Point3D::center({ l.points[e.a], l.points[e.b] }));
+		n.edges.push_back({e.a, i});
+		n.edges.push_back({i, e.b});
 	}
 
 	// Use faces to create new faces
-	for (auto g : faces) {
-		Edge ab { g.a, g.b }, bc { g.b, g.c }, ca { g.c, g.a };
-		auto d = edge_to_new_point.at(ab);
-		auto e = edge_to_new_point.at(bc);
-		auto f = edge_to_new_point.at(ca);
-		new_faces.push_back({  d,   e,   f});
-		new_faces.push_back({g.a,   d,   f});
-		new_faces.push_back({  d, g.b,   e});
-		new_faces.push_back({  f,   e, g.c});
-		new_edges.push_back({ d, e });
-		new_edges.push_back({ e, f });
-		new_edges.push_back({ f, d });
+	for (size_t j = 0; j < l.faces.size(); j++) {
+		auto g = l.faces[j];
+		auto &ge = l.face_edges[j];
+		auto d = points_count + ge[0];
+		auto e = points_count + ge[1];
+		auto f = points_count + ge[2];
+		n.faces.push_back({  d,   e,   f});
+		n.faces.push_back({g.a,   d,   f});
+		n.faces.push_back({  d, g.b,   e});
+		n.faces.push_back({  f,   e, g.c});
+		n.edges.push_back({ d, e });
+		n.edges.push_back({ e, f });
+		n.edges.push_back({ f, d });
+	}
+
+	if (with_face_edges) {
+		n.face_edges.reserve(n.faces.size());
+		// Half of edge k that touches point v
+		auto half = [&l](unsigned int k, unsigned int v) {
+			return 2 * k + (l.edges[k].a == v ? 0 : 1);
+		};
+		for (unsigned int j = 0; j < l.faces.size(); j++) {
+			auto g = l.faces[j];
+			auto &ge = l.face_edges[j];
+			auto de = 2 * edges_count + 3 * j, ef = de + 1, fd = de + 2;
+			n.face_edges.push_back({ de, ef, fd });
+			n.face_edges.push_back({ half(ge[0], g.a), fd, half(ge[2], g.a) });
+			n.face_edges.push_back({ half(ge[0], g.b), half(ge[1], g.b), de });
+			n.face_edges.push_back({ ef, half(ge[1], g.c), half(ge[2], g.c) });
+		}
 	}
 
-	edges = new_edges;
-	faces = new_faces;
+	return n;
 }
 
-static void sphere(unsigned int n, vector<Point3D> &points, vector<Edge> &edges, vector<Face> &faces) {
-	points = { icosahedron.points.begin(), icosahedron.points.end() };
-	edges = { icosahedron.edges.begin(), icosahedron.edges.end() };
-	faces = { icosahedron.faces.begin(), icosahedron.faces.end() };
+mutex cache_lock;
+vector<unique_ptr<const Level>> cache;
 
-	for (unsigned int i = 0; i < n; i++) {
-		bisect(points, edges, faces);
+/**
+ * \brief Get the cached level n, creating any missing levels first.
+ *
+ * Levels are never modified nor removed once added, so the reference stays valid.
+ */
+const Level &cached_level(unsigned int n) {
+	assert(n < SPHERE_CACHE_LEVELS);
+	lock_guard<mutex> lock(cache_lock);
+	while (cache.size() <= n) {
+		auto l = cache.empty() ? icosahedron_level() : bisect(*cache.back(), true, pmr::get_default_resource());
+		l.normalize();
+		cache.emplace_back(new Level(move(l)));
 	}
+	return *cache[n];
+}
+
+}
 
-	for (auto &p : points) {
-		p = Point3D(Vector3D(p.x, p.y, p.z).normalize());
+/**
+ * \brief Call f with the points, edges & faces of a sphere bisected n times.
+ *
+ * \param arena Where levels that aren't cached are allocated.
+ */
+template<typename F>
+static void sphere(unsigned int n, pmr::memory_resource *arena, F f) {
+	if (n < SPHERE_CACHE_LEVELS) {
+		auto &l = cached_level(n);
+		f(l.sphere_points, l.edges, l.faces);
+		return;
+	}
+	auto l = bisect(cached_level(SPHERE_CACHE_LEVELS - 1), SPHERE_CACHE_LEVELS < n, arena);
+	for (unsigned int i = SPHERE_CACHE_LEVELS; i < n; i++) {
+		l = bisect(l, i + 1 < n, arena);
 	}
+	l.normalize();
+	f(l.sphere_points, l.edges, l.faces);
 }
 
 void sphere(unsigned int n, EdgeShape &f) {
-	vector<Face> faces;
-	sphere(n, f.points, f.edges, faces);
+	sphere(n, pmr::get_default_resource(), [&f](auto &points, auto &edges, auto &) {
+		f.points.assign(points.begin(), points.end());
+		f.edges.assign(edges.begin(), edges.end());
+	});
 }
 
 void sphere(unsigned int n, FaceShape &f, bool point_normals) {
-	vector<Edge> edges;
-	sphere(n, f.points, edges, f.faces);
+	sphere(n, f.arena(), [&](auto &points, auto &, auto &faces) {
+		f.points = points;
+		f.faces = faces;
+	});
 	if (point_normals) {
 		f.normals.reserve(f.points.size());
 		for (auto p : f.points) {
@@ -94,21 +94,16 @@ void thicken(
 ) {
 	FaceShape sphere, cylinder;
 	init(conf, sphere, cylinder);
-	f.points.reserve(shape.points_size * sphere.points.size() + shape.edges_size * cylinder.points.size());
-	f.faces.reserve(shape.points_size * sphere.faces.size() + shape.edges_size * cylinder.faces.size());
+	f.points.reserve(shape.edges_size * cylinder.points.size());
+	f.faces.reserve(shape.edges_size * cylinder.faces.size());
 
+	// Spheres are only moved, so they can be instanced. Cylinders are rotated.
+	f.instanced.points = move(sphere.points);
+	f.instanced.normals = move(sphere.normals);
+	f.instanced.faces = move(sphere.faces);
+	f.instanced.instances.reserve(shape.points_size);
 	for (size_t ip = 0; ip < shape.points_size; ip++) {
-		const auto &p = shape.points[ip];
-		auto o = (unsigned int)f.points.size();
-		for (const auto &e : sphere.faces) {
-			f.faces.push_back({ e.a + o, e.b + o, e.c + o });
-		}
-		for (const auto &q : sphere.points) {
-			f.points.push_back(p + q.to_vector());
-		}
-		for (const auto &n : sphere.normals) {
-			f.normals.push_back(n);
-		}
+		f.instanced.instances.push_back({ shape.points[ip].to_vector(), 1 });
 	}
 
 	for (size_t ie = 0; ie < shape.edges_size; ie++) {
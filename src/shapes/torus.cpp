@@ -10,10 +10,11 @@ namespace shapes {
 using namespace std;
 using namespace render;
 
+template<typename P, typename N>
 static void torus(
 	const Configuration &conf,
-	vector<Point3D> &points,
-	vector<Vector3D> *normals,
+	P &points,
+	N *normals,
 	unsigned int &n,
 	unsigned int &m,
 	bool point_normals
@@ -57,7 +58,7 @@ static void torus(
 
 void torus(const Configuration &conf, EdgeShape &f) {
 	unsigned int n, m;
-	torus(conf, f.points, nullptr, n, m, false);
+	torus(conf, f.points, (vector<Vector3D> *)nullptr, n, m, false);
 	for (unsigned int i = 0; i < n; i++) {
 		for (unsigned int j = 0; j < m; j++) {
 			f.edges.push_back({ i * m + j, i * m + (j + 1) % m });
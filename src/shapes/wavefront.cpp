@@ -1,16 +1,19 @@
 #include "shapes/wavefront.h"
-#include <fstream>
-#include <iterator>
+#include <algorithm>
+#include <charconv>
 #include <limits>
-#include <set>
+#include <optional>
 #include <string>
-#include <sstream>
-#include <unordered_map>
+#include <string_view>
 #include "ini_configuration.h"
+#include "log.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 #include "math/point3d.h"
 #include "shapes.h"
 #include "render/geometry.h"
 #include "render/triangle.h"
+#include "util.h"
 
 namespace engine {
 namespace shapes {
@@ -34,271 +37,694 @@ using namespace render;
 // - [ ] vt (uv)
 // - [ ] vn (normal)
 //
-// We're parsing it directly to avoid an excessively huge amount of allocations & avoid
-// unneccessary indirection in general.
+// We're parsing it directly from a memory-mapped file to avoid an excessively huge amount of
+// allocations & avoid unneccessary indirection in general. Large files are split in chunks
+// that are parsed in parallel.
 
-void wavefront(const std::string &path, FaceShape &shape, Material &mat, bool &point_normals) {
+/**
+ * \brief Minimum size of the chunks a file is split in.
+ */
+#define WAVEFRONT_CHUNK_SIZE (1 << 20)
 
-	// Find all unique point/uv/normal triples
-	struct Triple {
-		int pi, ti, ni;
-	};
-	struct TripleHash {
-		size_t operator ()(const Triple &t) const {
-			// This is the fastest hash function I could come up with, I swear.
-			return t.pi;
+namespace {
+
+/**
+ * \brief Get the next line without the line terminator.
+ *
+ * \return false if there are no lines left.
+ */
+bool next_line(string_view &rest, string_view &line) {
+	if (rest.empty()) {
+		return false;
+	}
+	auto end = rest.find('\n');
+	line = rest.substr(0, end);
+	rest.remove_prefix(end == string_view::npos ? rest.size() : end + 1);
+	if (!line.empty() && line.back() == '\r') {
+		line.remove_suffix(1);
+	}
+	return true;
+}
+
+/**
+ * \brief Split off the next whitespace-separated token of a line.
+ *
+ * \return An empty string if there are no tokens left.
+ */
+string_view next_token(string_view &line) {
+	auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; };
+	size_t i = 0;
+	while (i < line.size() && is_space(line[i])) {
+		i++;
+	}
+	size_t k = i;
+	while (k < line.size() && !is_space(line[k])) {
+		k++;
+	}
+	auto tok = line.substr(i, k - i);
+	line.remove_prefix(k);
+	return tok;
+}
+
+/**
+ * \brief Parse an entire token as a number.
+ */
+template<typename T>
+bool parse_number(string_view s, T &out) {
+	// from_chars doesn't accept an explicit plus sign.
+	if (s.size() > 1 && s.front() == '+') {
+		s.remove_prefix(1);
+	}
+	auto end = s.data() + s.size();
+	auto [ptr, ec] = from_chars(s.data(), end, out);
+	return ec == errc() && ptr == end && !s.empty();
+}
+
+/**
+ * \brief Indices of the point, UV & normal of a face vertex. 0 means "none".
+ */
+struct Triple {
+	int pi, ti, ni;
+};
+
+/**
+ * \brief How many triples ahead to prefetch slots when looking up many triples.
+ */
+#define TRIPLE_PREFETCH (16)
+
+/**
+ * \brief Numbers unique triples in order of first use, with open addressing.
+ *
+ * Slots only hold the number of a triple, so many fit in a cache line. The triples
+ * themselves are kept in order of first use, which is also what callers want in the end.
+ */
+class TripleMap {
+	// Number of the triple in each slot or EMPTY.
+	vector<unsigned int> slots;
+	vector<Triple> triples;
+	// 64 minus log2 of the capacity
+	unsigned int shift = 64;
+
+	static constexpr unsigned int EMPTY = numeric_limits<unsigned int>::max();
+
+	/**
+	 * \brief Determine the preferred slot of a triple.
+	 *
+	 * All indices are mixed, as many triples may share a point or normal.
+	 */
+	size_t hash(Triple t) const {
+		u_int64_t h = (u_int64_t)(u_int32_t)t.pi * 0x9e3779b97f4a7c15;
+		h ^= (u_int64_t)(u_int32_t)t.ti * 0xc2b2ae3d27d4eb4f;
+		h ^= (u_int64_t)(u_int32_t)t.ni * 0x165667b19e3779f9;
+		h ^= h >> 29;
+		h *= 0xbf58476d1ce4e5b9;
+		// The top bits are mixed best.
+		return (size_t)(h >> shift);
+	}
+
+	void grow(size_t capacity) {
+		slots.assign(capacity, EMPTY);
+		shift = 64;
+		for (size_t c = capacity; c > 1; c >>= 1) {
+			shift--;
 		}
-	};
-	struct TripleEqual {
-		bool operator ()(const Triple &l, const Triple &r) const {
-			return l.pi == r.pi && l.ti == r.ti && l.ni == r.ni;
+		auto mask = slots.size() - 1;
+		for (unsigned int k = 0; k < triples.size(); k++) {
+			auto i = hash(triples[k]);
+			while (slots[i] != EMPTY) {
+				i = (i + 1) & mask;
+			}
+			slots[i] = k;
 		}
-	};
+	}
+
+public:
+	/**
+	 * \brief Start loading the slot of a triple into the cache.
+	 */
+	void prefetch(Triple t) const {
+		PREFETCH(&slots[hash(t)]);
+	}
+
+	/**
+	 * \brief Make room for the given amount of triples without rehashing.
+	 */
+	void reserve(size_t n) {
+		// Keep the table at most half full so probe sequences stay short.
+		size_t capacity = 16;
+		while (capacity < n * 2) {
+			capacity *= 2;
+		}
+		if (capacity > slots.size()) {
+			grow(capacity);
+		}
+		triples.reserve(n);
+	}
+
+	/**
+	 * \brief Find the number of a triple or give it the next number if it is new.
+	 *
+	 * \return The number of the triple & whether it is new.
+	 */
+	pair<unsigned int, bool> find_or_insert(Triple t) {
+		if ((triples.size() + 1) * 2 > slots.size()) {
+			grow(max(slots.size() * 2, (size_t)16));
+		}
+		auto mask = slots.size() - 1;
+		for (auto i = hash(t);; i = (i + 1) & mask) {
+			auto k = slots[i];
+			if (k == EMPTY) {
+				k = slots[i] = (unsigned int)triples.size();
+				triples.push_back(t);
+				return { k, true };
+			}
+			auto &u = triples[k];
+			if (u.pi == t.pi && u.ti == t.ti && u.ni == t.ni) {
+				return { k, false };
+			}
+		}
+	}
+
+	/**
+	 * \brief Take all triples in order of first use, which leaves the map unusable.
+	 */
+	vector<Triple> take() {
+		slots = {};
+		return move(triples);
+	}
+
+	size_t size() const {
+		return triples.size();
+	}
+};
+
+/**
+ * \brief Bits in Chunk::relative of indices relative to the start of the chunk.
+ */
+enum Relative : u_int8_t {
+	RELATIVE_POINT = 1 << 0,
+	RELATIVE_UV = 1 << 1,
+	RELATIVE_NORMAL = 1 << 2,
+};
+
+struct ParseError {
+	unsigned int line;
+	string reason;
+};
+
+/**
+ * \brief Everything found in a range of whole lines.
+ *
+ * Chunks are parsed independently, so indices can only be resolved once it is known how
+ * many elements precede each chunk.
+ */
+struct Chunk {
+	string_view text;
+	unsigned int lines = 0;
 
-	unordered_map<Triple, unsigned int, TripleHash, TripleEqual> triples;
-	string usemtl, mtllib;
 	vector<Point3D> points;
 	vector<Point2D> uvs;
 	vector<Vector3D> normals;
 
-	ifstream f;
-	char buffer[1 << 16];
-	f.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
-	f.open(path);
-	cout << "Reading Wavefront file" << endl;
-	// Try to reuse buffers as much as possible.
-	// Merely moving tok & vert from inside the loops to here
-	// reduced runtime on Lucy from 100s to 65s!
-	string line, prefix, token;
-	istringstream tok, vert;
-	vector<pair<Point3D, unsigned int>> polygon;
-
-	unsigned int line_i = 0;
-	while (getline(f, line)) {
-		line_i++;
-		tok.clear();
-		tok.seekg(0, ios::beg);
-		tok.str(line);
-		istream_iterator<string> it(tok);
-		auto end = istream_iterator<string>();
-		if (it == end) {
-			// Empty line.
-			continue;
-		}
-
-		auto next_string = [&]() {
-			++it;
-			if (it == end) {
-				throw WavefrontParseException(line_i, "expected token");
+	// Vertices of all polygons, one polygon after another.
+	vector<Triple> verts;
+	vector<u_int8_t> relative;
+	// Index of the first vertex & line of each polygon.
+	vector<unsigned int> polygons;
+	vector<unsigned int> polygon_lines;
+
+	string usemtl, mtllib;
+	unsigned int usemtl_line = 0, mtllib_line = 0;
+
+	optional<ParseError> error;
+
+	// Unique triples in order of first use & the index of each vertex in that list.
+	vector<Triple> uniques;
+	vector<unsigned int> ids;
+
+	vector<Face> faces;
+
+	void parse();
+
+	void parse_line(string_view line, unsigned int line_i);
+};
+
+void Chunk::parse() {
+	auto rest = text;
+	string_view line;
+	try {
+		while (next_line(rest, line)) {
+			lines++;
+			parse_line(line, lines);
+		}
+	} catch (ParseError &e) {
+		error = move(e);
+		// Count the remaining lines so errors in later chunks have the right line number.
+		lines += (unsigned int)count(rest.begin(), rest.end(), '\n') + !rest.empty();
+	}
+	polygons.push_back((unsigned int)verts.size());
+}
+
+void Chunk::parse_line(string_view line, unsigned int line_i) {
+	auto keyword = next_token(line);
+	if (keyword.empty()) {
+		// Empty line.
+		return;
+	}
+
+	auto next_string = [&]() {
+		auto tok = next_token(line);
+		if (tok.empty()) {
+			throw ParseError { line_i, "expected token" };
+		}
+		return tok;
+	};
+	auto to_double = [&](string_view tok) {
+		double v;
+		if (!parse_number(tok, v)) {
+			throw ParseError { line_i, "invalid number '" + string(tok) + "'" };
+		}
+		return v;
+	};
+	auto next_double = [&]() {
+		return to_double(next_string());
+	};
+	auto maybe_next_double = [&]() {
+		auto tok = next_token(line);
+		if (tok.empty()) {
+			return numeric_limits<double>::signaling_NaN();
+		}
+		return to_double(tok);
+	};
+	// Indices may be negative to refer to elements relative to the last one. Those are
+	// stored relative to the start of the chunk.
+	u_int8_t rel = 0;
+	auto to_index = [&](string_view tok, size_t count, u_int8_t bit) {
+		int v;
+		if (!parse_number(tok, v) || v == 0) {
+			throw ParseError { line_i, "invalid index '" + string(tok) + "'" };
+		}
+		if (v > 0) {
+			return v;
+		}
+		rel |= bit;
+		return (int)count + v + 1;
+	};
+	auto no_next = [&]() {
+		if (!next_token(line).empty()) {
+			throw ParseError { line_i, "too many tokens" };
+		}
+	};
+
+	if (keyword == "v") {
+		auto x = next_double();
+		auto y = next_double();
+		auto z = next_double();
+		maybe_next_double();
+		points.push_back({ x, y, z });
+	} else if (keyword == "vt") {
+		auto u = next_double();
+		auto v = maybe_next_double();
+		maybe_next_double();
+		uvs.push_back({ u, v });
+	} else if (keyword == "vn") {
+		auto x = next_double();
+		auto y = next_double();
+		auto z = next_double();
+		normals.push_back({ x, y, z });
+	} else if (keyword == "f") {
+		// Vertices may be defined later in the file, so triangulation is done afterwards.
+		auto first = verts.size();
+		for (auto vert = next_token(line); !vert.empty(); vert = next_token(line)) {
+			Triple t = { 0, 0, 0 };
+			rel = 0;
+			auto slash = vert.find('/');
+			t.pi = to_index(vert.substr(0, slash), points.size(), RELATIVE_POINT);
+			if (slash != string_view::npos) {
+				vert.remove_prefix(slash + 1);
+				slash = vert.find('/');
+				auto uv = vert.substr(0, slash);
+				if (!uv.empty()) {
+					t.ti = to_index(uv, uvs.size(), RELATIVE_UV);
+				}
+				if (slash != string_view::npos) {
+					t.ni = to_index(vert.substr(slash + 1), normals.size(), RELATIVE_NORMAL);
+				}
 			}
-			return *it;
-		};
-		auto next_double = [&]() {
-			return stod(next_string());
+			verts.push_back(t);
+			relative.push_back(rel);
+		}
+		if (verts.size() - first < 3) {
+			throw ParseError { line_i, "face must have at least 3 points" };
+		}
+		polygons.push_back((unsigned int)first);
+		polygon_lines.push_back(line_i);
+		return;
+	} else if (keyword == "p") {
+		// We don't support points so just skip.
+		return;
+	} else if (keyword == "l") {
+		// Ditto but lines
+		return;
+	} else if (keyword == "s" || keyword == "g") {
+		// Ignore anything group-related for now.
+		return;
+	} else if (keyword == "usemtl") {
+		auto s = next_string();
+		if (usemtl.empty()) {
+			usemtl = s;
+			usemtl_line = line_i;
+		} else if (s != usemtl) {
+			throw ParseError { line_i, "multiple different materials are not supported" };
+		}
+	} else if (keyword == "mtllib") {
+		if (!mtllib.empty()) {
+			throw ParseError { line_i, "only one mtllib can be loaded" };
+		}
+		mtllib = next_string();
+		mtllib_line = line_i;
+	} else if (keyword.front() == '#') {
+		return; // Skip no_next() at the end.
+	} else {
+		throw ParseError { line_i, "unknown keyword '" + string(keyword) + "'" };
+	}
+	no_next();
+}
+
+/**
+ * \brief Split a polygon into triangles.
+ *
+ * \param polygon The points & vertex IDs of the polygon. It is emptied in the process.
+ */
+void triangulate(vector<pair<Point3D, unsigned int>> &polygon, vector<Face> &faces) {
+	// Use two-ears theorem so we triangulate concave polygons properly.
+	//
+	// A vertex is an ear if the diagonal between it's two neighbours lies entirely
+	// in the polygon, i.e. none of its points lie in another triangle.
+
+	// Calculate the normal of the polygon.
+	// This is called Newell's method. I have no idea *why* it works and I seem to be
+	// unable to find a proper explanation.
+	// Ref: https://www.khronos.org/opengl/wiki/Calculating_a_Surface_Normal#Newell.27s_Method
+	Vector3D poly_norm;
+	for (size_t i = 0; i < polygon.size(); i++) {
+		auto c = polygon[i].first.to_vector();
+		auto n = polygon[(i + 1) % polygon.size()].first.to_vector();
+		auto d = c - n, s = c + n;
+		poly_norm += Vector3D(d.y * s.z, d.z * s.x, d.x * s.y);
+	}
+
+	size_t i = 0;
+	while (polygon.size() > 3) {
+		auto get = [&](auto n) {
+			return polygon[n % polygon.size()];
 		};
-		auto maybe_next_double = [&]() {
-			++it;
-			if (it == end) {
-				return numeric_limits<double>::signaling_NaN();
+		// Take any point and *ignore* its neighbours.
+		auto a = get(i);
+		auto b = get(i + 1);
+		auto c = get(i + 2);
+		if ((b.first - a.first).cross(c.first - a.first).dot(poly_norm) < 0) {
+			goto skip;
+		}
+		// Check if any other point is inside the triangle.
+		for (size_t k = 0; k < polygon.size(); k++) {
+			if (k != i && k != (i + 1) % polygon.size() && k != (i + 2) % polygon.size()) {
+				auto pq = calc_pq(a.first, b.first, c.first, get(k).first);
+				if ((0 <= pq.x && pq.x <= 1) && (0 <= pq.y && pq.y <= 1)) {
+					goto skip;
+				}
 			}
-			return stod(*it);
+		}
+		// No other point lies in the triangle and it faces in the right direction.
+		faces.push_back({ a.second, b.second, c.second });
+		polygon.erase(polygon.begin() + (i + 1) % polygon.size());
+	skip:
+		if (++i >= polygon.size()) {
+			i = 0;
+		}
+	}
+	// Push the final triangle.
+	faces.push_back({ polygon[0].second, polygon[1].second, polygon[2].second });
+	polygon.clear();
+}
+
+}
+
+void wavefront_mesh(const string &path, FaceShape &shape, bool &point_normals, WavefrontMaterialRef &ref) {
+	log_stream() << "Reading Wavefront file" << endl;
+	util::MappedFile file(path);
+	auto text = file.view();
+
+	// Split in chunks of whole lines. Merging chunks costs a bit, so don't split if there is
+	// only one thread anyways.
+	util::ThreadPool pool(text.size() > WAVEFRONT_CHUNK_SIZE ? 0 : 1);
+	auto chunk_size = pool.size() > 1 ? WAVEFRONT_CHUNK_SIZE : text.size();
+	vector<Chunk> chunks;
+	while (!text.empty()) {
+		auto end = text.size() <= chunk_size
+			? string_view::npos
+			: text.find('\n', chunk_size);
+		Chunk c;
+		c.text = text.substr(0, end == string_view::npos ? end : end + 1);
+		text.remove_prefix(c.text.size());
+		chunks.push_back(move(c));
+	}
+
+	pool.run(chunks.size(), [&](size_t i) { chunks[i].parse(); });
+
+	// Determine where the elements & lines of each chunk start & report the first error.
+	struct Base {
+		unsigned int line;
+		int point, uv, normal;
+	};
+	vector<Base> bases(chunks.size() + 1, { 0, 0, 0, 0 });
+	for (size_t i = 0; i < chunks.size(); i++) {
+		auto &c = chunks[i];
+		auto &b = bases[i];
+		if (c.error.has_value()) {
+			throw WavefrontParseException(b.line + c.error->line, c.error->reason);
+		}
+		bases[i + 1] = {
+			b.line + c.lines,
+			b.point + (int)c.points.size(),
+			b.uv + (int)c.uvs.size(),
+			b.normal + (int)c.normals.size(),
 		};
-		auto no_next = [&]() {
-			++it;
-			if (it != end) {
-				throw WavefrontParseException(line_i, "too many tokens");
+	}
+
+	// Merge materials in file order.
+	string usemtl, mtllib;
+	for (size_t i = 0; i < chunks.size(); i++) {
+		auto &c = chunks[i];
+		if (!c.usemtl.empty()) {
+			if (!usemtl.empty() && usemtl != c.usemtl) {
+				throw WavefrontParseException(bases[i].line + c.usemtl_line, "multiple different materials are not supported");
 			}
-		};
+			usemtl = c.usemtl;
+		}
+		if (!c.mtllib.empty()) {
+			if (!mtllib.empty()) {
+				throw WavefrontParseException(bases[i].line + c.mtllib_line, "only one mtllib can be loaded");
+			}
+			mtllib = c.mtllib;
+		}
+	}
 
-		if (*it == "v") {
-			auto x = next_double();
-			auto y = next_double();
-			auto z = next_double();
-			maybe_next_double();
-			points.push_back({ x, y, z });
-		} else if (*it == "vt") {
-			auto u = next_double();
-			auto v = maybe_next_double();
-			maybe_next_double();
-			uvs.push_back({ u, v });
-		} else if (*it == "vn") {
-			auto x = next_double();
-			auto y = next_double();
-			auto z = next_double();
-			normals.push_back({ x, y, z });
-		} else if (*it == "f") {
-			// Use two-ears theorem so we triangulate concave polygons properly.
-			polygon.clear();
-			while (++it != end) {
-				vert.clear();
-				vert.seekg(0, ios::beg);
-				vert.str(*it);
-				Triple t = { 0, 0, 0 };
-				if (!getline(vert, token, '/')) {
-					throw WavefrontParseException(line_i, "face vertex must have at least one point");
-				}
-				t.pi = stoi(token);
-				if (getline(vert, token, '/') && token != "") {
-					t.ti = stoi(token);
-				}
-				if (getline(vert, token, '/')) {
-					t.ni = stoi(token);
-				}
-				if (triples.count(t) == 0) {
-					triples[t] = (unsigned int)triples.size();
+	// Concatenate all elements.
+	auto &total = bases.back();
+	vector<Point3D> points(total.point);
+	vector<Point2D> uvs(total.uv);
+	vector<Vector3D> normals(total.normal);
+	pool.run(chunks.size(), [&](size_t i) {
+		auto &c = chunks[i];
+		auto &b = bases[i];
+		copy(c.points.begin(), c.points.end(), points.begin() + b.point);
+		copy(c.uvs.begin(), c.uvs.end(), uvs.begin() + b.uv);
+		copy(c.normals.begin(), c.normals.end(), normals.begin() + b.normal);
+		c.points = {};
+		c.uvs = {};
+		c.normals = {};
+	});
+
+	// Resolve indices & find the unique triples of each chunk.
+	vector<int> bad_polygon(chunks.size(), -1);
+	pool.run(chunks.size(), [&](size_t i) {
+		auto &c = chunks[i];
+		auto &b = bases[i];
+		auto in_range = [](int v, int count) {
+			return 0 <= v && v <= count;
+		};
+		for (size_t p = 0; p + 1 < c.polygons.size(); p++) {
+			for (auto k = c.polygons[p]; k < c.polygons[p + 1]; k++) {
+				auto &t = c.verts[k];
+				auto rel = c.relative[k];
+				t.pi += rel & RELATIVE_POINT ? b.point : 0;
+				t.ti += rel & RELATIVE_UV ? b.uv : 0;
+				t.ni += rel & RELATIVE_NORMAL ? b.normal : 0;
+				if (t.pi == 0 || !in_range(t.pi, total.point) || !in_range(t.ti, total.uv) || !in_range(t.ni, total.normal)) {
+					bad_polygon[i] = (int)p;
+					return;
 				}
-				// TODO defining faces before vertices may be technically valid, in which case
-				// we'll have to defer triangulation.
-				polygon.push_back({ points.at(t.pi - 1), triples[t] });
 			}
-			if (polygon.size() < 3) {
-				throw WavefrontParseException(line_i, "face must have at least 3 points");
-			} else {
-				// A vertex is an ear if the diagonal between it's two neighbours lies entirely
-				// in the polygon, i.e. none of its points lie in another triangle.
-				
-				// Calculate the normal of the polygon.
-				// This is called Newell's method. I have no idea *why* it works and I seem to be
-				// unable to find a proper explanation.
-				// Ref: https://www.khronos.org/opengl/wiki/Calculating_a_Surface_Normal#Newell.27s_Method
-				Vector3D poly_norm;
-				for (size_t i = 0; i < polygon.size(); i++) {
-					auto c = polygon[i].first.to_vector();
-					auto n = polygon[(i + 1) % polygon.size()].first.to_vector();
-					auto d = c - n, s = c + n;
-					poly_norm += Vector3D(d.y * s.z, d.z * s.x, d.x * s.y);
-				}
+		}
+
+		TripleMap local;
+		// Most vertices are shared by a few faces.
+		local.reserve(c.verts.size() / 4);
+		c.ids.reserve(c.verts.size());
+		for (size_t k = 0; k < c.verts.size(); k++) {
+			// Nearly every lookup misses the cache, so start loading slots a bit in advance.
+			if (k + TRIPLE_PREFETCH < c.verts.size()) {
+				local.prefetch(c.verts[k + TRIPLE_PREFETCH]);
+			}
+			auto t = c.verts[k];
+			c.ids.push_back(local.find_or_insert(t).first);
+		}
+		c.uniques = local.take();
+		c.relative = {};
+	});
+	for (size_t i = 0; i < chunks.size(); i++) {
+		if (bad_polygon[i] >= 0) {
+			auto line = bases[i].line + chunks[i].polygon_lines[bad_polygon[i]];
+			throw WavefrontParseException(line, "face refers to an element that doesn't exist");
+		}
+	}
 
-				size_t i = 0;
-				while (polygon.size() > 3) {
-					auto get = [&](auto n) {
-						return polygon[n % polygon.size()];
-					};
-					// Take any point and *ignore* its neighbours.
-					auto a = get(i);
-					auto b = get(i + 1);
-					auto c = get(i + 2);
-					if ((b.first - a.first).cross(c.first - a.first).dot(poly_norm) < 0) {
-						goto skip;
-					}
-					// Check if any other point is inside the triangle.
-					for (size_t k = 0; k < polygon.size(); k++) {
-						if (k != i && k != (i + 1) % polygon.size() && k != (i + 2) % polygon.size()) {
-							auto pq = calc_pq(a.first, b.first, c.first, get(k).first);
-							if ((0 <= pq.x && pq.x <= 1) && (0 <= pq.y && pq.y <= 1)) {
-								goto skip;
-							}
-						}
-					}
-					// No other point lies in the triangle and it faces in the right direction.
-					shape.faces.push_back({ a.second, b.second, c.second });
-					polygon.erase(polygon.begin() + (i + 1) % polygon.size());
-				skip:
-					if (++i >= polygon.size()) {
-						i = 0;
-					}
+	// Number the triples in order of first use, as if the file was read front to back.
+	vector<Triple> triples;
+	if (chunks.size() == 1) {
+		triples = move(chunks[0].uniques);
+	} else {
+		TripleMap global;
+		size_t uniques = 0;
+		for (auto &c : chunks) {
+			uniques += c.uniques.size();
+		}
+		global.reserve(uniques);
+		vector<vector<unsigned int>> remap(chunks.size());
+		for (size_t i = 0; i < chunks.size(); i++) {
+			auto &c = chunks[i];
+			remap[i].reserve(c.uniques.size());
+			for (size_t k = 0; k < c.uniques.size(); k++) {
+				if (k + TRIPLE_PREFETCH < c.uniques.size()) {
+					global.prefetch(c.uniques[k + TRIPLE_PREFETCH]);
 				}
+				remap[i].push_back(global.find_or_insert(c.uniques[k]).first);
 			}
-			// Push the final triangle.
-			shape.faces.push_back({ polygon[0].second, polygon[1].second, polygon[2].second });
-		} else if (*it == "p") {
-			// We don't support points so just skip.
-			continue;
-		} else if (*it == "l") {
-			// Ditto but lines
-			continue;
-		} else if (*it == "s" || *it == "g") {
-			// Ignore anything group-related for now.
-			continue;
-		} else if (*it == "usemtl") {
-			auto s = next_string();
-			usemtl.swap(s);
-			if (!s.empty() && s != usemtl) {
-				throw WavefrontParseException(line_i, "multiple different materials are not supported");
+			c.uniques = {};
+		}
+		triples = global.take();
+		pool.run(chunks.size(), [&](size_t i) {
+			for (auto &id : chunks[i].ids) {
+				id = remap[i][id];
 			}
-		} else if (*it == "mtllib") {
-			if (!mtllib.empty()) {
-				throw WavefrontParseException(line_i, "only one mtllib can be loaded");
+		});
+	}
+
+	// Triangulate
+	pool.run(chunks.size(), [&](size_t i) {
+		auto &c = chunks[i];
+		c.faces.reserve(c.verts.size() - 2 * (c.polygons.size() - 1));
+		vector<pair<Point3D, unsigned int>> polygon;
+		for (size_t p = 0; p + 1 < c.polygons.size(); p++) {
+			auto from = c.polygons[p], to = c.polygons[p + 1];
+			if (to - from == 3) {
+				c.faces.push_back({ c.ids[from], c.ids[from + 1], c.ids[from + 2] });
+				continue;
 			}
-			mtllib = next_string();
-		} else if (it->size() > 0 && it->front() == '#') {
-			continue; // Skip no_next() at the end.
-		} else {
-			throw WavefrontParseException(line_i, "unknown keyword '" + *it + "'");
+			for (auto k = from; k < to; k++) {
+				polygon.push_back({ points[c.verts[k].pi - 1], c.ids[k] });
+			}
+			triangulate(polygon, c.faces);
 		}
-		no_next();
+		c.verts = {};
+		c.ids = {};
+	});
+	size_t faces_count = 0;
+	for (auto &c : chunks) {
+		faces_count += c.faces.size();
+	}
+	shape.faces.reserve(shape.faces.size() + faces_count);
+	for (auto &c : chunks) {
+		shape.faces.insert(shape.faces.end(), c.faces.begin(), c.faces.end());
+		c.faces = {};
 	}
 
 	// Construct actual vertexes from face triples.
 	if (triples.empty()) {
 		return;
 	}
-	bool has_uv = triples.begin()->first.ti != 0, has_normals = triples.begin()->first.ni != 0;
+	bool has_uv = triples[0].ti != 0, has_normals = triples[0].ni != 0;
 	shape.points.resize(triples.size());
 	shape.uvs.resize(has_uv ? triples.size() : 0);
 	shape.normals.resize(has_normals ? triples.size() : 0);
-	for (auto [t, i] : triples) {
-		assert(i < triples.size());
-		assert(t.pi != 0);
-		shape.points[i] = points.at(t.pi > 0 ? t.pi - 1 : points.size() + t.pi);
+	for (size_t i = 0; i < triples.size(); i++) {
+		auto t = triples[i];
+		shape.points[i] = points[t.pi - 1];
 		if (has_uv) {
 			assert(t.ti != 0);
-			shape.uvs[i] = uvs.at(t.ti > 0 ? t.ti - 1 : uvs.size() + t.ti);
+			shape.uvs[i] = uvs[t.ti - 1];
 		}
 		if (has_normals) {
 			assert(t.ni != 0);
-			shape.normals[i] = normals.at(t.ni > 0 ? t.ni - 1 : normals.size() + t.ni);
+			shape.normals[i] = normals[t.ni - 1];
 		}
 	}
 	point_normals = has_normals;
+	ref = { mtllib, usemtl };
+
+	log_stream() << "Done parsing" << endl;
+}
 
-	// Parse material if any is provided
+void wavefront_material(const WavefrontMaterialRef &ref, Material &mat) {
+	auto &mtllib = ref.mtllib;
+	auto &usemtl = ref.usemtl;
 	if (mtllib != "" && usemtl != "") {
-		ifstream f(mtllib);
-		
+		util::MappedFile file(mtllib);
+		auto rest = file.view();
+		string_view line;
+
 		// Find proper material
 		unsigned int line_i = 0;
-		while (getline(f, line)) {
+		while (next_line(rest, line)) {
 			line_i++;
-			istringstream s(line);
-			istream_iterator<string> it(s);
-			auto end = istream_iterator<string>();
-			if (it == end || *it != "newmtl") {
-				continue;
+			if (next_token(line) == "newmtl" && next_token(line) == usemtl) {
+				goto found;
 			}
-			goto found;
 		}
 		throw WavefrontParseException(0, "material " + usemtl + " not found");
 	found:
 
-		while (getline(f, line)) {
+		while (next_line(rest, line)) {
 			line_i++;
-			istringstream s(line);
-			istream_iterator<string> it(s);
-			auto end = istream_iterator<string>();
-			if (it == end && *it == "newmtl") {
+			auto keyword = next_token(line);
+			if (keyword == "newmtl") {
 				break;
 			}
 
 			auto next_string = [&]() {
-				++it;
-				if (it == end) {
+				auto tok = next_token(line);
+				if (tok.empty()) {
 					throw WavefrontParseException(line_i, "expected token");
 				}
-				return *it;
+				return tok;
 			};
 			auto next_double = [&]() {
-				return stod(next_string());
+				auto tok = next_string();
+				double v;
+				if (!parse_number(tok, v)) {
+					throw WavefrontParseException(line_i, "invalid number '" + string(tok) + "'");
+				}
+				return v;
 			};
 			auto no_next = [&]() {
-				++it;
-				if (it != end) {
+				if (!next_token(line).empty()) {
 					throw WavefrontParseException(line_i, "too many tokens");
 				}
 			};
 
-			if (*it == "Ka" || *it == "Kd" || *it == "Ks") {
-				char t = (*it)[1];
+			if (keyword == "Ka" || keyword == "Kd" || keyword == "Ks") {
+				char t = keyword[1];
 				auto r = next_double();
 				auto g = next_double();
 				auto b = next_double();
@@ -308,17 +734,14 @@ void wavefront(const std::string &path, FaceShape &shape, Material &mat, bool &p
 				case 's': mat.specular = { r, g, b }; break;
 				default: UNREACHABLE;
 				}
-			} else if (*it == "Ns") {
+			} else if (keyword == "Ns") {
 				mat.reflection = next_double();
-			} else if (*it == "map_Ka" || *it == "map_Kd" || *it == "map_Ks") {
+			} else if (keyword == "map_Ka" || keyword == "map_Kd" || keyword == "map_Ks") {
 				// TODO do we need to support per-light type textures? It seems
 				// excessive...
-				auto path = next_string();
+				string path(next_string());
 				if (!mat.texture.has_value()) {
-					img::EasyImage img;
-					ifstream f(path);
-					f >> img;
-					mat.texture.emplace(Texture(std::move(img)));
+					mat.texture.emplace(Texture::load(path));
 				}
 			} else {
 				// TODO we shouldn't ignore other properties.
@@ -327,8 +750,12 @@ void wavefront(const std::string &path, FaceShape &shape, Material &mat, bool &p
 			no_next();
 		}
 	}
+}
 
-	cout << "Done parsing" << endl;
+void wavefront(const string &path, FaceShape &shape, Material &mat, bool &point_normals) {
+	WavefrontMaterialRef ref;
+	wavefront_mesh(path, shape, point_normals, ref);
+	wavefront_material(ref, mat);
 }
 
 void wavefront(const Configuration &conf, FaceShape &shape, Material &mat, bool &point_normals) {
@@ -0,0 +1,120 @@
+#include "thread_pool.h"
+#include <cstdlib>
+
+namespace engine {
+namespace util {
+
+using namespace std;
+
+static atomic<unsigned int> default_threads(0);
+
+ThreadPool::ThreadPool(unsigned int threads) : next(0) {
+	threads = resolve(threads);
+	workers.reserve(threads - 1);
+	for (unsigned int i = 1; i < threads; i++) {
+		workers.emplace_back([this]() { work(); });
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> l(lock);
+		stop = true;
+	}
+	wake.notify_all();
+	for (auto &w : workers) {
+		w.join();
+	}
+}
+
+unsigned int ThreadPool::resolve(unsigned int threads) {
+	auto env = getenv("CGENGINE_THREADS");
+	if (env != nullptr && *env != '\0') {
+		threads = (unsigned int)strtoul(env, nullptr, 10);
+	}
+	if (threads == 0) {
+		threads = default_threads;
+	}
+	if (threads == 0) {
+		threads = thread::hardware_concurrency();
+	}
+	// hardware_concurrency() may return 0 if it can't figure it out.
+	return threads > 0 ? threads : 1;
+}
+
+void ThreadPool::set_default_threads(unsigned int threads) {
+	default_threads = threads;
+}
+
+void ThreadPool::drain() {
+	for (size_t i; (i = next.fetch_add(1)) < job_size;) {
+		try {
+			(*job)(i);
+		} catch (...) {
+			lock_guard<mutex> l(lock);
+			if (!error) {
+				error = current_exception();
+			}
+			// Make everyone skip the remaining tasks.
+			next = job_size;
+		}
+	}
+}
+
+void ThreadPool::work() {
+	unsigned int seen = 0;
+	for (;;) {
+		{
+			unique_lock<mutex> l(lock);
+			wake.wait(l, [&]() { return stop || generation != seen; });
+			if (stop) {
+				return;
+			}
+			seen = generation;
+		}
+		drain();
+		{
+			lock_guard<mutex> l(lock);
+			if (--active == 0) {
+				done.notify_all();
+			}
+		}
+	}
+}
+
+void ThreadPool::run(size_t n, const function<void(size_t)> &f) {
+	if (workers.empty() || n <= 1) {
+		for (size_t i = 0; i < n; i++) {
+			f(i);
+		}
+		return;
+	}
+
+	{
+		lock_guard<mutex> l(lock);
+		job = &f;
+		job_size = n;
+		next = 0;
+		active = workers.size();
+		error = nullptr;
+		generation++;
+	}
+	wake.notify_all();
+
+	drain();
+
+	exception_ptr e;
+	{
+		unique_lock<mutex> l(lock);
+		done.wait(l, [&]() { return active == 0; });
+		job = nullptr;
+		e = error;
+		error = nullptr;
+	}
+	if (e) {
+		rethrow_exception(e);
+	}
+}
+
+}
+}
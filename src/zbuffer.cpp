@@ -1,13 +1,175 @@
 #include "zbuffer.h"
 #include <algorithm>
+#include <cmath>
 #include "engine.h"
 #include "math/point3d.h"
 #include "math/vector3d.h"
 
+#if GRAPHICS_RASTER_HALFSPACE && (defined(__AVX__) || defined(__SSE2__))
+# include <immintrin.h>
+#endif
+
 namespace engine {
 
 using namespace std;
 
+#if GRAPHICS_RASTER_HALFSPACE
+
+/**
+ * \brief Width & height of the blocks that are accepted or rejected as a whole.
+ */
+#define HALFSPACE_BLOCK (4)
+
+/**
+ * \brief Edge function of a non-horizontal edge going up from p to q.
+ *
+ * It is positive for points right of the edge.
+ */
+struct EdgeFunction {
+	double px, py, dx, dy;
+	// Margin to account for rounding errors when classifying whole blocks.
+	double margin;
+	bool left;
+
+	EdgeFunction() = default;
+
+	EdgeFunction(Point3D p, Point3D q, bool left)
+		: px(p.x), py(p.y), dx(q.x - p.x), dy(q.y - p.y), margin((abs(q.x - p.x) + abs(q.y - p.y)) * 1e-9), left(left)
+	{}
+
+	ALWAYS_INLINE double operator ()(double x, double y) const {
+		return (x - px) * dy - (y - py) * dx;
+	}
+
+	/**
+	 * \brief Whether the value of this function at a point means the point is inside.
+	 *
+	 * Points exactly on a left edge are outside, points on a right edge are inside. This
+	 * matches the scanline rasterizer.
+	 */
+	ALWAYS_INLINE bool inside(double e) const {
+		return left ? e > 0 : e <= 0;
+	}
+
+	/**
+	 * \brief Check on which side of this edge a square block of pixels lies.
+	 *
+	 * Edge functions are linear, so the range of values inside a block tells whether it
+	 * lies entirely inside or outside the edge.
+	 *
+	 * \param x, y Bottom-left pixel of the block.
+	 * \param size Width & height of the block.
+	 * \param all_outside Set if no pixel of the block is inside.
+	 * \param some_outside Set if any pixel of the block may be outside.
+	 */
+	ALWAYS_INLINE void classify(double x, double y, double size, bool &all_outside, bool &some_outside) const {
+		auto v = (*this)(x, y);
+		auto n = size - 1;
+		bool lo = inside(v + min(0.0, n * dy) + min(0.0, -n * dx) - margin);
+		bool hi = inside(v + max(0.0, n * dy) + max(0.0, -n * dx) + margin);
+		all_outside |= !lo && !hi;
+		some_outside |= !lo || !hi;
+	}
+};
+
+/**
+ * \brief Depth test & update a row of HALFSPACE_BLOCK pixels starting at (x, y).
+ *
+ * \param row Pointer to the depth value of the first pixel.
+ * \param partial Whether the pixels need to be tested against the edges.
+ * \param z0 1/Z value at x = g_x on this row.
+ *
+ * \return Bitmask of pixels whose depth value got replaced.
+ */
+static ALWAYS_INLINE unsigned int depth_test_row(
+	ZBuffer::depth_t *row,
+	double x, double y,
+	const EdgeFunction *edges, unsigned int edges_count, bool partial,
+	double z0, double g_x, double dzdx
+) {
+#if defined(__AVX__)
+	static_assert(HALFSPACE_BLOCK == 4);
+	auto xs = _mm256_add_pd(_mm256_set1_pd(x), _mm256_set_pd(3, 2, 1, 0));
+	auto inside = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+	if (partial) {
+		for (unsigned int i = 0; i < edges_count; i++) {
+			auto &e = edges[i];
+			auto v = _mm256_sub_pd(
+				_mm256_mul_pd(_mm256_sub_pd(xs, _mm256_set1_pd(e.px)), _mm256_set1_pd(e.dy)),
+				_mm256_set1_pd((y - e.py) * e.dx)
+			);
+			inside = _mm256_and_pd(inside, e.left
+				? _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_GT_OQ)
+				: _mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_LE_OQ)
+			);
+		}
+	}
+	auto inv_z = _mm256_add_pd(
+		_mm256_set1_pd(z0),
+		_mm256_mul_pd(_mm256_sub_pd(xs, _mm256_set1_pd(g_x)), _mm256_set1_pd(dzdx))
+	);
+#if GRAPHICS_ZBUFFER_COMPACT
+	auto cur = _mm256_cvtps_pd(_mm_loadu_ps(row));
+#else
+	auto cur = _mm256_loadu_pd(row);
+#endif
+	auto lower = _mm256_and_pd(inside, _mm256_cmp_pd(cur, inv_z, _CMP_GT_OQ));
+#if GRAPHICS_ZBUFFER_COMPACT
+	_mm_storeu_ps(row, _mm256_cvtpd_ps(_mm256_blendv_pd(cur, inv_z, lower)));
+#else
+	_mm256_storeu_pd(row, _mm256_blendv_pd(cur, inv_z, lower));
+#endif
+	return _mm256_movemask_pd(lower);
+#elif defined(__SSE2__) && !GRAPHICS_ZBUFFER_COMPACT
+	static_assert(HALFSPACE_BLOCK % 2 == 0);
+	unsigned int mask = 0;
+	for (unsigned int k = 0; k < HALFSPACE_BLOCK; k += 2) {
+		auto xs = _mm_add_pd(_mm_set1_pd(x + k), _mm_set_pd(1, 0));
+		auto inside = _mm_castsi128_pd(_mm_set1_epi64x(-1));
+		if (partial) {
+			for (unsigned int i = 0; i < edges_count; i++) {
+				auto &e = edges[i];
+				auto v = _mm_sub_pd(
+					_mm_mul_pd(_mm_sub_pd(xs, _mm_set1_pd(e.px)), _mm_set1_pd(e.dy)),
+					_mm_set1_pd((y - e.py) * e.dx)
+				);
+				inside = _mm_and_pd(inside, e.left
+					? _mm_cmpgt_pd(v, _mm_setzero_pd())
+					: _mm_cmple_pd(v, _mm_setzero_pd())
+				);
+			}
+		}
+		auto inv_z = _mm_add_pd(
+			_mm_set1_pd(z0),
+			_mm_mul_pd(_mm_sub_pd(xs, _mm_set1_pd(g_x)), _mm_set1_pd(dzdx))
+		);
+		auto cur = _mm_loadu_pd(row + k);
+		auto lower = _mm_and_pd(inside, _mm_cmpgt_pd(cur, inv_z));
+		_mm_storeu_pd(row + k, _mm_or_pd(_mm_and_pd(lower, inv_z), _mm_andnot_pd(lower, cur)));
+		mask |= (unsigned int)_mm_movemask_pd(lower) << k;
+	}
+	return mask;
+#else
+	unsigned int mask = 0;
+	for (unsigned int k = 0; k < HALFSPACE_BLOCK; k++) {
+		bool inside = true;
+		if (partial) {
+			for (unsigned int i = 0; i < edges_count; i++) {
+				inside &= edges[i].inside(edges[i](x + k, y));
+			}
+		}
+		auto inv_z = z0 + (x + k - g_x) * dzdx;
+		if (inside && row[k] > inv_z) {
+			row[k] = inv_z;
+			mask |= 1 << k;
+		}
+	}
+	return mask;
+#endif
+}
+
+#else
+
 /**
  * \brief Find intersections
  */
@@ -15,17 +177,117 @@ static ALWAYS_INLINE double f(double y, Point3D p, Point3D q) {
 	return q.x + (p.x - q.x) * (y - q.y) / (p.y - q.y);
 };
 
+/**
+ * \brief Clamp the inclusive range [from, to] to [lo, hi).
+ *
+ * Triangles in the guard band may go far outside the image, so this must be done before
+ * converting to integers.
+ *
+ * \return false if nothing is left, in which case out_from is larger than out_to.
+ */
+static ALWAYS_INLINE bool scissor(
+	double from, double to,
+	unsigned int lo, unsigned int hi,
+	unsigned int &out_from, unsigned int &out_to
+) {
+	from = max(from, (double)lo);
+	to = min(to, hi - 1.0);
+	// Also catches NaNs
+	if (!(from <= to)) {
+		out_from = 1;
+		out_to = 0;
+		return false;
+	}
+	out_from = (unsigned int)from;
+	out_to = (unsigned int)to;
+	return true;
+}
+
+#endif
+
+/**
+ * \brief Relative error allowed on the nearest 1/Z value of a triangle.
+ *
+ * The interpolated values may stray slightly outside the values at the corners due to
+ * rounding errors.
+ */
+#define HIZ_EPSILON (1e-9)
+
+double ZBuffer::refresh_fine(unsigned int bx, unsigned int by) {
+	auto i = hiz_fine.index(bx, by);
+	if (hiz_fine.dirty[i]) {
+		double m = -numeric_limits<double>::infinity();
+		for (unsigned int y = by; y < min(by + HIZ_FINE, height); y++) {
+			for (unsigned int x = bx; x < min(bx + HIZ_FINE, width); x++) {
+				m = max(m, (double)buffer[x + y * width]);
+			}
+		}
+		hiz_fine.max[i] = m;
+		hiz_fine.dirty[i] = 0;
+	}
+	return hiz_fine.max[i];
+}
+
+double ZBuffer::refresh_coarse(unsigned int bx, unsigned int by) {
+	auto i = hiz_coarse.index(bx, by);
+	if (hiz_coarse.dirty[i]) {
+		// Don't bother refreshing the fine blocks, most of them won't be needed.
+		double m = -numeric_limits<double>::infinity();
+		for (unsigned int y = by; y < min(by + HIZ_COARSE, height); y += HIZ_FINE) {
+			for (unsigned int x = bx; x < min(bx + HIZ_COARSE, width); x += HIZ_FINE) {
+				m = max(m, hiz_fine.max[hiz_fine.index(x, y)]);
+			}
+		}
+		hiz_coarse.max[i] = m;
+		hiz_coarse.dirty[i] = 0;
+	}
+	return hiz_coarse.max[i];
+}
+
+bool ZBuffer::occluded(unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1, double inv_z) {
+	// The pyramid is in the coordinates of the buffer.
+	y0 -= origin_y;
+	y1 -= origin_y;
+	assert(x0 <= x1 && x1 < width);
+	assert(y0 <= y1 && y1 < height);
+	for (unsigned int cy = y0 / HIZ_COARSE * HIZ_COARSE; cy <= y1; cy += HIZ_COARSE) {
+		for (unsigned int cx = x0 / HIZ_COARSE * HIZ_COARSE; cx <= x1; cx += HIZ_COARSE) {
+			// A stale maximum is still an upper bound, so only refresh if it's not good enough.
+			auto i = hiz_coarse.index(cx, cy);
+			if (hiz_coarse.max[i] <= inv_z || refresh_coarse(cx, cy) <= inv_z) {
+				continue;
+			}
+			// Only part of the coarse block may be covered, so check the finer blocks.
+			auto fy0 = max(cy, y0 / HIZ_FINE * HIZ_FINE), fy1 = min(cy + HIZ_COARSE - 1, y1);
+			auto fx0 = max(cx, x0 / HIZ_FINE * HIZ_FINE), fx1 = min(cx + HIZ_COARSE - 1, x1);
+			for (unsigned int fy = fy0; fy <= fy1; fy += HIZ_FINE) {
+				for (unsigned int fx = fx0; fx <= fx1; fx += HIZ_FINE) {
+					auto k = hiz_fine.index(fx, fy);
+					if (!(hiz_fine.max[k] <= inv_z || refresh_fine(fx, fy) <= inv_z)) {
+						return false;
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
 template<typename F>
-void ZBuffer::triangle(
+bool ZBuffer::triangle(
 	Point3D a, Point3D b, Point3D c,
 	double d, Vector2D offset,
 	double bias,
+	const render::TileGrid::Tile &clip,
 	F callback
 ) {
 	// Find repricoral Z-values first, which require unprojected points
 	// Optimized version of 1 / (3 * a.z) + 1 / (3 * b.z) + 1 / (3 * c.z)
 	// The former will emit 3 div instructions even with -Ofast
 	double inv_g_z = (b.z * c.z + a.z * c.z + a.z * b.z) / (3 * a.z * b.z * c.z);
+	// Interpolation between the corners can't go below the smallest 1/Z of the corners.
+	double near_z = min({ 1 / a.z, 1 / b.z, 1 / c.z }) + inv_g_z * (bias - 1);
+	near_z -= abs(near_z) * HIZ_EPSILON;
 	double dzdx, dzdy;
 	{
 		auto w = (b - a).cross(c - a);
@@ -36,9 +298,9 @@ void ZBuffer::triangle(
 	inv_g_z *= bias;
 	
 	// Project
-	a.x = a.x * (d / -a.z) + offset.x, a.y = a.y * (d / -a.z) + offset.y;
-	b.x = b.x * (d / -b.z) + offset.x, b.y = b.y * (d / -b.z) + offset.y;
-	c.x = c.x * (d / -c.z) + offset.x, c.y = c.y * (d / -c.z) + offset.y;
+	a = project(a, d, offset);
+	b = project(b, d, offset);
+	c = project(c, d, offset);
 
 	// These center coordaintes must be projected.
 	double g_x = (a.x + b.x + c.x) / 3;
@@ -56,14 +318,118 @@ void ZBuffer::triangle(
 	assert(isnan(p) || p <= 1);
 	bool b_left = b.x < a.x * (1 - p) + c.x * p;
 
+	// Skip the triangle if everything it covers is already closer.
+	{
+		// The scanline rasterizer may go a pixel beyond the corners due to rounding errors.
+		double min_y = max(floor(a.y) + 1, (double)clip.y0);
+		double max_y = min(floor(c.y), clip.y1 - 1.0);
+		double min_x = max(floor(min({ a.x, b.x, c.x })) - 1, (double)clip.x0);
+		double max_x = min(floor(max({ a.x, b.x, c.x })) + 1, clip.x1 - 1.0);
+		if (min_y <= max_y && min_x <= max_x && occluded(min_x, min_y, max_x, max_y, near_z)) {
+			return false;
+		}
+	}
+
+#if GRAPHICS_RASTER_HALFSPACE
+	// Degenerate (or invalid) triangles don't cover any rows.
+	if (!(a.y < c.y)) {
+		return true;
+	}
+
+	// Horizontal edges are handled by the Y bounds instead.
+	EdgeFunction edges[3];
+	unsigned int edges_count = 0;
+	auto add_edge = [&](Point3D p, Point3D q, bool left) {
+		if (p.y != q.y) {
+			edges[edges_count++] = EdgeFunction(p, q, left);
+		}
+	};
+	add_edge(a, c, !b_left);
+	add_edge(a, b, b_left);
+	add_edge(b, c, b_left);
+
+	// Same Y bounds as the scanline rasterizer, X bounds are conservative.
+	double min_y = max(floor(a.y) + 1, (double)clip.y0);
+	double max_y = min(floor(c.y), clip.y1 - 1.0);
+	double min_x = max(floor(min({ a.x, b.x, c.x })), (double)clip.x0);
+	double max_x = min(floor(max({ a.x, b.x, c.x })), clip.x1 - 1.0);
+	if (!(min_y <= max_y && min_x <= max_x)) {
+		return true;
+	}
+	unsigned int from_y = min_y, to_y = max_y;
+	unsigned int from_x = min_x, to_x = max_x;
+
+	// Classify coarse blocks first so large triangles don't have to check every small block.
+	const unsigned int n = HALFSPACE_BLOCK, m = HALFSPACE_BLOCK * 4;
+	// Not worth it for triangles that fit in a single coarse block anyways.
+	bool small = to_x - from_x < m && to_y - from_y < m;
+	for (unsigned int cy = from_y / m * m; cy <= to_y; cy += m) {
+		for (unsigned int cx = from_x / m * m; cx <= to_x; cx += m) {
+			bool coarse_reject = false, coarse_partial = small;
+			for (unsigned int i = 0; i < edges_count && !small; i++) {
+				edges[i].classify(cx, cy, m, coarse_reject, coarse_partial);
+			}
+			if (coarse_reject) {
+				continue;
+			}
+
+			for (unsigned int by = max(cy, from_y / n * n); by <= min(cy + m - 1, to_y); by += n) {
+				for (unsigned int bx = max(cx, from_x / n * n); bx <= min(cx + m - 1, to_x); bx += n) {
+					bool reject = false, partial = false;
+					if (coarse_partial) {
+						for (unsigned int i = 0; i < edges_count; i++) {
+							edges[i].classify(bx, by, n, reject, partial);
+						}
+						if (reject) {
+							continue;
+						}
+					}
+
+					for (unsigned int y = max(by, from_y); y <= min(by + n - 1, to_y); y++) {
+						auto dy = (y - g_y) * dzdy;
+						if (clip.x0 <= bx && bx + n <= clip.x1) {
+							auto mask = depth_test_row(
+								buffer.data() + index(bx, y),
+								bx, y,
+								edges, edges_count, partial,
+								inv_g_z + dy, g_x, dzdx
+							);
+							if (mask > 0) {
+								touch(bx, y);
+							}
+							for (unsigned int i = 0; mask > 0; i++, mask >>= 1) {
+								if ((mask & 1) > 0) {
+									callback(bx + i, y);
+								}
+							}
+						} else {
+							// Block sticks out of the clip region, so don't touch pixels that may
+							// belong to another tile.
+							for (unsigned int x = max(bx, from_x); x <= min(bx + n - 1, to_x); x++) {
+								bool inside = true;
+								for (unsigned int i = 0; i < edges_count; i++) {
+									inside &= edges[i].inside(edges[i](x, y));
+								}
+								auto inv_z = inv_g_z + dy + (x - g_x) * dzdx;
+								if (inside && replace(x, y, inv_z)) {
+									callback(x, y);
+								}
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+#else
 	// Start from bottom to middle
 	{
 		// 1.0 --> round(1.5) --> 2.0
 		// 1.9 --> floor(2.9) --> 2.0
-		unsigned int from_y = (unsigned int)a.y + 1;
 		// 1.0 --> round(0.5) --> 1.0
 		// 1.0 --> floor(1.0) --> 1.0
-		unsigned int to_y = b.y;
+		unsigned int from_y, to_y;
+		scissor(trunc(a.y) + 1, trunc(b.y), clip.y0, clip.y1, from_y, to_y);
 	
 		for (unsigned int y = from_y; y <= to_y; y++) {
 			// Find intersections
@@ -72,12 +438,14 @@ void ZBuffer::triangle(
 			// X bounds
 			double x_min = b_left ? ab : ac;
 			double x_max = b_left ? ac : ab;
-			unsigned int from_x = (unsigned int)x_min + 1;
-			unsigned int to_x   = x_max;
 			// If x_min and x_max are very close to each other (or even x_min > x_max
 			// by a small epsilon) from_x may be 1 higher than to_x. In this case nothing
 			// gets rendered which is the expected behaviour.
-			assert(from_x <= to_x + 1);
+			assert(!(trunc(x_min) > trunc(x_max)));
+			unsigned int from_x, to_x;
+			if (!scissor(trunc(x_min) + 1, trunc(x_max), clip.x0, clip.x1, from_x, to_x)) {
+				continue;
+			}
 
 			auto dy = (y - g_y) * dzdy;
 			for (unsigned int x = from_x; x <= to_x; x++) {
@@ -91,8 +459,8 @@ void ZBuffer::triangle(
 
 	// Now middle to top
 	{
-		unsigned int from_y = (unsigned int)b.y + 1;
-		unsigned int to_y = c.y;
+		unsigned int from_y, to_y;
+		scissor(trunc(b.y) + 1, trunc(c.y), clip.y0, clip.y1, from_y, to_y);
 	
 		for (unsigned int y = from_y; y <= to_y; y++) {
 			double ac = f(y, a, c), bc = f(y, b, c);
@@ -100,9 +468,11 @@ void ZBuffer::triangle(
 			// X bounds
 			double x_min = b_left ? bc : ac;
 			double x_max = b_left ? ac : bc;
-			unsigned int from_x = (unsigned int)x_min + 1;
-			unsigned int to_x   = x_max;
-			assert(from_x <= to_x + 1); // Ditto
+			assert(!(trunc(x_min) > trunc(x_max))); // Ditto
+			unsigned int from_x, to_x;
+			if (!scissor(trunc(x_min) + 1, trunc(x_max), clip.x0, clip.x1, from_x, to_x)) {
+				continue;
+			}
 
 			auto dy = (y - g_y) * dzdy;
 			for (unsigned int x = from_x; x <= to_x; x++) {
@@ -113,16 +483,29 @@ void ZBuffer::triangle(
 			}
 		}
 	}
+#endif
+	return true;
 }
 
-void ZBuffer::triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, double bias) {
-	triangle(a, b, c, d, offset, bias, [](auto, auto) {});
+bool ZBuffer::triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, double bias) {
+	return triangle(a, b, c, d, offset, bias, { 0, origin_y, width, origin_y + height }, [](auto, auto) {});
 }
 
-void TaggedZBuffer::triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, IdPair pair, double bias) {
-	ZBuffer::triangle(a, b, c, d, offset, bias, [this, &pair](auto x, auto y) {
-		figure_ids[x + y * get_width()] = pair.figure_id;
-		triangle_ids[x + y * get_width()] = pair.triangle_id;
+bool TaggedZBuffer::triangle(Point3D a, Point3D b, Point3D c, double d, Vector2D offset, IdPair pair, double bias) {
+	size_t writes = 0;
+	return triangle(a, b, c, d, offset, pair, bias, { 0, get_origin_y(), get_width(), get_origin_y() + get_height() }, writes);
+}
+
+bool TaggedZBuffer::triangle(
+	Point3D a, Point3D b, Point3D c,
+	double d, Vector2D offset,
+	IdPair pair, double bias,
+	const render::TileGrid::Tile &clip,
+	size_t &writes
+) {
+	return ZBuffer::triangle(a, b, c, d, offset, bias, clip, [this, &pair, &writes](auto x, auto y) {
+		writes++;
+		store_id(index(x, y), pair);
 	});
 }
 